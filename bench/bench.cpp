@@ -0,0 +1,707 @@
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "App.hpp"
+#include "Channel.hpp"
+#include "Client.hpp"
+#include "IRCReply.hpp"
+#include "Mask.hpp"
+#include "MaskList.hpp"
+#include "Transport.hpp"
+#include "connection.hpp"
+
+/*
+Microbenchmarks for the functions on the message path.
+
+	make bench
+	./ircserv_bench                      > baseline.tsv
+	./ircserv_bench --baseline baseline.tsv
+
+Output is tab separated: name, ns/op, allocations/op, iterations. With
+--baseline the old values and the change are appended to each line, and
+the exit status is 1 if any benchmark got slower by more than the
+threshold (--threshold, in percent, default 10) or allocates more.
+--filter <substring> runs a subset. Each benchmark is timed --repeat
+times (default 5) over at least --min-time milliseconds (default 100),
+and the fastest run is reported.
+
+The last line gives the heap bytes per idle connection; going over
+idle_client_budget also makes the exit status 1.
+*/
+
+
+// ============================
+//     Allocation counting
+// ============================
+
+static unsigned long g_allocs = 0;
+static long g_live_bytes = 0;
+
+/* room before each block for its size, keeping malloc's alignment */
+static size_t const alloc_header = 16;
+
+/* Results are summed here so the compiler cannot drop the calls. */
+static volatile unsigned long g_sink = 0;
+
+/* GCC sees malloc/free behind the replaced operators and warns once it inlines them. */
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+
+void *operator new(size_t size) throw(std::bad_alloc)
+{
+	char *p;
+
+	g_allocs++;
+	p = static_cast<char *>(std::malloc(alloc_header + size));
+	if (!p)
+		throw std::bad_alloc();
+	*reinterpret_cast<size_t *>(p) = size;
+	g_live_bytes += size;
+	return p + alloc_header;
+}
+
+void operator delete(void *p) throw()
+{
+	if (!p)
+		return ;
+	p = static_cast<char *>(p) - alloc_header;
+	g_live_bytes -= *static_cast<size_t *>(p);
+	std::free(p);
+}
+
+
+// ============================
+//          Fixture
+// ============================
+
+/*
+Replies and log lines are written to std::cout; the fixture points it at
+a sink so that only results reach the real stdout. The App runs on an
+in-memory transport. Most clients have no connection (fd -1), so their
+sends fail without side effects; the sim/ benchmarks give theirs one.
+*/
+class Fixture
+{
+	public:
+		MemoryTransport transport;
+		App app;
+		Client *user;
+		Channel *small_channel;
+		Channel *big_channel;
+		Message msg;
+		std::vector<std::string> params;
+		std::map<std::string, std::string> info;
+
+		Fixture() : app("127.0.0.1", "password", Config())
+		{
+			app.transport = &transport;
+			user = add_user("alice");
+			small_channel = make_channel("#small", 10);
+			big_channel = make_channel("#big", 1000);
+		}
+
+		Client *add_user(std::string const &nick, int fd = -1)
+		{
+			Client *client = new Client(app, fd);
+			std::vector<std::string> p;
+
+			app.add_client(client);
+			p.push_back("password");
+			client->pass(p);
+			p[0] = nick;
+			client->nick(p);
+			p[0] = nick;
+			p.push_back("0");
+			p.push_back("*");
+			p.push_back(":Real Name");
+			client->user(p);
+			return client;
+		}
+
+		Channel *make_channel(std::string const &name, int members)
+		{
+			Channel *channel = app.create_channel(name);
+			std::ostringstream nick;
+
+			app.add_channel(channel);
+			channel->add_client(user, true);
+			for (int i = 1; i < members; i++)
+			{
+				nick.str("");
+				nick << name.substr(1, 1) << i;
+				channel->add_client(add_user(nick.str()), false);
+			}
+			return channel;
+		}
+};
+
+
+// ============================
+//         Benchmarks
+// ============================
+
+typedef void (*bench_func)(Fixture &f, std::string const &input, size_t iterations);
+
+struct Benchmark
+{
+	char const *name;
+	bench_func func;
+	std::string input;
+};
+
+static Benchmark make_bench(char const *name, bench_func func, std::string const &input)
+{
+	Benchmark bench;
+
+	bench.name = name;
+	bench.func = func;
+	bench.input = input;
+	return bench;
+}
+
+static void bench_parse_message(Fixture &f, std::string const &input, size_t iterations)
+{
+	for (size_t i = 0; i < iterations; i++)
+		g_sink += f.app.parse_message(*f.user, input, f.msg) + f.msg.params.size();
+}
+
+static void bench_fill_placeholders(Fixture &f, std::string const &input, size_t iterations)
+{
+	for (size_t i = 0; i < iterations; i++)
+	{
+		std::string reply(input);
+		Client::fill_placeholders(reply, f.info);
+		g_sink += reply.size();
+	}
+}
+
+static void bench_code_to_string(Fixture &f, std::string const &input, size_t iterations)
+{
+	IRCReplyCodeEnum code = static_cast<IRCReplyCodeEnum>(std::atoi(input.c_str()));
+
+	(void) f;
+	for (size_t i = 0; i < iterations; i++)
+		g_sink += IRCReply::code_to_string(code).size();
+}
+
+/*
+input is "<modes to set> <modes to unset> <params...>"; iterations
+alternate between the two, so the state flips back and forth and every
+change_mode() call does real work. Both get the same parameters, as
+parse_mode() expects a parameter for every mode that takes one.
+*/
+static void bench_mode(Fixture &f, std::string const &input, size_t iterations)
+{
+	std::istringstream iss(input);
+	std::vector<std::string> set_params;
+	std::vector<std::string> unset_params;
+	std::string word;
+
+	set_params.push_back(f.small_channel->name);
+	iss >> word;
+	set_params.push_back(word);
+	iss >> word;
+	unset_params = set_params;
+	unset_params[1] = word;
+	while (iss >> word)
+	{
+		set_params.push_back(word);
+		unset_params.push_back(word);
+	}
+	for (size_t i = 0; i < iterations; i++)
+	{
+		std::vector<std::string> const &p = i % 2 ? unset_params : set_params;
+		Channel::chan_mode_delta_t delta;
+		std::vector<std::string> lines;
+
+		f.small_channel->parse_mode(*f.user, p[1], p, delta);
+		f.small_channel->change_mode(delta, lines);
+		g_sink += lines.size();
+	}
+}
+
+static void bench_parse_mode(Fixture &f, std::string const &input, size_t iterations)
+{
+	std::istringstream iss(input);
+	std::vector<std::string> params;
+	std::string word;
+
+	params.push_back(f.small_channel->name);
+	while (iss >> word)
+		params.push_back(word);
+	for (size_t i = 0; i < iterations; i++)
+	{
+		Channel::chan_mode_delta_t delta;
+
+		f.small_channel->parse_mode(*f.user, params[1], params, delta);
+		g_sink += delta.size();
+	}
+}
+
+static void bench_nicks_str(Fixture &f, std::string const &input, size_t iterations)
+{
+	Channel *channel = f.app.find_channel_by_name(input);
+
+	for (size_t i = 0; i < iterations; i++)
+		g_sink += channel->get_client_nicks_str().size();
+}
+
+/*
+A guest joins and leaves the input channel; with "*" it joins both
+fixture channels and leaves them the way a disconnect does.
+*/
+static void bench_membership(Fixture &f, std::string const &input, size_t iterations)
+{
+	Client *guest = f.app.find_client_by_nick("guest");
+
+	if (!guest)
+		guest = f.add_user("guest");
+	for (size_t i = 0; i < iterations; i++)
+	{
+		if (input == "*")
+		{
+			f.small_channel->add_client(guest, false);
+			f.big_channel->add_client(guest, false);
+			guest->remove_channels();
+		}
+		else
+		{
+			Channel *channel = f.app.find_channel_by_name(input);
+
+			channel->add_client(guest, false);
+			channel->remove_client(guest);
+		}
+		g_sink += f.big_channel->get_client_count();
+	}
+}
+
+/*
+NICK/QUIT fanout from alice, who is on #small and #big: one line per
+distinct member.
+*/
+static void bench_send_to_peers(Fixture &f, std::string const &input, size_t iterations)
+{
+	for (size_t i = 0; i < iterations; i++)
+		f.user->send_to_peers(input);
+	g_sink += f.app.fanout_epoch;
+}
+
+/*
+Each iteration is one read handed to run_input(); the allocations are
+what a read costs, the saved partial line included.
+*/
+static void bench_run_input(Fixture &f, std::string const &input, size_t iterations)
+{
+	for (size_t i = 0; i < iterations; i++)
+	{
+		f.app.run_input(*f.user, input.data(), input.size());
+		g_sink += f.user->get_msg_buff().size();
+		f.user->set_msg_buff(NULL, 0);
+	}
+}
+
+/*
+One compiled mask against every fixture user, the inner loop of a WHO
+scan; matching must not allocate.
+*/
+static void bench_mask_match(Fixture &f, std::string const &input, size_t iterations)
+{
+	std::vector<Client *> clients = f.app.get_clients();
+	Mask mask(input);
+
+	for (size_t i = 0; i < iterations; i++)
+	{
+		for (std::vector<Client *>::const_iterator c = clients.begin(); c != clients.end(); c++)
+			g_sink += (*c)->matches(mask);
+	}
+}
+
+/*
+A JOIN check against 5000 bans of the usual shapes: by host, by nick,
+by username and a few with wildcards at both ends.
+*/
+static void bench_ban_check(Fixture &f, std::string const &input, size_t iterations)
+{
+	static MaskList bans;
+
+	(void) f;
+	for (int i = 0; bans.size() == 0 && i < 5000; i++)
+	{
+		std::ostringstream mask;
+
+		if (i % 100 == 0)
+			mask << "*!*spam" << i << "*@*";
+		else if (i % 3 == 0)
+			mask << "*!*@host" << i << ".example.net";
+		else if (i % 3 == 1)
+			mask << "nick" << i << "!*@*";
+		else
+			mask << "*!user" << i << "@*";
+		bans.add(mask.str(), "bench", 0);
+	}
+	for (size_t i = 0; i < iterations; i++)
+		g_sink += bans.matches(input);
+}
+
+/*
+The sim/ benchmarks run whole reads through handle_msg(), from the
+transport's recv() to every reply written back. They come last, as
+their clients would change what the benchmarks above see.
+
+sim/privmsg_channel: a member of a 100-user channel says one line; the
+other members' connections take the output and drop it.
+*/
+static void bench_sim_privmsg(Fixture &f, std::string const &input, size_t iterations)
+{
+	static Client *sender = NULL;
+
+	if (!sender)
+	{
+		sender = f.add_user("sim0", f.transport.open(false));
+		Channel *channel = f.app.create_channel("#sim");
+
+		f.app.add_channel(channel);
+		channel->add_client(sender, true);
+		for (int i = 1; i < 100; i++)
+		{
+			std::ostringstream nick;
+
+			nick << "sim" << i;
+			channel->add_client(f.add_user(nick.str(), f.transport.open(false)), false);
+		}
+	}
+	for (size_t i = 0; i < iterations; i++)
+	{
+		f.transport.feed(sender->get_fd(), input);
+		handle_msg(f.app, sender);
+	}
+	g_sink += f.transport.get_bytes_sent(sender->get_fd());
+}
+
+/*
+A message to a peer whose connection takes 16 bytes per write: it is
+queued, then flushed the way the event loop does on write readiness.
+*/
+static void bench_sim_short_writes(Fixture &f, std::string const &input, size_t iterations)
+{
+	static Client *sender = NULL;
+	static Client *peer = NULL;
+
+	if (!sender)
+	{
+		sender = f.add_user("simfrom", f.transport.open(false));
+		peer = f.add_user("simto", f.transport.open(true));
+		f.transport.take_output(peer->get_fd());
+		f.transport.set_max_write(peer->get_fd(), 16);
+	}
+	for (size_t i = 0; i < iterations; i++)
+	{
+		f.transport.feed(sender->get_fd(), input);
+		handle_msg(f.app, sender);
+		while (peer->has_pending_output())
+			peer->flush_output();
+		g_sink += f.transport.take_output(peer->get_fd()).size();
+	}
+}
+
+/*
+A whole connection: accepted, registered, quit and freed.
+*/
+static void bench_sim_connection(Fixture &f, std::string const &input, size_t iterations)
+{
+	for (size_t i = 0; i < iterations; i++)
+	{
+		int fd = f.transport.open(false);
+		Client *client = new Client(f.app, fd);
+
+		client->set_class(f.app.find_class("default"));
+		f.app.add_client(client);
+		f.transport.feed(fd, input);
+		handle_msg(f.app, client);
+		g_sink += f.transport.is_shut(fd);
+		f.app.remove_client(client->get_uuid());
+		f.transport.close(fd);
+	}
+}
+
+static void bench_valid_nick(Fixture &f, std::string const &input, size_t iterations)
+{
+	for (size_t i = 0; i < iterations; i++)
+		g_sink += f.user->is_valid_nick(input);
+}
+
+static void bench_valid_channel_name(Fixture &f, std::string const &input, size_t iterations)
+{
+	(void) f;
+	for (size_t i = 0; i < iterations; i++)
+		g_sink += Channel::is_valid_channel_name(input);
+}
+
+static std::vector<Benchmark> make_benchmarks(void)
+{
+	std::vector<Benchmark> res;
+	std::string many_params;
+	std::string long_name("#");
+	std::string pings;
+
+	for (int i = 0; i < 40; i++)
+		many_params += " p";
+	long_name.append(199, 'c');
+	for (int i = 0; i < 8; i++)
+		pings += "PING token\r\n";
+
+#define BENCH(name, func, input) res.push_back(make_bench(name, func, input))
+	BENCH("parse_message/privmsg",        bench_parse_message, "PRIVMSG #general :hello there, how is everyone doing today?");
+	BENCH("parse_message/prefixed",       bench_parse_message, ":alice!alice@127.0.0.1 PRIVMSG #a,#b,bob :hi");
+	BENCH("parse_message/mode",           bench_parse_message, "MODE #general +oolk bob carol 10 secret");
+	BENCH("parse_message/many_params",    bench_parse_message, "PRIVMSG" + many_params);
+	BENCH("parse_message/long_trailing",  bench_parse_message, "PRIVMSG #general :" + std::string(490, 'x'));
+	BENCH("parse_message/spaces",         bench_parse_message, "PRIVMSG" + std::string(500, ' ') + "#a :b");
+	BENCH("fill_placeholders/reply",      bench_fill_placeholders, "<client> <nick> :No such nick/channel");
+	BENCH("fill_placeholders/unmatched",  bench_fill_placeholders, std::string(200, '<') + " :text");
+	BENCH("fill_placeholders/unknown",    bench_fill_placeholders, "<a> <b> <c> <d> <e> <f> <g> <h> :text");
+	BENCH("code_to_string/welcome",       bench_code_to_string, "1");
+	BENCH("code_to_string/topic",         bench_code_to_string, "332");
+	BENCH("mode/flags",                   bench_mode, "+it -it");
+	BENCH("mode/key_limit",               bench_mode, "+kl -kl secret 50");
+	BENCH("mode/op",                      bench_mode, "+o -o s1");
+	BENCH("mode/mass_op",                 bench_mode, "+oooooooo -oooooooo s1 s2 s3 s4 s5 s6 s7 s8");
+	BENCH("parse_mode/unknown_chars",     bench_parse_mode, "+" + std::string(30, 'z'));
+	BENCH("parse_mode/flip_flop",         bench_parse_mode, std::string(15, '+') + std::string(15, '-') + "itit");
+	BENCH("nicks_str/10",                 bench_nicks_str, "#small");
+	BENCH("nicks_str/1000",               bench_nicks_str, "#big");
+	BENCH("membership/join_part_10",      bench_membership, "#small");
+	BENCH("membership/join_part_1000",    bench_membership, "#big");
+	BENCH("membership/disconnect",        bench_membership, "*");
+	BENCH("send_to_peers/1010_members",   bench_send_to_peers, ":alice!alice@127.0.0.1 NICK :alicia");
+	BENCH("run_input/8_lines",            bench_run_input, pings);
+	BENCH("run_input/partial_line",       bench_run_input, "PING token\r\nPRIVMSG #small :half a li");
+	BENCH("mask_match/star",              bench_mask_match, "*");
+	BENCH("mask_match/prefix",            bench_mask_match, "s1*");
+	BENCH("mask_match/host",              bench_mask_match, "*!*@127.*.1");
+	BENCH("mask_match/worst_case",        bench_mask_match, "*a*a*a*a*b");
+	BENCH("ban_check/5000_miss",          bench_ban_check, "alice!alice@127.0.0.1");
+	BENCH("ban_check/5000_hit_host",      bench_ban_check, "bob!bob@host2997.example.net");
+	BENCH("ban_check/5000_hit_nick",      bench_ban_check, "nick4000!x@127.0.0.1");
+	BENCH("valid_nick/plain",             bench_valid_nick, "alice");
+	BENCH("valid_nick/special",           bench_valid_nick, "[a]-b^c");
+	BENCH("valid_nick/too_long",          bench_valid_nick, std::string(1000, 'a'));
+	BENCH("valid_nick/bad_last",          bench_valid_nick, "abcdefgh!");
+	BENCH("valid_channel_name/short",     bench_valid_channel_name, "#general");
+	BENCH("valid_channel_name/long",      bench_valid_channel_name, long_name);
+	BENCH("valid_channel_name/huge",      bench_valid_channel_name, "#" + std::string(10000, 'c'));
+	BENCH("sim/privmsg_channel_100",      bench_sim_privmsg, "PRIVMSG #sim :hello there, how is everyone doing today?\r\n");
+	BENCH("sim/privmsg_short_writes",     bench_sim_short_writes, "PRIVMSG simto :hello there, how is everyone doing today?\r\n");
+	BENCH("sim/connect_register_quit",    bench_sim_connection, "PASS password\r\nNICK simc\r\nUSER simc 0 * :Sim\r\nQUIT :bye\r\n");
+#undef BENCH
+	return res;
+}
+
+
+// ============================
+//        Memory budget
+// ============================
+
+static long const idle_client_count = 4096;
+static long const idle_client_budget = 512;
+
+/*
+Heap bytes a registered client costs while it sits idle: the Client,
+its strings and its share of the App's indexes. Averaged over many
+clients so that table growth is spread out.
+*/
+static long measure_idle_client(Fixture &f)
+{
+	std::vector<Client *> clients;
+	std::ostringstream nick;
+	long before;
+	long per_client;
+
+	clients.reserve(idle_client_count);
+	before = g_live_bytes;
+	for (long i = 0; i < idle_client_count; i++)
+	{
+		nick.str("");
+		nick << "idle" << i;
+		clients.push_back(f.add_user(nick.str()));
+	}
+	nick.str("");
+	per_client = (g_live_bytes - before) / idle_client_count;
+	for (std::vector<Client *>::const_iterator i = clients.begin(); i != clients.end(); i++)
+		f.app.remove_client((*i)->get_uuid());
+	return per_client;
+}
+
+
+// ============================
+//           Runner
+// ============================
+
+struct Result
+{
+	double ns_per_op;
+	double allocs_per_op;
+	size_t iterations;
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+Doubles the iteration count until one run lasts at least min_time_ns,
+then repeats that run and keeps the fastest one, the least disturbed
+by the rest of the system.
+*/
+static Result run(Fixture &f, Benchmark const &bench, double min_time_ns, int repeats)
+{
+	Result res;
+	unsigned long allocs;
+	double start;
+	double elapsed;
+	size_t n = 1;
+
+	bench.func(f, bench.input, 1);
+	for (;;)
+	{
+		start = now_ns();
+		bench.func(f, bench.input, n);
+		elapsed = now_ns() - start;
+		if (elapsed >= min_time_ns || n >= (1UL << 30))
+			break ;
+		n *= 2;
+	}
+	res.ns_per_op = elapsed / n;
+	res.iterations = n;
+	for (int i = 0; i < repeats; i++)
+	{
+		allocs = g_allocs;
+		start = now_ns();
+		bench.func(f, bench.input, n);
+		elapsed = now_ns() - start;
+		res.allocs_per_op = static_cast<double>(g_allocs - allocs) / n;
+		if (elapsed / n < res.ns_per_op)
+			res.ns_per_op = elapsed / n;
+	}
+	return res;
+}
+
+static std::map<std::string, Result> read_baseline(char const *path)
+{
+	std::map<std::string, Result> res;
+	std::ifstream file(path);
+	std::string line;
+
+	if (!file)
+	{
+		std::cerr << path << ": " << std::strerror(errno) << "\n";
+		std::exit(2);
+	}
+	while (std::getline(file, line))
+	{
+		std::istringstream iss(line);
+		std::string name;
+		Result r;
+
+		if (line.empty() || line[0] == '#')
+			continue ;
+		if (iss >> name >> r.ns_per_op >> r.allocs_per_op >> r.iterations)
+			res[name] = r;
+	}
+	return res;
+}
+
+int main(int argc, char **argv)
+{
+	std::map<std::string, Result> baseline;
+	bool has_baseline = false;
+	char const *filter = "";
+	double min_time_ns = 100e6;
+	int repeats = 5;
+	double threshold = 10;
+	int status = 0;
+
+	for (int i = 1; i + 1 < argc; i += 2)
+	{
+		if (!std::strcmp(argv[i], "--baseline"))
+		{
+			baseline = read_baseline(argv[i + 1]);
+			has_baseline = true;
+		}
+		else if (!std::strcmp(argv[i], "--filter"))
+			filter = argv[i + 1];
+		else if (!std::strcmp(argv[i], "--min-time"))
+			min_time_ns = std::atof(argv[i + 1]) * 1e6;
+		else if (!std::strcmp(argv[i], "--repeat"))
+			repeats = std::atoi(argv[i + 1]);
+		else if (!std::strcmp(argv[i], "--threshold"))
+			threshold = std::atof(argv[i + 1]);
+		else
+		{
+			std::cerr << "Unknown option " << argv[i] << "\n";
+			return 2;
+		}
+	}
+
+	std::ostream out(std::cout.rdbuf());
+	std::ofstream null_stream("/dev/null");
+	std::cout.rdbuf(null_stream.rdbuf());
+	{
+		Fixture f;
+		std::vector<Benchmark> benchmarks = make_benchmarks();
+
+		f.info["client"] = "alice!alice@127.0.0.1";
+		f.info["nick"] = "bob";
+		out << "# name\tns/op\tallocs/op\titerations";
+		if (has_baseline)
+			out << "\tbase_ns/op\tbase_allocs/op\tchange%";
+		out << "\n" << std::fixed;
+		for (std::vector<Benchmark>::const_iterator b = benchmarks.begin(); b != benchmarks.end(); b++)
+		{
+			if (!std::strstr(b->name, filter))
+				continue ;
+			Result r = run(f, *b, min_time_ns, repeats);
+			out << b->name << "\t" << std::setprecision(1) << r.ns_per_op << "\t" << std::setprecision(2)
+				<< r.allocs_per_op << "\t" << r.iterations;
+			if (has_baseline && baseline.count(b->name))
+			{
+				Result const &base = baseline[b->name];
+				double change = (r.ns_per_op - base.ns_per_op) / base.ns_per_op * 100;
+				bool regressed = change > threshold || r.allocs_per_op > base.allocs_per_op + 0.005;
+
+				out << "\t" << std::setprecision(1) << base.ns_per_op << "\t" << std::setprecision(2)
+					<< base.allocs_per_op << "\t" << std::showpos << std::setprecision(1) << change
+					<< std::noshowpos << (regressed ? "\tREGRESSION" : "");
+				if (regressed)
+					status = 1;
+			}
+			out << std::endl;
+		}
+		if (std::strstr("memory/idle_client", filter))
+		{
+			long bytes = measure_idle_client(f);
+
+			out << "# memory/idle_client\t" << bytes << " bytes\tbudget " << idle_client_budget
+				<< (bytes > idle_client_budget ? "\tOVER BUDGET" : "") << std::endl;
+			if (bytes > idle_client_budget)
+				status = 1;
+		}
+	}
+	std::cout.rdbuf(out.rdbuf());
+	return status;
+}
@@ -0,0 +1,154 @@
+#!/usr/bin/env python3
+# Upgrade load test: connects many registered clients to a fresh ircserv over
+# loopback, sends SIGUSR2, then checks that every connection is still served
+# by the new process. Exits with status 1 if any client was dropped.
+#
+#   python3 bench/upgrade_load.py --clients 10000
+
+import argparse, os, resource, selectors, signal, socket, subprocess, sys, tempfile, time
+
+def parse_args():
+	p = argparse.ArgumentParser(description="ircserv upgrade load test")
+	p.add_argument("--binary", default="./ircserv")
+	p.add_argument("--port", type=int, default=6790)
+	p.add_argument("--clients", type=int, default=10000)
+	p.add_argument("--per-channel", type=int, default=100, help="clients per channel")
+	p.add_argument("--timeout", type=float, default=60.0, help="seconds to wait for each phase")
+	return p.parse_args()
+
+def raise_fd_limit(needed):
+	soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+	if hard != resource.RLIM_INFINITY and hard < needed:
+		sys.exit("need %d file descriptors, hard limit is %d" % (needed, hard))
+	resource.setrlimit(resource.RLIMIT_NOFILE, (max(soft, needed) if hard == resource.RLIM_INFINITY else hard, hard))
+
+def server_pids(argv):
+	# The new process is exec'd with the same argv as the old one.
+	want = "\0".join(argv) + "\0"
+	pids = []
+	for d in os.listdir("/proc"):
+		if not d.isdigit():
+			continue
+		try:
+			with open("/proc/%s/cmdline" % d) as f:
+				if f.read() == want:
+					pids.append(int(d))
+		except (IOError, OSError):
+			pass
+	return pids
+
+def wait_listening(port, proc):
+	for _ in range(50):
+		if proc.poll() is not None:
+			return False
+		try:
+			socket.create_connection(("127.0.0.1", port)).close()
+			return True
+		except OSError:
+			time.sleep(0.1)
+	return False
+
+class Conn(object):
+	def __init__(self, sock, nick):
+		self.sock = sock
+		self.nick = nick
+		self.inbuf = b""
+		self.closed = False
+
+def pump(sel, conns, done, timeout):
+	# Reads every socket until done(conn) holds for all open ones or time runs out.
+	deadline = time.time() + timeout
+	while time.time() < deadline:
+		if all(c.closed or done(c) for c in conns):
+			return True
+		for key, _ in sel.select(0.2):
+			c = key.data
+			try:
+				data = c.sock.recv(65536)
+			except (BlockingIOError, InterruptedError):
+				continue
+			except OSError:
+				data = b""
+			if not data:
+				c.closed = True
+				sel.unregister(c.sock)
+				continue
+			c.inbuf += data
+			if len(c.inbuf) > 1 << 16:
+				c.inbuf = c.inbuf[-4096:]
+	return False
+
+def main():
+	args = parse_args()
+	raise_fd_limit(args.clients + 256)
+	workdir = tempfile.mkdtemp(prefix="ircserv_upgrade.")
+	conf = os.path.join(workdir, "ircserv.conf")
+	with open(conf, "w") as f:
+		f.write("listen_backlog = 4096\nmax_events = 256\n")
+	binary = os.path.abspath(args.binary)
+	argv = [binary, str(args.port), "secret", conf]
+	log = open(os.path.join(workdir, "log"), "w")
+	print("server log\t%s" % log.name)
+	old = subprocess.Popen(argv, cwd=workdir, stdout=log, stderr=subprocess.STDOUT)
+	if not wait_listening(args.port, old):
+		sys.exit("server did not start, see %s" % log.name)
+
+	sel = selectors.DefaultSelector()
+	conns = []
+	start = time.time()
+	try:
+		for i in range(args.clients):
+			s = socket.create_connection(("127.0.0.1", args.port))
+			s.setblocking(False)
+			c = Conn(s, "u%d" % i)
+			s.sendall(("PASS secret\r\nNICK %s\r\nUSER %s 0 * :load\r\nJOIN #c%d\r\n"
+				% (c.nick, c.nick, i // args.per_channel)).encode())
+			conns.append(c)
+			sel.register(s, selectors.EVENT_READ, c)
+			if i % 500 == 499:
+				pump(sel, conns, lambda c: True, 0)
+		if not pump(sel, conns, lambda c: b" 353 " in c.inbuf, args.timeout):
+			sys.exit("clients did not all register and join in time")
+		lost = sum(1 for c in conns if c.closed)
+		print("connected\t%d clients in %.1f s, %d closed" % (len(conns), time.time() - start, lost))
+
+		# A line cut in half across the upgrade must arrive whole afterwards.
+		conns[0].sock.sendall(b"PRIVMSG #c0 :split ")
+		time.sleep(0.2)
+		for c in conns:
+			c.inbuf = b""
+		start = time.time()
+		os.kill(old.pid, signal.SIGUSR2)
+		try:
+			status = old.wait(args.timeout)
+		except subprocess.TimeoutExpired:
+			sys.exit("old process did not exit")
+		handover = time.time() - start
+		new = [p for p in server_pids(argv) if p != old.pid]
+		print("handover\t%.2f s, old exited %d, new pid %s" % (handover, status, new[0] if new else "none"))
+		if not new:
+			sys.exit("no new process is running")
+
+		conns[0].sock.sendall(b"across the upgrade\r\n")
+		for c in conns:
+			if not c.closed:
+				c.sock.sendall(b"PING load\r\n")
+		pump(sel, conns, lambda c: b"PONG" in c.inbuf, args.timeout)
+		dropped = sum(1 for c in conns if c.closed or b"PONG" not in c.inbuf)
+		split = sum(1 for c in conns[1:args.per_channel] if b"PRIVMSG #c0 :split across the upgrade" in c.inbuf)
+		print("after\t%d of %d clients answered PING, %d dropped" % (len(conns) - dropped, len(conns), dropped))
+		print("split line\tdelivered to %d of %d channel members" % (split, min(args.per_channel, len(conns)) - 1))
+		return 1 if dropped or split != min(args.per_channel, len(conns)) - 1 else 0
+	finally:
+		for c in conns:
+			c.sock.close()
+		for p in server_pids(argv):
+			os.kill(p, signal.SIGTERM)
+		for _ in range(100):
+			if not server_pids(argv):
+				break
+			time.sleep(0.1)
+		log.close()
+
+if __name__ == "__main__":
+	sys.exit(main())
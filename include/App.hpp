@@ -1,9 +1,18 @@
 #ifndef APP_HPP
 #define APP_HPP
 
+#include "ChannelSizeIndex.hpp"
+#include "CommandStats.hpp"
+#include "Config.hpp"
+#include "HashMap.hpp"
+#include "InviteIndex.hpp"
+#include "Mask.hpp"
 #include "Message.hpp"
 #include "IRCReply.hpp"
+#include "Poller.hpp"
+#include "Transport.hpp"
 
+#include <ctime>
 #include <map>
 #include <string>
 #include <vector>
@@ -11,9 +20,68 @@
 #define CRLF "\r\n"
 
 class Channel;
+class ChannelStore;
 class Client;
+class Recorder;
+class StateWriter;
+class StateReader;
 typedef unsigned long uint32;
 
+/*
+Registry key for a channel: the name case-folded with the rfc1459
+casemapping, and its hash. Both are computed once, when the key is built.
+*/
+struct ChannelKey
+{
+	std::string folded;
+	size_t hash;
+
+	ChannelKey();
+	explicit ChannelKey(std::string const &name);
+	bool operator==(ChannelKey const &other) const;
+};
+
+struct ChannelKeyHash
+{
+	size_t operator()(ChannelKey const &key) const
+	{
+		return key.hash;
+	}
+};
+
+/*
+A connection class with its live counters. Classes live as long as the
+App, so clients keep a plain pointer; a class dropped from the config
+keeps its last limits for the clients still in it.
+*/
+struct ConnClass
+{
+	Config::ClassSpec spec;
+	long clients;
+	unsigned long sendq_bytes;
+	unsigned long evictions;
+};
+
+/*
+The ELIST conditions of a LIST: bounds on the member count, on when the
+channel was created and on when its topic was set, and name masks, of
+which one has to match if there are any and none of the '!' ones may.
+*/
+struct ListFilter
+{
+	unsigned long min_users;
+	unsigned long max_users;
+	std::time_t min_created;
+	std::time_t max_created;
+	std::time_t min_topic_time;
+	std::time_t max_topic_time;
+	std::vector<Mask> masks;
+	std::vector<Mask> excluded;
+
+	ListFilter();
+	bool add_condition(std::string const &condition, std::time_t now);
+	bool accepts(Channel const &channel) const;
+};
 
 class App
 {
@@ -22,49 +90,159 @@ class App
 		{
 			std::string name;
 			void (Client::*cmd_func)(std::vector<std::string> const &params);
+			LatencyHistogram *latency;
 		};
-		static const int nick_max_len = 9;
 		static const int user_max_len = 12;
-		static const int client_channel_limit = 10;
+		static const int max_targets = 4;
+
+		/*
+		Client uuids are generational slot-map handles: the low bits index
+		client_slots, the high bits hold the slot generation at allocation time.
+		*/
+		struct ClientSlot
+		{
+			Client *client;
+			uint32 generation;
+
+			ClientSlot();
+		};
+		static const int uuid_index_bits = 20;
+		static const uint32 uuid_index_mask = (1UL << uuid_index_bits) - 1;
+		static const uint32 uuid_generation_mask = (1UL << (32 - uuid_index_bits)) - 1;
+
+		/*
+		A WHO over every user, answered a slice of client_slots per loop
+		turn; see run_who_queries().
+		*/
+		struct WhoQuery
+		{
+			uint32 requester;
+			std::string mask_text;
+			Mask mask;
+			size_t next_slot;
+		};
+		static const size_t who_slots_per_turn = 4096;
+
+		/*
+		A LIST over every channel, walked through a channel_sizes cursor a
+		slice per loop turn; see run_list_queries().
+		*/
+		struct ListQuery
+		{
+			uint32 requester;
+			size_t cursor;
+			ListFilter filter;
+		};
+		static const size_t list_channels_per_turn = 1024;
 
 	private:
 		std::string server_password;
 		std::vector<Command> commands;
-		std::map<uint32, Client *> clients;
-		std::map<std::string, Channel *> channels;
+		std::vector<ClientSlot> client_slots;
+		std::vector<uint32> free_client_slots;
+		/* keyed by casefold(nick) */
+		HashMap<std::string, Client *, StringHash> nicks;
+		std::vector<Client *> links;
+		std::map<std::string, Client *> remote_clients;
+		HashMap<ChannelKey, Channel *, ChannelKeyHash> channels;
+		ChannelStore *channel_store;
+		std::vector<ConnClass *> classes;
+		/* clients whose input waits for flood budget, see run_input() */
+		std::vector<uint32> throttled;
+		std::vector<WhoQuery> who_queries;
+		std::vector<ListQuery> list_queries;
+		SocketTransport sockets;
 
 	public:
 		std::string server_name;
 		std::string server_version;
 		std::string created_at;
 		std::string network_name;
+		std::string server_id;
+		Poller poller;
+		/* shutting down: input is dropped, output is flushed */
+		bool draining;
+		Config config;
+		CommandStats stats;
+		InviteIndex invites;
+		ChannelSizeIndex channel_sizes;
+		/* inbound traffic for ircserv_replay, see record_path */
+		Recorder *recorder;
+		/* client I/O; the sockets unless a simulation swaps it out */
+		Transport *transport;
+		/* see Client::send_to_peers() */
+		unsigned int fanout_epoch;
+		/* the event loop reads every client's input into this one buffer */
+		std::vector<char> input_buffer;
 
 	public:
-		App(std::string const &name, std::string const &password);
+		App(std::string const &name, std::string const &password, Config const &config);
 		~App();
 
-		void add_client(Client *new_client);
+		bool add_client(Client *new_client);
 		void remove_client(uint32 uuid);
 
-		Channel *create_channel(std::string const &nick, std::string const &channel_name);
+		Channel *create_channel(std::string const &channel_name);
 		void add_channel(Channel *channel);
 		void remove_channel(std::string const &channel_name);
 
 		int parse_message(Client &user, std::string const &msg_string, Message &msg) const;
 		void execute_message(Client &user, Message const &msg);
+		LatencyHistogram *run_command(Client &user, Message const &msg);
+		void run_input(Client &user, char const *data, size_t size);
+		void report_slow_command(Client const &user, Message const &msg, unsigned long ns, unsigned long bytes);
 
 		Client *get_client(uint32 uuid) const;
+		std::vector<Client *> get_clients(void) const;
+		void find_users_by_mask(Mask const &mask, size_t limit, std::vector<Client *> &users) const;
+		bool has_pending_output(void) const;
 		Client *find_client_by_nick(std::string const &nick) const;
-		Client *find_client_by_fd(int fd) const;
+		void index_nick(Client *client, std::string const &old_nick);
+		Client *find_client_by_uid(std::string const &uid) const;
+		void add_remote_client(Client *client);
+		void start_who(Client const &requester, std::string const &mask_text);
+		void run_who_queries(void);
+		bool has_runnable_who(void) const;
+		void start_list(Client const &requester, ListFilter const &filter);
+		void run_list_queries(void);
+		bool has_runnable_list(void) const;
+		void end_pending_queries(void);
+		unsigned int next_fanout_epoch(void);
+
+		void add_link(Client *link);
+		Client *find_link_by_sid(std::string const &sid) const;
+		Client *find_link_by_block(std::string const &block) const;
+		bool has_links(void) const;
+		void propagate(Client const *origin, std::string const &line) const;
 
 		Channel *find_channel_by_name(std::string const &channel_name) const;
+		std::vector<Channel *> get_channels(void) const;
+		void save_channel(Channel const &channel);
+		void sync_channel_store(void);
+		void load_saved_channels(void);
+		void start_channel_journal(void);
 
 		void free_clients(void);
 		void free_channels(void);
 		
+		static std::string casefold(std::string const &name);
 		static std::string create_message(std::string const &prefix, std::string const &cmd, std::string const &msg);
 
+		ConnClass *find_class(std::string const &name) const;
+		ConnClass *find_class_by_password(std::string const &password) const;
+		std::vector<ConnClass *> const &get_classes(void) const;
+
+		void apply_config(void);
+		void reload_config(void);
+		int get_poll_timeout(void) const;
+		void run_timers(void);
+
 		bool is_correct_pwd(std::string const &password) const;
+		std::string get_isupport_tokens(void) const;
+		std::string const &get_password(void) const;
+
+		void serialize_state(StateWriter &out, std::vector<int> &client_fds) const;
+		void restore_state(StateReader &in, std::vector<int> const &client_fds);
 
 		void display_welcome(void) const;
 
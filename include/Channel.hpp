@@ -2,22 +2,45 @@
 #define CHANNEL_HPP
 
 #include "App.hpp"
+#include "ChannelHistory.hpp"
+#include "MaskList.hpp"
+#include "SmallVector.hpp"
 
+#include <ctime>
 #include <string>
 #include <vector>
 #include <map>
-#include <stack>
 
 enum chan_mode_enum {
 	INVITE_ONLY = 1 << 0,
 	TOPIC_LOCK  = 1 << 1,
 	CHANNEL_KEY = 1 << 2,
 	USER_LIMIT  = 1 << 3,
-	CHAN_OP     = 1 << 4
+	CHAN_OP     = 1 << 4,
+	BAN         = 1 << 5,
+	BAN_EXCEPT  = 1 << 6
+};
+
+/*
+One client on one channel. The node sits in two lists at once: the
+channel's members and the client's channels, so leaving a channel unlinks
+it from both without searching either.
+*/
+struct Membership
+{
+	Channel *channel;
+	Client *client;
+	bool op;
+	Membership *channel_prev;
+	Membership *channel_next;
+	Membership *client_prev;
+	Membership *client_next;
 };
 
 class Channel
 {
+	friend class ChannelSizeIndex;
+
 	public:
 
 		typedef struct chan_mode_map_s
@@ -27,70 +50,109 @@ class Channel
 			char              mode_type;
 		} chan_mode_map_t;
 
-		typedef struct chan_mode_set_s
+		/*
+		One change from a MODE line. param is the mask for type a modes, the
+		nick for type b modes and the value for type c modes being set, empty
+		otherwise. setter is who set a mask.
+		*/
+		typedef struct chan_mode_change_s
 		{
-			unsigned short mode;
-			unsigned int user_limit;
-			std::map<chan_mode_enum, std::map<std::string, std::stack<char> > > type_b_params;
-			std::map<chan_mode_enum, std::string> type_c_params;
-		} chan_mode_set_t;
+			chan_mode_map_t const *map;
+			char sign;
+			std::string param;
+			std::string setter;
+		} chan_mode_change_t;
+		typedef SmallVector<chan_mode_change_t, 8> chan_mode_delta_t;
+
+		/* parameters per outgoing MODE line, advertised as MODES */
+		static const int modes_per_line = 4;
 
 	private:
 		App &app;
-		std::vector<Client *> clients;
-		std::vector<Client *> invites;
+		Membership *members;
+		Membership *members_tail;
+		unsigned int member_count;
 		unsigned short mode;
 		unsigned int user_limit;
-		std::map<chan_mode_enum, std::vector<std::string> > type_b_params;
 		std::map<chan_mode_enum, std::string> type_c_params;
 		std::string topic;
+		std::time_t topic_time;
+		std::time_t created_at;
+		ChannelHistory history;
+		ChannelKey key;
+		MaskList bans;
+		MaskList exceptions;
+		/* links in App::channel_sizes */
+		Channel *size_prev;
+		Channel *size_next;
+		size_t size_bucket;
+		/* channel_sizes cursors whose next channel this is */
+		unsigned int size_cursors;
 
 	public:
 		std::string name;
-		static chan_mode_map_t supported_modes[5];
+		static chan_mode_map_t supported_modes[7];
+		static chan_mode_map_t const *mode_table[256];
+
+	private:
+		static bool const mode_table_ready;
+		static bool init_mode_table(void);
 	
 	public:
-		Channel(App &app, std::string const &nick, std::string const &name);
+		Channel(App &app, std::string const &name);
+		~Channel();
 
 		std::string const &get_topic(void) const;
+		std::time_t get_topic_time(void) const;
+		std::time_t get_created_at(void) const;
 		int get_user_limit(void) const;
 		int get_client_count(void) const;
 		std::string get_client_nicks_str(void) const;
+		Membership const *get_members(void) const;
+		std::string get_burst_modes(void) const;
+		ChannelHistory const &get_history(void) const;
+		ChannelKey const &get_key(void) const;
+		MaskList const &get_list(chan_mode_enum mode) const;
 
 		void set_topic(std::string const &topic);
 		void set_user_limit(int limit);
 
-		void add_client(Client *client);
+		Membership *add_client(Client *client, bool op);
 		void remove_client(Client *client);
+		void remove_member(Membership *member);
+		Membership *find_member(Client const *client) const;
 
 		bool is_full(void) const;
 		bool is_in_mode(chan_mode_enum mode) const;
 		bool is_matching_key(std::string const &key) const;
 		bool is_on_channel(Client const *client) const;
 		bool is_invited(Client const *client) const;
-		bool is_channel_operator(std::string const &nick) const;
+		bool is_channel_operator(Client const *client) const;
+		bool is_banned(Client const *client) const;
 		static bool is_valid_channel_name(std::string const &channel_name);
 
 		void add_invite(Client *client);
 		void remove_invite(Client *client);
 
-		void get_mode_with_params(std::string const &nick, std::map<std::string, std::string> &info) const;
-		chan_mode_set_t parse_mode(Client const &user, std::string const &mode_str, std::vector<std::string> const &params) const;
-		std::string change_mode(chan_mode_set_t const &channel_mode_set);
+		void get_mode_with_params(Client const *client, std::map<std::string, std::string> &info) const;
+		void parse_mode(Client const &user, std::string const &mode_str, std::vector<std::string> const &params,
+			chan_mode_delta_t &delta) const;
+		void change_mode(chan_mode_delta_t const &delta, std::vector<std::string> &lines);
 		static bool mode_str_has_enough_params(std::string const &mode_str, size_t param_count);
 		static bool mode_requires_param(char mode, char sign);
-		static void parse_type_b_mode(chan_mode_set_t &mode_set, chan_mode_enum mode, char sign, std::string const &param);
-		static void parse_type_c_mode(chan_mode_set_t &mode_set, chan_mode_enum mode, char sign, std::string const &param);
-		static void parse_type_d_mode(chan_mode_set_t &mode_set, chan_mode_enum mode, char sign);
+		static bool is_list_query(std::vector<std::string> const &params);
+		void send_list(Client const &user, chan_mode_enum mode) const;
 
 		std::string get_type_c_param(chan_mode_enum mode) const;
 		void set_type_c_param(chan_mode_enum mode, std::string const &value);
-		void add_type_b_param(chan_mode_enum mode, std::string const &value);
-		void remove_type_b_param(chan_mode_enum mode, std::string const &value);
-		bool is_type_b_param(chan_mode_enum mode, std::string const &value) const;
 
-		void privmsg(std::string const &source, std::string const &msg) const;
+		void add_history(std::string const &source, std::string const &cmd, std::string const &text);
 		void notify(std::string const &source, std::string const &cmd, std::string const &param) const;
+
+		void serialize_settings(StateWriter &out) const;
+		void restore_settings(StateReader &in);
+		void serialize(StateWriter &out) const;
+		static Channel *deserialize(App &app, StateReader &in);
 };
 
 #endif // CHANNEL_HPP
\ No newline at end of file
@@ -0,0 +1,64 @@
+#ifndef CHANNEL_HISTORY_HPP
+#define CHANNEL_HISTORY_HPP
+
+#include "App.hpp"
+
+#include <deque>
+#include <string>
+#include <vector>
+
+/*
+Bounded history of the messages sent to one channel. The text of every
+entry lives in a single circular byte arena; the oldest entries are
+evicted to make room. A line is written into the arena piece by piece,
+never built as a string first. Arenas start small and grow on demand up to
+max_channel_bytes, as long as the server-wide total stays under
+max_total_bytes.
+*/
+class ChannelHistory
+{
+	public:
+		struct Entry
+		{
+			uint32 sec;
+			unsigned short msec;
+			uint32 msgid;
+			size_t offset;
+			size_t len;
+		};
+
+		static size_t max_channel_bytes;
+		static size_t max_total_bytes;
+		static const size_t min_arena_bytes = 1024;
+		static const size_t max_query_limit = 100;
+
+	private:
+		static size_t total_bytes;
+
+		std::vector<char> arena;
+		std::deque<Entry> entries;
+		size_t head;
+		size_t used;
+		uint32 next_msgid;
+
+		bool grow(size_t needed);
+		void evict_oldest(void);
+		size_t put(size_t offset, char const *data, size_t size);
+		size_t put(size_t offset, std::string const &str);
+
+	public:
+		ChannelHistory();
+		~ChannelHistory();
+
+		void append(std::string const &prefix, std::string const &cmd, std::string const &target,
+			std::string const &text);
+
+		size_t size(void) const;
+		Entry const &at(size_t index) const;
+		std::string text(Entry const &entry) const;
+		bool ref_bounds(std::string const &ref, size_t &before_end, size_t &after_begin) const;
+
+		static std::string format_time(Entry const &entry);
+};
+
+#endif /* CHANNEL_HISTORY_HPP */
@@ -0,0 +1,72 @@
+#ifndef CHANNEL_SIZE_INDEX_HPP
+#define CHANNEL_SIZE_INDEX_HPP
+
+#include <cstddef>
+#include <vector>
+
+class Channel;
+
+/*
+Channels grouped by member count, for the LIST filters. Counts below
+exact_buckets have a bucket each, larger ones share one per power of
+two. A bucket is a list linked through the channels themselves, so a
+join or a part moves its channel in constant time.
+
+A listing walks the buckets from the largest channels down through a
+cursor. A channel leaving its bucket first moves every cursor that
+points at it, so cursors stay valid from one loop turn to the next; a
+channel that changes bucket during a walk may be listed twice or not
+at all. Each channel counts the cursors pointing at it, so that only a
+channel some cursor waits on looks through the open cursors, which are
+kept apart from the closed ones. Closed cursor ids are reused, and the
+table is emptied once no cursor is open.
+*/
+class ChannelSizeIndex
+{
+	public:
+		static const size_t exact_buckets = 32;
+		static const size_t not_indexed = static_cast<size_t>(-1);
+
+	private:
+		struct Bucket
+		{
+			Channel *head;
+			Channel *tail;
+		};
+
+		struct Cursor
+		{
+			size_t bucket;
+			size_t last_bucket;
+			Channel *next;
+			/* index in open_ids */
+			size_t position;
+		};
+
+		std::vector<Bucket> buckets;
+		std::vector<Cursor> cursors;
+		std::vector<size_t> open_ids;
+		std::vector<size_t> free_ids;
+
+		ChannelSizeIndex(ChannelSizeIndex const &other);
+		ChannelSizeIndex &operator=(ChannelSizeIndex const &other);
+
+		void link(Channel *channel, size_t bucket);
+		void unlink(Channel *channel);
+		static void point(Cursor &cursor, Channel *channel);
+
+	public:
+		ChannelSizeIndex();
+
+		static size_t bucket_of(unsigned long count);
+
+		void add(Channel *channel);
+		void update(Channel *channel);
+		void remove(Channel *channel);
+
+		size_t open_cursor(unsigned long min_count, unsigned long max_count);
+		Channel *next(size_t cursor);
+		void close_cursor(size_t cursor);
+};
+
+#endif /* CHANNEL_SIZE_INDEX_HPP */
@@ -0,0 +1,65 @@
+#ifndef CHANNEL_STORE_HPP
+#define CHANNEL_STORE_HPP
+
+#include "App.hpp"
+#include "StateCodec.hpp"
+
+#include <string>
+#include <vector>
+
+/*
+Keeps channel settings (topic, modes, keys, limits, bans) on disk so
+they survive a crash or restart. A snapshot holds every channel; between
+snapshots each mutation is appended to a journal. Records are gathered in
+memory and written with one write() by flush(), once per loop turn. Once
+the journal grows past the snapshot it is folded into a new snapshot, so
+loading is bounded by the number of channels plus the recent changes.
+
+Membership, operator status and invites belong to live connections and
+are not stored.
+*/
+class ChannelStore
+{
+	public:
+		static const uint32 snapshot_magic   = 0x53435249; // "IRCS"
+		static const uint32 journal_magic    = 0x4a435249; // "IRCJ"
+		static const uint32 version          = 1;
+		static const size_t min_compact_size = 1 << 16;
+
+		enum record_type
+		{
+			REC_CHANNEL = 1,
+			REC_REMOVE  = 2
+		};
+
+	private:
+		std::string snapshot_path;
+		std::string journal_path;
+		int journal_fd;
+		size_t journal_size;
+		size_t snapshot_size;
+		StateWriter record;
+		/* records not written yet */
+		std::string pending;
+
+		void append_record(void);
+		void load_snapshot(App &app);
+		void replay_journal(App &app);
+
+	public:
+		ChannelStore(std::string const &snapshot_path, std::string const &journal_path);
+		~ChannelStore();
+
+		void load(App &app);
+		void open_journal(void);
+		void close_journal(void);
+
+		void record_channel(Channel const &channel);
+		void record_remove(std::string const &channel_name);
+		void flush(void);
+
+		bool needs_compaction(void) const;
+		void compact(std::vector<Channel *> const &channels);
+};
+
+#endif /* CHANNEL_STORE_HPP */
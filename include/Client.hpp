@@ -6,67 +6,168 @@
 #include <string>
 
 class Channel;
+class ServerLink;
+struct Membership;
 
 class Client
 {
+	public:
+		/*
+		A resolved PRIVMSG/NOTICE target. name is what local users see,
+		wire_name is what server links use (a uid instead of a nick).
+		*/
+		struct MessageTarget
+		{
+			Channel *channel;
+			Client *client;
+			std::string name;
+			std::string wire_name;
+		};
+
 	private:
+		/*
+		Hot fields first: what delivering a line and flushing output on a
+		poll event read fits in the first 64 bytes. A poll event reaches
+		its Client through the uuid it carries and one client slot, so
+		fanout to a member or a writable event touches one or two cache
+		lines of that Client and no other client's.
+		*/
 		App &app;
-		uint32 uuid;
 		int fd;
+		/* App fanout epoch of the last send_to_peers() that reached this client */
+		mutable unsigned int seen_epoch;
 		bool is_registered;
+		bool remote;
+		mutable bool write_wanted;
+		mutable bool evicted;
+		bool throttled;
+		/* an outgoing link whose connect() has not completed yet */
+		bool connecting;
+		/* closes once the send queue is empty; input is only discarded */
+		mutable bool closing;
+		ConnClass *conn_class;
+		/* output the socket did not take yet; empty, it holds no memory */
+		mutable std::string send_queue;
+
+		/* cold: registration, queries, channel changes, quit */
+		Client *uplink;
+		ServerLink *link;
+		Membership *memberships;
+		size_t channel_count;
+		uint32 uuid;
 		bool has_valid_pwd;
-		std::string username;
+		/* registration waits for CAP END */
+		bool cap_negotiating;
+		/* cap_* bits the client enabled */
+		unsigned char caps;
+		/* the flood budget is spent up to this time, in microseconds */
+		unsigned long flood_clock;
 		std::string nickname;
 		std::string full_nickname;
-		std::vector<Channel *> channels;
-		std::vector<Channel *> invites;
+		std::string username;
+		std::string realname;
+		std::string uid;
+		mutable std::string quit_reason;
+		/* input after the last complete line, sized to fit */
 		std::string msg_buff;
 
 	public:
+		static const unsigned char cap_server_time = 1;
+		static const unsigned char cap_batch = 2;
+
 		Client(App &app, int fd);
 		~Client();
 
-		uint32 generate_uuid(void) const;
 		void register_client(void);
 
-		std::string get_nickname(void) const;
-		std::string get_full_nickname(void) const;
+		std::string const &get_nickname(void) const;
+		std::string const &get_full_nickname(void) const;
 		int get_fd(void) const;
 		uint32 get_uuid(void) const;
+		std::string const &get_uid(void) const;
+		std::string const &get_username(void) const;
+		std::string const &get_realname(void) const;
+		std::string const &get_server_name(void) const;
+		bool matches(Mask const &mask) const;
+		ServerLink *get_link(void) const;
+		Client *get_uplink(void) const;
+		Membership *get_memberships(void) const;
+		std::string const &get_quit_reason(void) const;
+		ConnClass *get_class(void) const;
+		bool is_throttled(void) const;
+		bool is_connecting(void) const;
+		bool is_closing(void) const;
 		std::string pretty_uuid(void) const;
 
 		void send_message(std::string const &msg) const;
+		void flush_output(void) const;
+		bool has_pending_output(void) const;
 		void send_numeric_reply(IRCReplyCodeEnum code, std::map<std::string, std::string> const &info) const;
+		void send_who_reply(Client const &user, std::string const &channel, bool op, std::string &line) const;
+		void send_list_reply(Channel const &channel, std::string &line) const;
+		void send_fail(std::string const &cmd, std::string const &code, std::string const &context, std::string const &desc) const;
 
-		void set_msg_buff(std::string const &s);
-		std::string get_msg_buff(void) const;
+		void set_uuid(uint32 uuid);
+		void set_remote(Client *uplink, std::string const &uid, std::string const &nick,
+			std::string const &username, std::string const &host, std::string const &realname);
+		void set_remote_nick(std::string const &nick);
+		void set_quit_reason(std::string const &reason);
+		void request_close(void) const;
+		void close_when_flushed(void) const;
+		void evict(std::string const &reason) const;
+		void set_class(ConnClass *conn_class);
+		void set_throttled(bool throttled);
+		void set_connecting(bool connecting);
+		bool take_flood_token(unsigned long now_us);
+		long flood_wait_ms(unsigned long now_us) const;
+		void set_msg_buff(char const *data, size_t size);
+		std::string const &get_msg_buff(void) const;
 
 		static void fill_placeholders(std::string &str, std::map<std::string, std::string> const &info);
 		static int split_targets(std::string const &target_str, std::vector<std::string> &targets);
 
-		void privmsg_client(std::string const &source, std::string const &msg) const;
-		void privmsg_targets(std::string const &msg, std::vector<std::string> const &targets) const;
+		void send_text(std::string const &cmd, std::vector<std::string> const &params);
+		void resolve_targets(std::string const &cmd, std::vector<std::string> const &names,
+			std::vector<MessageTarget> &targets) const;
+		void deliver_text(std::string const &cmd, std::vector<MessageTarget> const &targets, std::string const &msg) const;
 
+		void cap(std::vector<std::string> const &params);
 		void pass(std::vector<std::string> const &params);
 		void nick(std::vector<std::string> const &params);
 		void user(std::vector<std::string> const &params);
 		void join(std::vector<std::string> const &params);
 		void privmsg(std::vector<std::string> const &params);
+		void notice(std::vector<std::string> const &params);
 		void kick(std::vector<std::string> const &params);
+		void part(std::vector<std::string> const &params);
+		void quit(std::vector<std::string> const &params);
 		void invite(std::vector<std::string> const &params);
 		void topic(std::vector<std::string> const &params);
 		void mode(std::vector<std::string> const &params);
 		void ping(std::vector<std::string> const &params);
+		void chathistory(std::vector<std::string> const &params);
+		void stats(std::vector<std::string> const &params);
+		void who(std::vector<std::string> const &params);
+		void whois(std::vector<std::string> const &params);
+		void list(std::vector<std::string> const &params);
+		void server(std::vector<std::string> const &params);
+		void connect(std::vector<std::string> const &params);
 
 		bool is_valid_nick(std::string const &nickname) const;
 		bool is_registered_client(void) const;
+		bool is_server_link(void) const;
+		bool is_remote(void) const;
 
-		void add_channel(Channel *channel);
-		void add_invite(Channel *channel);
-		void remove_channel(Channel *channel);
-		void remove_invite(Channel *channel);
+		void link_membership(Membership *member);
+		void unlink_membership(Membership *member);
 		void remove_channels(void);
+		void send_to_peers(std::string const &message) const;
+		void broadcast_quit(std::string const &reason) const;
+		void clear_fanout_mark(void) const;
 		void remove_invites(void);
+
+		void serialize(StateWriter &out) const;
+		static Client *deserialize(App &app, int fd, StateReader &in);
 };
 
 #endif // CLIENT_HPP
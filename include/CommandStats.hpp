@@ -0,0 +1,110 @@
+#ifndef COMMAND_STATS_HPP
+#define COMMAND_STATS_HPP
+
+#include "HashMap.hpp"
+
+#include <ctime>
+#include <deque>
+#include <string>
+#include <vector>
+
+/*
+Cheap monotonic tick source for timing commands: the TSC on x86, the
+monotonic clock elsewhere. to_ns converts a tick count with a ratio
+measured once, the first time the clock is calibrated.
+*/
+class CycleClock
+{
+	private:
+		static double ns_per_tick;
+
+	public:
+		static unsigned long now(void);
+		static unsigned long monotonic_ns(void);
+		static unsigned long to_ns(unsigned long ticks);
+		static void calibrate(void);
+};
+
+/*
+Latency histogram with log-linear buckets in the HDR style: values below
+sub_buckets get a bucket each, then every power of two is split into
+sub_buckets linear steps, so a bucket is never wider than 1/16 of the
+values it holds. Values are nanoseconds and clamp at max_bits.
+*/
+class LatencyHistogram
+{
+	public:
+		static const int sub_bucket_bits = 4;
+		static const int sub_buckets = 1 << sub_bucket_bits;
+		static const int max_bits = 32;
+		static const int bucket_count = (max_bits - sub_bucket_bits + 1) * sub_buckets;
+
+	private:
+		unsigned long counts[bucket_count];
+		unsigned long total;
+		double sum_ns;
+		unsigned long max_ns;
+
+		static int bucket_of(unsigned long ns);
+		static unsigned long bucket_high(int bucket);
+
+	public:
+		LatencyHistogram();
+
+		void record(unsigned long ns);
+		unsigned long count(void) const;
+		unsigned long max(void) const;
+		unsigned long mean(void) const;
+		unsigned long percentile(double p) const;
+};
+
+/*
+Per-command latency histograms and a log of the slowest executions.
+App::execute_message times every command and reports it here together
+with the bytes the command produced, counted by Client::send_message.
+Past max_commands distinct names, further commands share the "*" entry.
+*/
+class CommandStats
+{
+	public:
+		struct SlowEntry
+		{
+			std::time_t when;
+			std::string command;
+			std::string source;
+			std::string target;
+			int channel_size;
+			unsigned long ns;
+			unsigned long bytes;
+		};
+		static const size_t slow_log_size = 64;
+		static const size_t max_commands = 64;
+
+	private:
+		HashMap<std::string, LatencyHistogram *, StringHash> histograms;
+		std::vector<std::string> names;
+		std::deque<SlowEntry> slow_log;
+		unsigned long bytes_out;
+
+		CommandStats(CommandStats const &other);
+		CommandStats &operator=(CommandStats const &other);
+
+	public:
+		unsigned long slow_threshold_ns;
+
+	public:
+		CommandStats();
+		~CommandStats();
+
+		LatencyHistogram *histogram(std::string const &command);
+		void add_slow(SlowEntry const &entry);
+
+		void add_output(size_t bytes);
+		unsigned long get_bytes_out(void) const;
+
+		std::vector<std::string> const &get_names(void) const;
+		LatencyHistogram const *find(std::string const &command) const;
+		std::deque<SlowEntry> const &get_slow_log(void) const;
+};
+
+#endif /* COMMAND_STATS_HPP */
@@ -0,0 +1,128 @@
+#ifndef CONFIG_HPP
+#define CONFIG_HPP
+
+#include <string>
+#include <vector>
+
+/*
+Server tunables. The defaults below can be overridden by a config file
+given as the third command line argument, one "key = value" per line,
+'#' starting a comment. SIGHUP re-reads the file: reloadable settings
+take effect at once, the others (marked startup-only) only on the next
+start or upgrade.
+*/
+class Config
+{
+	public:
+		struct Setting
+		{
+			char const *key;
+			long Config::*field;
+			long min;
+			long max;
+			bool reloadable;
+		};
+
+		struct TextSetting
+		{
+			char const *key;
+			std::string Config::*field;
+			bool reloadable;
+		};
+
+		/*
+		One listening socket. A buffer size of 0 keeps the system default;
+		accept_budget caps the connections accepted per readiness event.
+		*/
+		struct ListenSpec
+		{
+			std::string address;
+			int port;
+			long backlog;
+			long sndbuf;
+			long rcvbuf;
+			long accept_budget;
+			std::string class_name;
+
+			bool operator==(ListenSpec const &other) const;
+		};
+		static const long default_accept_budget = 16;
+
+		/*
+		Limits shared by a group of connections: sendq and recvq in bytes,
+		channels a member can be on, and flood in lines per second (0 for
+		no limit). A class with a password is picked by a PASS giving that
+		password, otherwise the listener decides.
+		*/
+		struct ClassSpec
+		{
+			std::string name;
+			long sendq;
+			long recvq;
+			long channels;
+			long flood;
+			std::string password;
+
+			ClassSpec();
+		};
+
+		/*
+		A peer server this one may link with. The password is sent in
+		the handshake and must be the one the peer sends back.
+		*/
+		struct LinkSpec
+		{
+			std::string name;
+			std::string address;
+			int port;
+			std::string password;
+		};
+
+	private:
+		static Setting const settings[];
+		static TextSetting const text_settings[];
+
+		void set(std::string const &key, std::string const &value, int line_nb);
+		void add_listener(std::string const &value, int line_nb);
+		void add_class(std::string const &value, int line_nb);
+		void add_link(std::string const &value, int line_nb);
+
+	public:
+		std::string path;
+
+		/* startup-only */
+		std::string bind_address;
+		std::string snapshot_path;
+		std::string journal_path;
+		long listen_backlog;
+		std::vector<ListenSpec> listeners;
+
+		/* reloadable */
+		long max_events;
+		long poll_timeout_ms;
+		long max_msg_size;
+		long recv_buffer_size;
+		long nick_max_len;
+		long history_channel_bytes;
+		long history_total_bytes;
+		long slow_command_us;
+		long invite_ttl_s;
+		long invite_channel_limit;
+		long ban_list_limit;
+		long shutdown_drain_ms;
+		std::string record_path;
+		std::vector<ClassSpec> classes;
+		std::vector<LinkSpec> links;
+
+	public:
+		Config();
+
+		void load(std::string const &path);
+		void reload(Config const &fresh);
+		std::vector<ListenSpec> get_listeners(int port) const;
+		std::vector<ClassSpec> get_classes(void) const;
+		LinkSpec const *find_link(std::string const &name) const;
+		LinkSpec const *find_link_by_password(std::string const &password) const;
+};
+
+#endif /* CONFIG_HPP */
@@ -0,0 +1,265 @@
+#ifndef HASH_MAP_HPP
+#define HASH_MAP_HPP
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+// ============================
+//        Hash functors
+// ============================
+
+/*
+FNV-1a over the bytes of the string.
+*/
+struct StringHash
+{
+	size_t operator()(std::string const &s) const
+	{
+		size_t hash = 2166136261UL;
+
+		for (std::string::const_iterator i = s.begin(); i != s.end(); i++)
+		{
+			hash ^= static_cast<unsigned char>(*i);
+			hash *= 16777619UL;
+		}
+		return hash;
+	}
+};
+
+/*
+Pointers are aligned, so the low bits carry no information; the
+multiply spreads the rest over the bits the table actually uses.
+*/
+struct PointerHash
+{
+	size_t operator()(void const *p) const
+	{
+		size_t hash = reinterpret_cast<size_t>(p) >> 3;
+
+		return hash * 2654435761UL ^ hash >> 16;
+	}
+};
+
+struct IntHash
+{
+	size_t operator()(unsigned long n) const
+	{
+		return n * 2654435761UL ^ n >> 16;
+	}
+};
+
+
+// ============================
+//          HashMap
+// ============================
+
+/*
+Open-addressing hash table with linear probing, for the hot lookups
+where std::map's pointer chasing shows up. The capacity is a power of
+two and the load stays under 3/4. Erasing shifts the following entries
+back instead of leaving tombstones, so probes stay short. Inserting or
+erasing invalidates iterators.
+*/
+template <typename Key, typename Value, typename Hash, typename Equal = std::equal_to<Key> >
+class HashMap
+{
+	public:
+		typedef std::pair<Key, Value> value_type;
+
+		template <typename Map, typename Ref>
+		class basic_iterator
+		{
+			private:
+				Map *map;
+				size_t index;
+
+			public:
+				basic_iterator(Map *map, size_t index) : map(map), index(index)
+				{
+					skip_empty();
+				}
+
+				Ref &operator*(void) const { return map->slots[index]; }
+				Ref *operator->(void) const { return &map->slots[index]; }
+				bool operator==(basic_iterator const &other) const { return index == other.index; }
+				bool operator!=(basic_iterator const &other) const { return index != other.index; }
+
+				basic_iterator &operator++(void)
+				{
+					index++;
+					skip_empty();
+					return *this;
+				}
+
+				basic_iterator operator++(int)
+				{
+					basic_iterator old(*this);
+					++*this;
+					return old;
+				}
+
+			private:
+				void skip_empty(void)
+				{
+					while (index < map->used.size() && !map->used[index])
+						index++;
+				}
+		};
+		typedef basic_iterator<HashMap, value_type> iterator;
+		typedef basic_iterator<HashMap const, value_type const> const_iterator;
+
+	private:
+		std::vector<value_type> slots;
+		std::vector<char> used;
+		size_t count;
+		Hash hash;
+		Equal equal;
+
+		/*
+		Index of the slot holding key, or of the empty slot where it would go.
+		*/
+		size_t probe(Key const &key) const
+		{
+			size_t mask = slots.size() - 1;
+			size_t i = hash(key) & mask;
+
+			while (used[i] && !equal(slots[i].first, key))
+				i = (i + 1) & mask;
+			return i;
+		}
+
+		void rehash(size_t new_capacity)
+		{
+			std::vector<value_type> old_slots(new_capacity);
+			std::vector<char> old_used(new_capacity, 0);
+
+			old_slots.swap(slots);
+			old_used.swap(used);
+			for (size_t i = 0; i < old_slots.size(); i++)
+			{
+				if (old_used[i])
+				{
+					size_t j = probe(old_slots[i].first);
+					slots[j] = old_slots[i];
+					used[j] = 1;
+				}
+			}
+		}
+
+	public:
+		HashMap() : count(0) {}
+
+		size_t size(void) const { return count; }
+		bool empty(void) const { return count == 0; }
+
+		iterator begin(void) { return iterator(this, 0); }
+		iterator end(void) { return iterator(this, slots.size()); }
+		const_iterator begin(void) const { return const_iterator(this, 0); }
+		const_iterator end(void) const { return const_iterator(this, slots.size()); }
+
+		void clear(void)
+		{
+			slots.clear();
+			used.clear();
+			count = 0;
+		}
+
+		/*
+		Makes room for n entries without rehashing.
+		*/
+		void reserve(size_t n)
+		{
+			size_t capacity = 8;
+
+			while (capacity * 3 < n * 4)
+				capacity *= 2;
+			if (capacity > slots.size())
+				rehash(capacity);
+		}
+
+		Value *find(Key const &key)
+		{
+			size_t i;
+
+			if (count == 0)
+				return NULL;
+			i = probe(key);
+			return used[i] ? &slots[i].second : NULL;
+		}
+
+		Value const *find(Key const &key) const
+		{
+			size_t i;
+
+			if (count == 0)
+				return NULL;
+			i = probe(key);
+			return used[i] ? &slots[i].second : NULL;
+		}
+
+		/*
+		Returns false (and leaves the stored value alone) if key is already there.
+		*/
+		bool insert(Key const &key, Value const &value)
+		{
+			size_t i;
+
+			reserve(count + 1);
+			i = probe(key);
+			if (used[i])
+				return false;
+			slots[i] = value_type(key, value);
+			used[i] = 1;
+			count++;
+			return true;
+		}
+
+		Value &operator[](Key const &key)
+		{
+			size_t i;
+
+			reserve(count + 1);
+			i = probe(key);
+			if (!used[i])
+			{
+				slots[i] = value_type(key, Value());
+				used[i] = 1;
+				count++;
+			}
+			return slots[i].second;
+		}
+
+		bool erase(Key const &key)
+		{
+			size_t mask;
+			size_t hole;
+			size_t home;
+
+			if (count == 0)
+				return false;
+			mask = slots.size() - 1;
+			hole = probe(key);
+			if (!used[hole])
+				return false;
+			used[hole] = 0;
+			count--;
+			for (size_t i = (hole + 1) & mask; used[i]; i = (i + 1) & mask)
+			{
+				home = hash(slots[i].first) & mask;
+				if (((i - home) & mask) >= ((i - hole) & mask))
+				{
+					slots[hole] = slots[i];
+					used[hole] = 1;
+					used[i] = 0;
+					hole = i;
+				}
+			}
+			slots[hole] = value_type();
+			return true;
+		}
+};
+
+#endif /* HASH_MAP_HPP */
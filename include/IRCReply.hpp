@@ -10,17 +10,36 @@ enum IRCReplyCodeEnum {
 	RPL_CREATED = 003,
 	RPL_MYINFO = 004,
 	RPL_ISUPPORT = 005,
+	RPL_STATSCOMMANDS = 212,
+	RPL_STATSYLINE = 218,
+	RPL_ENDOFSTATS = 219,
+	RPL_STATSDEBUG = 249,
+	RPL_WHOISUSER = 311,
+	RPL_WHOISSERVER = 312,
+	RPL_ENDOFWHO = 315,
+	RPL_ENDOFWHOIS = 318,
+	RPL_WHOISCHANNELS = 319,
+	RPL_LISTSTART = 321,
+	RPL_LIST = 322,
+	RPL_LISTEND = 323,
 	RPL_CHANNELMODEIS = 324,
 	RPL_NOTOPIC = 331,
 	RPL_TOPIC = 332,
 	RPL_INVITING = 341,
+	RPL_EXCEPTLIST = 348,
+	RPL_ENDOFEXCEPTLIST = 349,
+	RPL_WHOREPLY = 352,
 	RPL_NAMREPLY = 353,
+	RPL_BANLIST = 367,
+	RPL_ENDOFBANLIST = 368,
 	ERR_NOSUCHNICK = 401,
+	ERR_NOSUCHSERVER = 402,
 	ERR_NOSUCHCHANNEL = 403,
 	ERR_CANNOTSENDTOCHAN = 404,
 	ERR_TOOMANYCHANNELS = 405,
 	ERR_TOOMANYTARGETS = 407,
 	ERR_NOORIGIN = 409,
+	ERR_INVALIDCAPCMD = 410,
 	ERR_NORECIPIENT = 411,
 	ERR_NOTEXTTOSEND = 412,
 	ERR_UNKNOWNCOMMAND = 421,
@@ -41,6 +60,7 @@ enum IRCReplyCodeEnum {
 	ERR_BANNEDFROMCHAN = 474,
 	ERR_BADCHANNELKEY = 475,
 	ERR_BADCHANMASK = 476,
+	ERR_BANLISTFULL = 478,
 	ERR_NOPRIVILEGES = 481,
 	ERR_CHANOPRIVSNEEDED = 482,
 	ERR_UMODEUNKNOWNFLAG = 501,
@@ -9,7 +9,10 @@ enum internal_error_code
 	IEC_NONE = 0,
 	IEC_BADPASS,
 	IEC_BADPORTNUM,
-	IEC_BADARGC
+	IEC_BADARGC,
+	IEC_BADSTATE,
+	IEC_BADCONFIG,
+	IEC_BADADDR
 };
 
 class InternalError
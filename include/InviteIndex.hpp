@@ -0,0 +1,90 @@
+#ifndef INVITE_INDEX_HPP
+#define INVITE_INDEX_HPP
+
+#include "HashMap.hpp"
+
+#include <ctime>
+#include <vector>
+
+class Channel;
+class Client;
+
+/*
+Pending invites. A hash on the (channel, client) pair answers the JOIN
+check; every invite is also linked into a list of its channel, a list of
+its client and one list in creation order. Dropping a channel or client
+walks only its own list, and since every invite gets the same TTL the
+creation order is also the expiry order.
+*/
+class InviteIndex
+{
+	public:
+		struct Invite
+		{
+			Channel *channel;
+			Client *client;
+			std::time_t created;
+			Invite *channel_prev;
+			Invite *channel_next;
+			Invite *client_prev;
+			Invite *client_next;
+			Invite *age_prev;
+			Invite *age_next;
+		};
+
+		struct InviteList
+		{
+			Invite *head;
+			Invite *tail;
+			size_t size;
+
+			InviteList();
+		};
+
+		struct Key
+		{
+			Channel const *channel;
+			Client const *client;
+
+			bool operator==(Key const &other) const;
+		};
+
+		struct KeyHash
+		{
+			size_t operator()(Key const &key) const;
+		};
+
+	private:
+		HashMap<Key, Invite *, KeyHash> index;
+		HashMap<Channel const *, InviteList, PointerHash> by_channel;
+		HashMap<Client const *, InviteList, PointerHash> by_client;
+		InviteList by_age;
+
+		InviteIndex(InviteIndex const &other);
+		InviteIndex &operator=(InviteIndex const &other);
+
+		void remove(Invite *invite);
+
+	public:
+		/* seconds an invite lasts, 0 for ever */
+		long ttl;
+		/* invites per channel, the oldest one makes room for a new one */
+		size_t channel_limit;
+
+	public:
+		InviteIndex();
+		~InviteIndex();
+
+		void add(Channel *channel, Client *client, std::time_t now);
+		bool contains(Channel const *channel, Client const *client) const;
+		void remove(Channel const *channel, Client const *client);
+		void remove_channel(Channel const *channel);
+		void remove_client(Client const *client);
+		void get_clients(Channel const *channel, std::vector<Client *> &clients) const;
+
+		size_t size(void) const;
+		long next_expiry_ms(std::time_t now) const;
+		void expire(std::time_t now);
+};
+
+#endif /* INVITE_INDEX_HPP */
@@ -0,0 +1,43 @@
+#ifndef MASK_HPP
+#define MASK_HPP
+
+#include <string>
+#include <vector>
+
+/*
+A wildcard pattern, '*' for any run of characters and '?' for exactly
+one, compiled once per query. The pattern is folded with the rfc1459
+casemapping and cut at its stars into pieces; matching places the first
+and last pieces at the ends of the subject and finds the others left to
+right, folding the subject as it goes. Matching never allocates.
+*/
+class Mask
+{
+	private:
+		struct Piece
+		{
+			size_t start;
+			size_t size;
+		};
+
+		std::string folded;
+		std::vector<Piece> pieces;
+		bool has_star;
+		bool leading_star;
+		bool trailing_star;
+
+		bool piece_at(Piece const &piece, char const *subject) const;
+
+	public:
+		Mask();
+		explicit Mask(std::string const &pattern);
+
+		bool matches(std::string const &subject) const;
+		bool matches(char const *subject, size_t size) const;
+		bool matches_everything(void) const;
+
+		static bool has_wildcards(std::string const &pattern);
+		static char fold(char c);
+};
+
+#endif // MASK_HPP
@@ -0,0 +1,64 @@
+#ifndef MASK_LIST_HPP
+#define MASK_LIST_HPP
+
+#include "HashMap.hpp"
+#include "Mask.hpp"
+
+#include <ctime>
+#include <string>
+#include <vector>
+
+/*
+A channel's ban or exception list of nick!user@host masks. Masks are
+compiled when they are added and filed by their literal ends: every
+mask by its folded text, which answers masks without wildcards, a mask
+starting with at least key_size literal characters by those, one ending
+with them by those, and the rest in a list that is always tried. A
+check looks up the client's own text, one prefix bucket and one suffix
+bucket, so it costs what the masks sharing the client's ends cost, not
+what the whole list does.
+*/
+class MaskList
+{
+	public:
+		struct Entry
+		{
+			std::string mask;
+			std::string setter;
+			std::time_t set_at;
+			Mask compiled;
+		};
+
+		static const size_t key_size = 4;
+
+	private:
+		typedef HashMap<std::string, std::vector<Entry *>, StringHash> Buckets;
+
+		std::vector<Entry *> entries;
+		HashMap<std::string, Entry *, StringHash> by_mask;
+		Buckets by_prefix;
+		Buckets by_suffix;
+		std::vector<Entry *> unindexed;
+
+		MaskList(MaskList const &other);
+		MaskList &operator=(MaskList const &other);
+
+		Buckets *index_of(std::string const &folded, std::string &key);
+		static bool any_matches(std::vector<Entry *> const *bucket, std::string const &subject);
+		static std::string fold(std::string const &text);
+
+	public:
+		MaskList();
+		~MaskList();
+
+		bool add(std::string const &mask, std::string const &setter, std::time_t set_at);
+		bool remove(std::string const &mask);
+		void clear(void);
+		bool matches(std::string const &subject) const;
+		size_t size(void) const;
+		std::vector<Entry *> const &get_entries(void) const;
+
+		static std::string normalize(std::string const &mask);
+};
+
+#endif /* MASK_LIST_HPP */
@@ -0,0 +1,99 @@
+#ifndef POLLER_HPP
+#define POLLER_HPP
+
+#include <vector>
+#ifdef __APPLE__
+#include <sys/event.h>
+#else
+#include <sys/epoll.h>
+#endif
+
+/*
+The event loop's epoll or kqueue. Connections are watched for input and
+hangups; listeners (and the signalfd) for input only. A connection is
+added with an owner, the uuid of its client, that comes back in each of
+its events so that the loop finds the client without a search. Other
+fds have owner 0.
+
+Write interest changes are not made at once but noted per fd and sent
+before the next wait, so that a connection whose queue fills and drains
+within one loop turn costs nothing. With epoll each fd whose interest
+really changed gets one EPOLL_CTL_MOD; with kqueue all changes, new
+registrations included, go in the changelist of the next kevent() call.
+Closed fds must be removed before they are reused. A write interest
+change the kernel refuses is logged and dropped rather than thrown, so
+that one bad fd cannot stop the loop.
+*/
+class Poller
+{
+	public:
+		struct Event
+		{
+			int fd;
+			unsigned long owner;
+			bool readable;
+			bool writable;
+			bool hangup;
+			bool signal;
+		};
+
+		struct Counters
+		{
+			unsigned long waits;
+			unsigned long events;
+			unsigned long requested;
+			unsigned long submitted;
+		};
+
+	private:
+		struct Interest
+		{
+			bool watched;
+			bool registered_out;
+			bool wanted_out;
+			bool queued;
+			unsigned long owner;
+		};
+
+		int poll_fd;
+		std::vector<Interest> interests;
+		std::vector<int> dirty;
+		std::vector<Event> ready;
+		Counters counters;
+		#ifdef __APPLE__
+		std::vector<struct kevent> changes;
+		std::vector<struct kevent> events;
+		#else
+		std::vector<struct epoll_event> events;
+		#endif
+
+		Poller(Poller const &other);
+		Poller &operator=(Poller const &other);
+
+		Interest &interest_of(int fd);
+		void register_fd(int fd, bool connection);
+		unsigned long owner_of(int fd) const;
+		void submit(void);
+
+	public:
+		Poller();
+		~Poller();
+
+		void open(void);
+		void close(void);
+		int get_fd(void) const;
+		Counters const &get_counters(void) const;
+
+		void add(int fd);
+		void add_connection(int fd, unsigned long owner);
+		#ifdef __APPLE__
+		void add_signal(int sig);
+		#endif
+		void set_writable(int fd, bool writable);
+		void remove(int fd);
+
+		int wait(int timeout_ms, size_t max_events);
+		Event const &get_event(int i) const;
+};
+
+#endif /* POLLER_HPP */
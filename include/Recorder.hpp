@@ -0,0 +1,65 @@
+#ifndef RECORDER_HPP
+#define RECORDER_HPP
+
+#include "StateCodec.hpp"
+
+#include <string>
+
+/*
+Optional recording of the inbound traffic, for ircserv_replay: every
+accepted connection, every chunk read from a client, as it came off the
+socket, and every close, each stamped with the time since the previous
+record. A recording holds whatever clients sent, passwords included.
+
+File: magic, version, start time (seconds since the epoch), then records
+of u8 type, u32 microseconds since the previous record, u32 connection
+id, and the local port for REC_OPEN or the bytes as a string for
+REC_DATA. Records are buffered and written out once flush_bytes have
+piled up or a second has passed. An existing recording is appended to,
+so one file follows the server across upgrades.
+*/
+class Recorder
+{
+	public:
+		static const uint32 magic       = 0x52435249; // "IRCR"
+		static const uint32 version     = 1;
+		static const size_t flush_bytes = 1 << 16;
+		static const unsigned long flush_interval_ns = 1000000000UL;
+
+		enum record_type
+		{
+			REC_OPEN  = 1,
+			REC_DATA  = 2,
+			REC_CLOSE = 3
+		};
+
+	private:
+		std::string path;
+		int fd;
+		unsigned long last_ns;
+		unsigned long flushed_ns;
+		StateWriter buffer;
+
+		Recorder(Recorder const &other);
+		Recorder &operator=(Recorder const &other);
+
+		void put_record(record_type type, uint32 conn);
+		void wrote_record(void);
+
+	public:
+		Recorder();
+		~Recorder();
+
+		bool is_open(void) const;
+		std::string const &get_path(void) const;
+
+		void open(std::string const &path);
+		void close(void);
+		void flush(void);
+
+		void record_open(uint32 conn, int port);
+		void record_data(uint32 conn, char const *data, size_t size);
+		void record_close(uint32 conn);
+};
+
+#endif /* RECORDER_HPP */
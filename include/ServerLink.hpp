@@ -0,0 +1,95 @@
+#ifndef SERVER_LINK_HPP
+#define SERVER_LINK_HPP
+
+#include "App.hpp"
+#include "Channel.hpp"
+
+#include <set>
+#include <string>
+#include <vector>
+
+/*
+State of a connection to a peer server (a TS6-like subset).
+
+Users are identified across servers by uid: the 3-character server id
+followed by the hex uuid of the user on its home server. Users of peer
+servers are kept as Client objects whose uplink is the link they are
+reachable through; links are expected to form a tree.
+
+Each link has its own password from a link block of the config. A
+command is only taken from the link its source is behind: a uid of a
+user introduced on this link, or a server id first seen on it.
+
+Server to server commands:
+	PASS <password> TS 6 :<sid>
+	SERVER <name> <hops> <sid> :<description>
+	:<sid> UID <nick> <hops> <ts> <umodes> <user> <host> <ip> <uid> :<realname>
+	:<sid> SJOIN <ts> <channel> <modes> [<mode params>] :[@]<uid> ...
+	:<sid> TB <channel> <ts> :<topic>
+	:<sid> BMASK <ts> <channel> <b|e> :<mask> ...
+	:<uid> NICK <nick> <ts>
+	:<uid> QUIT :<reason>
+	:<uid> PRIVMSG <channel|uid> :<text>
+	:<uid> KICK <channel> <uid> :<reason>
+	:<uid> TOPIC <channel> :<topic>
+	:<uid> TMODE <ts> <channel> <modes> [<mode params>]
+	:<uid> INVITE <uid> <channel>
+	PING / PONG, ERROR
+*/
+class ServerLink
+{
+	public:
+		struct Command
+		{
+			std::string name;
+			void (ServerLink::*cmd_func)(Client *source, Message const &msg);
+		};
+		static const size_t max_sjoin_len = 400;
+
+	private:
+		App &app;
+		Client &conn;
+		static Command commands[];
+
+		void relay(Message const &msg) const;
+		static std::string join_params(std::vector<std::string> const &params, size_t from);
+		void add_bmask_lines(Channel const &channel, chan_mode_enum mode, std::string &burst) const;
+		bool is_behind(std::string const &server_id) const;
+
+		void uid(Client *source, Message const &msg);
+		void sjoin(Client *source, Message const &msg);
+		void tb(Client *source, Message const &msg);
+		void bmask(Client *source, Message const &msg);
+		void nick(Client *source, Message const &msg);
+		void quit(Client *source, Message const &msg);
+		void privmsg(Client *source, Message const &msg);
+		void kick(Client *source, Message const &msg);
+		void part(Client *source, Message const &msg);
+		void topic(Client *source, Message const &msg);
+		void tmode(Client *source, Message const &msg);
+		void invite(Client *source, Message const &msg);
+		void ping(Client *source, Message const &msg);
+		void error(Client *source, Message const &msg);
+
+	public:
+		std::string name;
+		std::string block;
+		std::string sid;
+		std::string password;
+		std::set<std::string> sids;
+		bool outgoing;
+		bool linked;
+
+	public:
+		ServerLink(App &app, Client &conn);
+
+		void send_handshake(std::string const &password) const;
+		void send_burst(void) const;
+		bool execute(Message const &msg);
+
+		static std::string make_server_id(int port);
+		static std::string uid_line(App const &app, Client const &user);
+		static std::string sjoin_line(App const &app, Channel const &channel, std::string const &members);
+};
+
+#endif /* SERVER_LINK_HPP */
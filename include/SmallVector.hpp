@@ -0,0 +1,61 @@
+#ifndef SMALL_VECTOR_HPP
+#define SMALL_VECTOR_HPP
+
+#include <cstddef>
+#include <vector>
+
+/*
+Sequence that keeps its first N elements inline and only allocates for
+the ones past N. Meant for short lists built and thrown away on a hot
+path. The inline elements are default-constructed once and reused after
+clear(), so append() hands back a slot whose fields must all be set.
+*/
+template <typename T, size_t N>
+class SmallVector
+{
+	private:
+		T items[N];
+		std::vector<T> spill;
+		size_t count;
+
+	public:
+		SmallVector() : count(0)
+		{}
+
+		size_t size(void) const
+		{
+			return count;
+		}
+
+		bool empty(void) const
+		{
+			return count == 0;
+		}
+
+		T &operator[](size_t i)
+		{
+			return i < N ? items[i] : spill[i - N];
+		}
+
+		T const &operator[](size_t i) const
+		{
+			return i < N ? items[i] : spill[i - N];
+		}
+
+		T &append(void)
+		{
+			if (count < N)
+				return items[count++];
+			count++;
+			spill.push_back(T());
+			return spill.back();
+		}
+
+		void clear(void)
+		{
+			count = 0;
+			spill.clear();
+		}
+};
+
+#endif /* SMALL_VECTOR_HPP */
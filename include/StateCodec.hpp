@@ -0,0 +1,50 @@
+#ifndef STATE_CODEC_HPP
+#define STATE_CODEC_HPP
+
+#include "App.hpp"
+
+#include <string>
+
+/*
+Fixed-width little-endian encoding used to carry server state
+between processes and to disk. Strings are length-prefixed.
+*/
+class StateWriter
+{
+	private:
+		std::string buff;
+
+	public:
+		void put_u8(unsigned char value);
+		void put_u32(uint32 value);
+		void put_string(std::string const &value);
+		void put_string(char const *value, size_t size);
+
+		std::string const &data(void) const;
+		void clear(void);
+};
+
+/*
+Reads over a borrowed memory region (a received buffer or a mapped file).
+Throws IEC_BADSTATE when the region ends before the requested field.
+*/
+class StateReader
+{
+	private:
+		char const *data;
+		size_t size;
+		size_t pos;
+
+	public:
+		StateReader(char const *data, size_t size);
+
+		unsigned char get_u8(void);
+		uint32 get_u32(void);
+		std::string get_string(void);
+		void skip(size_t len);
+
+		size_t get_pos(void) const;
+		bool at_end(void) const;
+};
+
+#endif /* STATE_CODEC_HPP */
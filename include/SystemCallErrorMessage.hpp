@@ -20,7 +20,18 @@ enum scem_function
 	SCEM_SOCKET,
 	SCEM_FCNTL,
 	SCEM_KEVENT,
-	SCEM_KQUEUE
+	SCEM_KQUEUE,
+	SCEM_SOCKETPAIR,
+	SCEM_FORK,
+	SCEM_SENDMSG,
+	SCEM_RECVMSG,
+	SCEM_OPEN,
+	SCEM_MMAP,
+	SCEM_WRITE,
+	SCEM_RENAME,
+	SCEM_CONNECT,
+	SCEM_SIGPROCMASK,
+	SCEM_SIGNALFD
 };
 
 class SystemCallErrorMessage
@@ -0,0 +1,118 @@
+#ifndef TRANSPORT_HPP
+#define TRANSPORT_HPP
+
+#include "Poller.hpp"
+
+#include <string>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <vector>
+
+/*
+Where client bytes come from and go to. The calls mirror the socket ones
+(-1 with errno on failure, EAGAIN when nothing can move), and fd is the
+connection handle the Client was made with. set_writable asks to be told
+when a connection can take output again.
+*/
+class Transport
+{
+	public:
+		virtual ~Transport();
+
+		virtual ssize_t recv(int fd, char *buff, size_t size) = 0;
+		virtual ssize_t send(int fd, char const *data, size_t size) = 0;
+		virtual ssize_t sendv(int fd, struct iovec const *iov, int count) = 0;
+		virtual void shutdown(int fd, int how) = 0;
+		virtual void set_writable(int fd, bool writable) = 0;
+};
+
+/*
+Real sockets, registered with the event loop's poller.
+*/
+class SocketTransport : public Transport
+{
+	private:
+		Poller *poller;
+
+	public:
+		explicit SocketTransport(Poller *poller);
+
+		ssize_t recv(int fd, char *buff, size_t size);
+		ssize_t send(int fd, char const *data, size_t size);
+		ssize_t sendv(int fd, struct iovec const *iov, int count);
+		void shutdown(int fd, int how);
+		void set_writable(int fd, bool writable);
+};
+
+/*
+Connections that live in memory, so that the command logic can run
+without sockets: a simulation opens a connection, feeds it input,
+calls handle_msg() and reads back what was sent.
+
+Faults are injected per connection. The capacity is the room for
+output the peer has not taken yet, and a write that does not fit is
+cut short, or fails with EAGAIN when there is no room at all.
+max_write cuts every write, and fail_writes() makes the next writes
+fail with EAGAIN. A connection opened without keep_output drops its
+output as if the peer read it at once, and only counts it. Unknown
+fds fail with EBADF, like -1 does on a socket.
+*/
+class MemoryTransport : public Transport
+{
+	public:
+		static const int first_fd = 1 << 20;
+		static const size_t unlimited = static_cast<size_t>(-1);
+
+	private:
+		struct Connection
+		{
+			bool open;
+			bool keep_output;
+			bool peer_closed;
+			bool shut;
+			bool writable;
+			std::string input;
+			std::string output;
+			size_t capacity;
+			size_t max_write;
+			unsigned long failing_writes;
+			unsigned long bytes_sent;
+		};
+
+		std::vector<Connection> conns;
+		std::vector<int> free_fds;
+		unsigned long calls;
+
+		MemoryTransport(MemoryTransport const &other);
+		MemoryTransport &operator=(MemoryTransport const &other);
+
+		Connection *find(int fd);
+		Connection const *find(int fd) const;
+		ssize_t room_for(Connection &conn, size_t size);
+
+	public:
+		MemoryTransport();
+
+		int open(bool keep_output = true);
+		void close(int fd);
+
+		void feed(int fd, std::string const &data);
+		void close_peer(int fd);
+		std::string take_output(int fd);
+		void set_capacity(int fd, size_t capacity);
+		void set_max_write(int fd, size_t max_write);
+		void fail_writes(int fd, unsigned long count);
+
+		bool is_shut(int fd) const;
+		bool wants_writable(int fd) const;
+		unsigned long get_bytes_sent(int fd) const;
+		unsigned long get_calls(void) const;
+
+		ssize_t recv(int fd, char *buff, size_t size);
+		ssize_t send(int fd, char const *data, size_t size);
+		ssize_t sendv(int fd, struct iovec const *iov, int count);
+		void shutdown(int fd, int how);
+		void set_writable(int fd, bool writable);
+};
+
+#endif /* TRANSPORT_HPP */
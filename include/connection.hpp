@@ -3,24 +3,41 @@
 
 #include "App.hpp"
 #include "Client.hpp"
+#include "Config.hpp"
 
-#define NO_TIMEOUT -1
-#define MAX_MSG_SIZE 512
+#include <vector>
 
-class ConnConst
+struct Listener
 {
-	public:
-		static const int max_events  = 12;
-		static const int max_conns   = 12;
-		static const int time_out_ms = NO_TIMEOUT;
+	int fd;
+	Config::ListenSpec spec;
 };
 
-int parse_port(char *s);
-int listen_sock_init(int port);
-int epoll_init(int listen_sock_fd);
-void accept_in_conns(App &app, int epoll_fd, int listen_sock_fd);
-void close_conn_by_fd(App &app, int fd);
+/* what the signals received since the last loop turn ask for */
+struct SignalRequests
+{
+	bool reload;
+	bool upgrade;
+	bool shutdown;
+};
+
+int parse_port(char const *s);
+int listen_sock_init(Config::ListenSpec const &spec);
+void open_listeners(std::vector<Config::ListenSpec> const &specs, std::vector<Listener> &listeners);
+Listener const *find_listener(std::vector<Listener> const &listeners, int fd);
+int connect_sock_init(Config::LinkSpec const &spec);
+void poller_init(Poller &poller, std::vector<Listener> const &listeners);
+void accept_in_conns(App &app, Listener const &listener);
+void close_conn(App &app, Client &client);
+void flush_conn(Client &client);
 void handle_msg(App &app, Client *client);
+void discard_input(App &app, Client *client);
 void setup_signal_handlers(void);
+int signal_fd_init(Poller &poller);
+void note_signal(int sig, SignalRequests &requests);
+#ifndef __APPLE__
+void read_signals(int sig_fd, SignalRequests &requests);
+#endif
+void begin_shutdown(App &app, std::vector<Listener> &listeners);
 
 #endif /* CONNECTION_HPP */
@@ -0,0 +1,23 @@
+#ifndef UPGRADE_HPP
+#define UPGRADE_HPP
+
+#include "App.hpp"
+#include "connection.hpp"
+
+#include <vector>
+
+#define UPGRADE_FD_ENV "IRCSERV_UPGRADE_FD"
+
+class UpgradeConst
+{
+	public:
+		static const int fds_per_msg = 128;
+		static const uint32 magic    = 0x55435249; // "IRCU"
+		static const uint32 version  = 9;
+};
+
+int get_upgrade_fd(void);
+bool upgrade_server(App &app, std::vector<Listener> const &listeners, char **argv);
+std::vector<Listener> resume_from_upgrade(App &app, int upgrade_fd, std::vector<Config::ListenSpec> const &specs);
+
+#endif /* UPGRADE_HPP */
@@ -0,0 +1,378 @@
+#include <arpa/inet.h>
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <vector>
+#include "InternalError.hpp"
+#include "Recorder.hpp"
+#include "StateCodec.hpp"
+
+/*
+Plays a recording made with record_path back into a running ircserv
+over loopback.
+
+	make replay
+	./ircserv_replay ircserv.record                 original pacing
+	./ircserv_replay ircserv.record --speed 10      ten times faster
+	./ircserv_replay ircserv.record --fast          as fast as it goes
+	./ircserv_replay ircserv.record --port 6668     every connection to 6668
+
+Each recorded connection gets a connection of its own, to the port it
+was accepted on unless --port says otherwise, and is sent the same bytes
+in the same chunks. Whatever the server answers is read and dropped. At
+the end every connection still open is half-closed and the replay waits
+(up to --wait seconds, default 10) for the server to close it, so that
+the time reported covers the server handling every line.
+*/
+
+
+// ============================
+//          Recording
+// ============================
+
+struct Record
+{
+	unsigned char type;
+	uint32 gap_us;
+	uint32 conn;
+	int port;
+	std::string data;
+};
+
+/*
+A recording cut short by a crash ends with a partial record, which is
+dropped.
+*/
+static bool read_recording(char const *path, std::vector<Record> &records)
+{
+	std::ifstream file(path, std::ios::binary);
+	std::string content((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	StateReader reader(content.data(), content.size());
+	Record record;
+
+	if (!file)
+	{
+		std::cerr << "Cannot read " << path << "\n";
+		return false;
+	}
+	try
+	{
+		if (reader.get_u32() != Recorder::magic || reader.get_u32() != Recorder::version)
+		{
+			std::cerr << path << " is not a recording of this version\n";
+			return false;
+		}
+		reader.get_u32();
+		while (!reader.at_end())
+		{
+			record.type = reader.get_u8();
+			record.gap_us = reader.get_u32();
+			record.conn = reader.get_u32();
+			record.port = 0;
+			record.data.clear();
+			if (record.type == Recorder::REC_OPEN)
+				record.port = reader.get_u32();
+			else if (record.type == Recorder::REC_DATA)
+				record.data = reader.get_string();
+			else if (record.type != Recorder::REC_CLOSE)
+			{
+				std::cerr << path << ": unknown record type " << static_cast<int>(record.type) << "\n";
+				return false;
+			}
+			records.push_back(record);
+		}
+	}
+	catch (internal_error_code)
+	{
+		std::cerr << path << ": partial record at the end dropped\n";
+	}
+	return true;
+}
+
+
+// ============================
+//         Connections
+// ============================
+
+struct Connection
+{
+	int fd;
+	std::string pending;
+	bool closing;
+	bool half_closed;
+};
+
+struct Totals
+{
+	unsigned long connections;
+	unsigned long refused;
+	unsigned long dropped;
+	unsigned long bytes;
+	unsigned long lines;
+};
+
+static double now_us(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+static int connect_to(int port)
+{
+	struct sockaddr_in addr;
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (fd == -1)
+		return -1;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == -1
+		|| fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+False when the server closed the connection or the write failed.
+*/
+static bool write_pending(Connection &conn)
+{
+	ssize_t written;
+
+	while (!conn.pending.empty())
+	{
+		written = send(conn.fd, conn.pending.data(), conn.pending.size(), 0);
+		if (written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return true;
+		if (written == -1 && errno == EINTR)
+			continue ;
+		if (written == -1)
+			return false;
+		conn.pending.erase(0, written);
+	}
+	if (conn.closing && !conn.half_closed)
+	{
+		shutdown(conn.fd, SHUT_WR);
+		conn.half_closed = true;
+	}
+	return true;
+}
+
+/*
+Drops what the server sent; false once it closed the connection.
+*/
+static bool drain_input(Connection &conn)
+{
+	char buff[16384];
+	ssize_t bytes;
+
+	while (true)
+	{
+		bytes = recv(conn.fd, buff, sizeof(buff), 0);
+		if (bytes > 0)
+			continue ;
+		if (bytes == -1 && errno == EINTR)
+			continue ;
+		return bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK);
+	}
+}
+
+typedef std::map<uint32, Connection> Connections;
+
+static void drop(Connections &conns, Connections::iterator conn)
+{
+	close(conn->second.fd);
+	conns.erase(conn);
+}
+
+static void apply(Record const &record, Connections &conns, int port, Totals &totals)
+{
+	Connections::iterator found = conns.find(record.conn);
+	Connection conn;
+
+	if (record.type == Recorder::REC_OPEN)
+	{
+		if (found != conns.end())
+			drop(conns, found);
+		conn.fd = connect_to(port ? port : record.port);
+		conn.closing = false;
+		conn.half_closed = false;
+		if (conn.fd == -1)
+		{
+			totals.refused++;
+			return ;
+		}
+		conns[record.conn] = conn;
+		totals.connections++;
+		return ;
+	}
+	if (found == conns.end())
+		return ;
+	if (record.type == Recorder::REC_CLOSE)
+		found->second.closing = true;
+	else
+	{
+		found->second.pending += record.data;
+		totals.bytes += record.data.size();
+		for (std::string::const_iterator c = record.data.begin(); c != record.data.end(); c++)
+			totals.lines += *c == '\n';
+	}
+	if (!write_pending(found->second))
+	{
+		totals.dropped++;
+		drop(conns, found);
+	}
+}
+
+/*
+One poll over every connection: answers are drained, pending bytes
+written, and connections the server closed are dropped. A half-closed
+connection is done once the server closes it.
+*/
+static void poll_connections(Connections &conns, int timeout_ms, Totals &totals)
+{
+	std::vector<struct pollfd> fds;
+	std::vector<uint32> ids;
+	struct pollfd pfd;
+
+	for (Connections::iterator i = conns.begin(); i != conns.end(); i++)
+	{
+		pfd.fd = i->second.fd;
+		pfd.events = POLLIN | (i->second.pending.empty() ? 0 : POLLOUT);
+		pfd.revents = 0;
+		fds.push_back(pfd);
+		ids.push_back(i->first);
+	}
+	if (poll(fds.empty() ? NULL : &fds[0], fds.size(), timeout_ms) <= 0)
+		return ;
+	for (size_t i = 0; i < fds.size(); i++)
+	{
+		Connections::iterator conn = conns.find(ids[i]);
+		bool alive = true;
+
+		if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+			alive = drain_input(conn->second);
+		if (alive && (fds[i].revents & POLLOUT))
+			alive = write_pending(conn->second);
+		if (alive)
+			continue ;
+		if (!conn->second.half_closed || !conn->second.pending.empty())
+			totals.dropped++;
+		drop(conns, conn);
+	}
+}
+
+/*
+Bytes still waiting to be written on a connection. Past max_backlog the
+replay stops feeding records until the server has read some of them.
+*/
+static size_t const max_backlog = 1 << 16;
+
+static size_t backlog(Connections const &conns, uint32 id)
+{
+	Connections::const_iterator conn = conns.find(id);
+
+	return conn == conns.end() ? 0 : conn->second.pending.size();
+}
+
+
+// ============================
+//            Main
+// ============================
+
+int main(int argc, char **argv)
+{
+	std::vector<Record> records;
+	Connections conns;
+	Totals totals = {0, 0, 0, 0, 0};
+	double speed = 1;
+	int port = 0;
+	double wait_s = 10;
+	double start;
+	double due;
+	double deadline;
+	size_t next = 0;
+
+	if (argc < 2)
+	{
+		std::cerr << "Usage: " << argv[0] << " <recording> [--fast] [--speed N] [--port N] [--wait S]\n";
+		return 2;
+	}
+	for (int i = 2; i < argc; i++)
+	{
+		if (!std::strcmp(argv[i], "--fast"))
+			speed = 0;
+		else if (!std::strcmp(argv[i], "--speed") && i + 1 < argc)
+			speed = std::atof(argv[++i]);
+		else if (!std::strcmp(argv[i], "--port") && i + 1 < argc)
+			port = std::atoi(argv[++i]);
+		else if (!std::strcmp(argv[i], "--wait") && i + 1 < argc)
+			wait_s = std::atof(argv[++i]);
+		else
+		{
+			std::cerr << "Unknown option " << argv[i] << "\n";
+			return 2;
+		}
+	}
+	if (!read_recording(argv[1], records))
+		return 1;
+	std::signal(SIGPIPE, SIG_IGN);
+
+	start = now_us();
+	due = start;
+	while (next < records.size())
+	{
+		if (speed > 0)
+			due += records[next].gap_us / speed;
+		while (now_us() < due)
+			poll_connections(conns, static_cast<int>((due - now_us()) / 1000) + 1, totals);
+		apply(records[next], conns, port, totals);
+		while (backlog(conns, records[next].conn) > max_backlog)
+			poll_connections(conns, 100, totals);
+		if (++next % 256 == 0)
+			poll_connections(conns, 0, totals);
+	}
+	for (Connections::iterator i = conns.begin(); i != conns.end(); i++)
+	{
+		i->second.closing = true;
+		write_pending(i->second);
+	}
+	deadline = now_us() + wait_s * 1e6;
+	while (!conns.empty() && now_us() < deadline)
+		poll_connections(conns, 100, totals);
+
+	double elapsed = (now_us() - start) / 1e6;
+	std::cout << std::fixed << std::setprecision(3)
+		<< "records\t" << records.size() << "\n"
+		<< "connections\t" << totals.connections << "\n"
+		<< "refused\t" << totals.refused << "\n"
+		<< "dropped by server\t" << totals.dropped << "\n"
+		<< "unfinished\t" << conns.size() << "\n"
+		<< "bytes\t" << totals.bytes << "\n"
+		<< "lines\t" << totals.lines << "\n"
+		<< "seconds\t" << elapsed << "\n"
+		<< "lines/s\t" << std::setprecision(0) << (elapsed > 0 ? totals.lines / elapsed : 0) << "\n";
+	for (Connections::iterator i = conns.begin(); i != conns.end(); i++)
+		close(i->second.fd);
+	return conns.empty() ? 0 : 1;
+}
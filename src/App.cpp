@@ -1,36 +1,62 @@
 #include "App.hpp"
 #include "Channel.hpp"
+#include "ChannelHistory.hpp"
+#include "ChannelStore.hpp"
 #include "Client.hpp"
+#include "InternalError.hpp"
+#include "Recorder.hpp"
+#include "ServerLink.hpp"
+#include "StateCodec.hpp"
 
 #include <iostream>
 #include <sstream>
 #include <algorithm>
 #include <sys/socket.h>
+#include <cctype>
+#include <cstdlib>
 #include <ctime>
+#include <limits>
 
 // ============================
 //   Constructor & Destructor
 // ============================
 
-App::App(std::string const &name, std::string const &password) : server_password(password), server_name(name)
+App::App(std::string const &name, std::string const &password, Config const &config) : server_password(password),
+	sockets(&poller), server_name(name), server_id("000"), draining(false), config(config), fanout_epoch(0)
 {
+	channel_store = new ChannelStore(config.snapshot_path, config.journal_path);
+	recorder = new Recorder();
+	transport = &sockets;
 	std::time_t result = std::time(NULL);
 	
 	this->server_version = "1.0";
 	this->network_name = "42 London";
 	this->created_at = std::asctime(std::localtime(&result));
-	commands.push_back((Command){"PASS",    &Client::pass});
-	commands.push_back((Command){"NICK",    &Client::nick});
-	commands.push_back((Command){"USER",    &Client::user});
-	commands.push_back((Command){"JOIN",    &Client::join});
-	commands.push_back((Command){"PRIVMSG", &Client::privmsg});
-	commands.push_back((Command){"KICK",    &Client::kick});
-	commands.push_back((Command){"INVITE",  &Client::invite});
-	commands.push_back((Command){"TOPIC",   &Client::topic});
-	commands.push_back((Command){"MODE",    &Client::mode});
-	commands.push_back((Command){"PING",    &Client::ping});
-	commands.push_back((Command){"WHOIS",   NULL});
+	commands.push_back((Command){"CAP",     &Client::cap, NULL});
+	commands.push_back((Command){"PASS",    &Client::pass, NULL});
+	commands.push_back((Command){"NICK",    &Client::nick, NULL});
+	commands.push_back((Command){"USER",    &Client::user, NULL});
+	commands.push_back((Command){"JOIN",    &Client::join, NULL});
+	commands.push_back((Command){"PRIVMSG", &Client::privmsg, NULL});
+	commands.push_back((Command){"NOTICE",  &Client::notice, NULL});
+	commands.push_back((Command){"KICK",    &Client::kick, NULL});
+	commands.push_back((Command){"PART",    &Client::part, NULL});
+	commands.push_back((Command){"QUIT",    &Client::quit, NULL});
+	commands.push_back((Command){"INVITE",  &Client::invite, NULL});
+	commands.push_back((Command){"TOPIC",   &Client::topic, NULL});
+	commands.push_back((Command){"MODE",    &Client::mode, NULL});
+	commands.push_back((Command){"PING",    &Client::ping, NULL});
+	commands.push_back((Command){"CHATHISTORY", &Client::chathistory, NULL});
+	commands.push_back((Command){"SERVER",  &Client::server, NULL});
+	commands.push_back((Command){"CONNECT", &Client::connect, NULL});
+	commands.push_back((Command){"STATS",   &Client::stats, NULL});
+	commands.push_back((Command){"WHO",     &Client::who, NULL});
+	commands.push_back((Command){"WHOIS",   &Client::whois, NULL});
+	commands.push_back((Command){"LIST",    &Client::list, NULL});
+	for (std::vector<Command>::iterator i = commands.begin(); i != commands.end(); i++)
+		i->latency = stats.histogram(i->name);
 
+	apply_config();
 	display_welcome();
 }
 
@@ -38,6 +64,10 @@ App::~App()
 {
 	free_channels();
 	free_clients();
+	delete channel_store;
+	delete recorder;
+	for (std::vector<ConnClass *>::iterator i = classes.begin(); i != classes.end(); i++)
+		delete *i;
 }
 
 
@@ -47,14 +77,88 @@ App::~App()
 
 void App::free_clients(void)
 {
-	for (std::map<uint32, Client *>::iterator it = clients.begin(); it != clients.end(); it++)
-		delete it->second;
+	for (std::vector<ClientSlot>::iterator it = client_slots.begin(); it != client_slots.end(); it++)
+	{
+		delete it->client;
+		it->client = NULL;
+	}
 }
 
 void App::free_channels(void)
 {
-	for (std::map<std::string, Channel *>::iterator it = channels.begin(); it != channels.end(); it++)
+	for (HashMap<ChannelKey, Channel *, ChannelKeyHash>::iterator it = channels.begin(); it != channels.end(); it++)
+	{
+		channel_sizes.remove(it->second);
 		delete it->second;
+	}
+	channels.clear();
+}
+
+
+// ============================
+//        Configuration
+// ============================
+
+/*
+Pushes the settings that live outside App to where they are used.
+*/
+void App::apply_config(void)
+{
+	ChannelHistory::max_channel_bytes = config.history_channel_bytes;
+	ChannelHistory::max_total_bytes = config.history_total_bytes;
+	stats.slow_threshold_ns = config.slow_command_us * 1000UL;
+	invites.ttl = config.invite_ttl_s;
+	invites.channel_limit = config.invite_channel_limit;
+	if (config.record_path.empty())
+		recorder->close();
+	else if (config.record_path != recorder->get_path())
+		recorder->open(config.record_path);
+
+	std::vector<Config::ClassSpec> specs = config.get_classes();
+	for (std::vector<Config::ClassSpec>::const_iterator i = specs.begin(); i != specs.end(); i++)
+	{
+		std::vector<ConnClass *>::iterator cls = classes.begin();
+
+		while (cls != classes.end() && (*cls)->spec.name != i->name)
+			cls++;
+		if (cls != classes.end())
+			(*cls)->spec = *i;
+		else
+		{
+			ConnClass *fresh = new ConnClass;
+
+			fresh->spec = *i;
+			fresh->clients = 0;
+			fresh->sendq_bytes = 0;
+			fresh->evictions = 0;
+			classes.push_back(fresh);
+		}
+	}
+}
+
+/*
+Called from conn_loop on SIGHUP. A file that fails to load leaves the
+running configuration untouched. Connections are never dropped: smaller
+limits only apply to what happens next.
+*/
+void App::reload_config(void)
+{
+	Config fresh;
+
+	if (config.path.empty())
+		return ;
+	try
+	{
+		fresh.load(config.path);
+	}
+	catch (internal_error_code iec)
+	{
+		std::cerr << "Config: " << InternalError::get_error_message(iec) << ", keeping the current one\n";
+		return ;
+	}
+	config.reload(fresh);
+	apply_config();
+	std::cout << "Reloaded config from " << config.path << "\n";
 }
 
 
@@ -67,100 +171,719 @@ bool App::is_correct_pwd(std::string const &password) const
 	return password == server_password;
 }
 
+/*
+Timeout for the next poll: the configured one, cut short when an invite
+expires or a throttled client gets flood budget back sooner, so that
+run_timers() gets to them on time, and none while a WHO or a LIST can
+go on.
+*/
+int App::get_poll_timeout(void) const
+{
+	long timeout = config.poll_timeout_ms;
+	long expiry = invites.next_expiry_ms(std::time(NULL));
+	unsigned long now_us = CycleClock::monotonic_ns() / 1000;
+
+	if (expiry >= 0 && (timeout < 0 || expiry < timeout))
+		timeout = expiry;
+	if (has_runnable_who() || has_runnable_list())
+		return 0;
+	for (std::vector<uint32>::const_iterator i = throttled.begin(); i != throttled.end(); i++)
+	{
+		Client const *client = get_client(*i);
+		long wait;
+
+		if (!client)
+			continue ;
+		wait = client->flood_wait_ms(now_us);
+		if (timeout < 0 || wait < timeout)
+			timeout = wait;
+	}
+	return timeout;
+}
+
+void App::run_timers(void)
+{
+	std::vector<uint32> waiting;
+
+	invites.expire(std::time(NULL));
+	if (draining)
+		return ;
+	run_who_queries();
+	run_list_queries();
+	waiting.swap(throttled);
+	for (std::vector<uint32>::const_iterator i = waiting.begin(); i != waiting.end(); i++)
+	{
+		Client *client = get_client(*i);
+
+		if (!client)
+			continue ;
+		client->set_throttled(false);
+		if (client->get_msg_buff().empty())
+			continue ;
+		input_buffer.assign(client->get_msg_buff().begin(), client->get_msg_buff().end());
+		run_input(*client, &input_buffer[0], input_buffer.size());
+	}
+}
+
+std::string App::get_isupport_tokens(void) const
+{
+	std::ostringstream oss;
+
+	oss << "CASEMAPPING=rfc1459 CHANTYPES=#& NICKLEN=" << config.nick_max_len << " CHANNELLEN=200"
+		<< " CHATHISTORY=" << ChannelHistory::max_query_limit
+		<< " TARGMAX=PRIVMSG:" << max_targets << ",NOTICE:" << max_targets
+		<< " MODES=" << Channel::modes_per_line
+		<< " CHANMODES=be,k,l,it EXCEPTS=e MAXLIST=be:" << config.ban_list_limit
+		<< " ELIST=CMNTU SAFELIST";
+	return oss.str();
+}
+
+std::string const &App::get_password(void) const
+{
+	return server_password;
+}
+
+
+// ============================
+//     Connection classes
+// ============================
+
+/*
+Unknown names fall back to the "default" class, which always exists and
+comes first.
+*/
+ConnClass *App::find_class(std::string const &name) const
+{
+	for (std::vector<ConnClass *>::const_iterator i = classes.begin(); i != classes.end(); i++)
+	{
+		if ((*i)->spec.name == name)
+			return *i;
+	}
+	return classes[0];
+}
+
+ConnClass *App::find_class_by_password(std::string const &password) const
+{
+	for (std::vector<ConnClass *>::const_iterator i = classes.begin(); i != classes.end(); i++)
+	{
+		if (!(*i)->spec.password.empty() && (*i)->spec.password == password)
+			return *i;
+	}
+	return NULL;
+}
+
+std::vector<ConnClass *> const &App::get_classes(void) const
+{
+	return classes;
+}
+
 
 // ============================
 //          Clients
 // ============================
 
-void App::add_client(Client *new_client)
+App::ClientSlot::ClientSlot() : client(NULL), generation(1) {}
+
+/*
+Stores the client in a free slot (or a new one) and hands it a uuid built
+from the slot index and the slot generation. Both operations are O(1).
+Once every index a uuid can hold is taken, the client is refused: false
+is returned and the caller still owns it.
+*/
+bool App::add_client(Client *new_client)
 {
-	clients[new_client->get_uuid()] = new_client;
+	uint32 index;
+
+	if (free_client_slots.empty())
+	{
+		if (client_slots.size() > uuid_index_mask)
+			return false;
+		index = client_slots.size();
+		client_slots.push_back(ClientSlot());
+	}
+	else
+	{
+		index = free_client_slots.back();
+		free_client_slots.pop_back();
+	}
+	client_slots[index].client = new_client;
+	new_client->set_uuid((client_slots[index].generation << uuid_index_bits) | index);
+	index_nick(new_client, "");
+	return true;
 }
 
+/*
+Bumping the generation on release makes every outstanding copy of the
+old uuid stale, so get_client() returns NULL for it even after the slot is reused.
+Leaving the channels costs one unlink per membership; the peers still in
+them get a single QUIT each.
+*/
 void App::remove_client(uint32 uuid)
 {
-	std::map<uint32, Client *>::iterator it;
+	Client *client;
+	uint32 index;
 
-	it = clients.find(uuid);
-	if (it == clients.end())
+	client = get_client(uuid);
+	if (!client)
 		return ;
 
-	it->second->remove_channels();
-	it->second->remove_invites();
+	if (client->get_link())
+	{
+		std::vector<Client *>::iterator it = std::find(links.begin(), links.end(), client);
+		if (it != links.end())
+			links.erase(it);
+		std::map<std::string, Client *> remotes(remote_clients);
+		for (std::map<std::string, Client *>::iterator i = remotes.begin(); i != remotes.end(); i++)
+		{
+			if (i->second->get_uplink() == client)
+				remove_client(i->second->get_uuid());
+		}
+	}
+	if (client->get_quit_reason().empty())
+		client->set_quit_reason("Client exited");
+	if (client->is_registered_client())
+	{
+		propagate(client->get_uplink(), ':' + client->get_uid() + " QUIT :" + client->get_quit_reason());
+		client->broadcast_quit(client->get_quit_reason());
+	}
+	if (client->is_remote())
+		remote_clients.erase(client->get_uid());
+	else
+		recorder->record_close(uuid);
+
+	client->remove_channels();
+	client->remove_invites();
+	if (find_client_by_nick(client->get_nickname()) == client)
+		nicks.erase(casefold(client->get_nickname()));
 
-	delete it->second;
-	clients.erase(uuid);
+	delete client;
+	index = uuid & uuid_index_mask;
+	client_slots[index].client = NULL;
+	client_slots[index].generation = (client_slots[index].generation + 1) & uuid_generation_mask;
+	if (client_slots[index].generation == 0)
+		client_slots[index].generation = 1;
+	free_client_slots.push_back(index);
 }
 
 Client *App::get_client(uint32 uuid) const
 {
-	std::map<uint32, Client *>::const_iterator it;		
-	
-	it = clients.find(uuid);
-	
-	if (it == clients.end())
+	uint32 index = uuid & uuid_index_mask;
+
+	if (index >= client_slots.size())
 		return (NULL);
-	return (it->second);
+	if (client_slots[index].generation != (uuid >> uuid_index_bits))
+		return (NULL);
+	return (client_slots[index].client);
+}
+
+std::vector<Client *> App::get_clients(void) const
+{
+	std::vector<Client *> res;
+
+	for (std::vector<ClientSlot>::const_iterator i = client_slots.begin(); i != client_slots.end(); i++)
+	{
+		if (i->client)
+			res.push_back(i->client);
+	}
+	return res;
+}
+
+/*
+Appends the local users whose nick matches, at most limit of them,
+walking client_slots in place. The walk is not paced: it stops at the
+limit or at the end of the slots, within the calling command.
+*/
+void App::find_users_by_mask(Mask const &mask, size_t limit, std::vector<Client *> &users) const
+{
+	for (std::vector<ClientSlot>::const_iterator i = client_slots.begin(); i != client_slots.end() && limit; i++)
+	{
+		Client *user = i->client;
+
+		if (user && user->is_registered_client() && !user->get_link() && mask.matches(user->get_nickname()))
+		{
+			users.push_back(user);
+			limit--;
+		}
+	}
 }
 
+bool App::has_pending_output(void) const
+{
+	for (std::vector<ClientSlot>::const_iterator i = client_slots.begin(); i != client_slots.end(); i++)
+	{
+		if (i->client && i->client->has_pending_output())
+			return true;
+	}
+	return false;
+}
+
+/*
+Nicks are keyed by their rfc1459 casefolded form, the CASEMAPPING we
+advertise, so Alice and alice are the same nick.
+*/
 Client *App::find_client_by_nick(std::string const &nick) const
 {
-	for (std::map<uint32, Client *>::const_iterator i = clients.begin(); i != clients.end(); i++)
+	Client *const *client = nicks.find(casefold(nick));
+
+	return client ? *client : NULL;
+}
+
+/*
+Keeps the nick index in step with the client's nickname; call it
+whenever the nickname changes.
+*/
+void App::index_nick(Client *client, std::string const &old_nick)
+{
+	if (!old_nick.empty() && find_client_by_nick(old_nick) == client)
+		nicks.erase(casefold(old_nick));
+	if (!client->get_nickname().empty())
+		nicks[casefold(client->get_nickname())] = client;
+}
+
+Client *App::find_client_by_uid(std::string const &uid) const
+{
+	std::map<std::string, Client *>::const_iterator it;
+	std::istringstream iss;
+	uint32 uuid;
+
+	if (uid.compare(0, server_id.size(), server_id) == 0)
+	{
+		iss.str(uid.substr(server_id.size()));
+		if (!(iss >> std::hex >> uuid))
+			return NULL;
+		return get_client(uuid);
+	}
+	it = remote_clients.find(uid);
+	if (it == remote_clients.end())
+		return NULL;
+	return it->second;
+}
+
+void App::add_remote_client(Client *client)
+{
+	remote_clients[client->get_uid()] = client;
+}
+
+
+// ============================
+//             WHO
+// ============================
+
+void App::start_who(Client const &requester, std::string const &mask_text)
+{
+	WhoQuery query;
+
+	query.requester = requester.get_uuid();
+	query.mask_text = mask_text;
+	query.mask = Mask(mask_text);
+	query.next_slot = 0;
+	who_queries.push_back(query);
+}
+
+/*
+Each turn a query scans at most who_slots_per_turn slots, and stops early
+once the requester's output backs up; it goes on when the socket has
+taken everything, so a WHO * is paced by the client that asked for it.
+A client's queries run one after the other. The reply line is built in
+one buffer for the whole turn.
+*/
+void App::run_who_queries(void)
+{
+	std::string line;
+	std::map<std::string, std::string> info;
+
+	for (size_t q = 0; q < who_queries.size(); )
+	{
+		WhoQuery &query = who_queries[q];
+		Client *requester = get_client(query.requester);
+		bool waiting = false;
+
+		if (!requester || !requester->get_quit_reason().empty())
+		{
+			who_queries.erase(who_queries.begin() + q);
+			continue ;
+		}
+		for (size_t earlier = 0; earlier < q && !waiting; earlier++)
+			waiting = who_queries[earlier].requester == query.requester;
+		if (waiting || requester->has_pending_output())
+		{
+			q++;
+			continue ;
+		}
+		size_t end = std::min(client_slots.size(), query.next_slot + who_slots_per_turn);
+		for (; query.next_slot < end && !requester->has_pending_output(); query.next_slot++)
+		{
+			Client const *user = client_slots[query.next_slot].client;
+
+			if (user && user->is_registered_client() && !user->get_link() && user->matches(query.mask))
+				requester->send_who_reply(*user, "*", false, line);
+		}
+		if (query.next_slot < client_slots.size())
+		{
+			q++;
+			continue ;
+		}
+		info["client"] = requester->get_full_nickname();
+		info["mask"] = query.mask_text;
+		requester->send_numeric_reply(RPL_ENDOFWHO, info);
+		who_queries.erase(who_queries.begin() + q);
+	}
+}
+
+/*
+True when a query could make progress right now, which keeps the poll
+from sleeping.
+*/
+bool App::has_runnable_who(void) const
+{
+	for (std::vector<WhoQuery>::const_iterator i = who_queries.begin(); i != who_queries.end(); i++)
 	{
-		if (i->second->get_nickname() == nick)
-			return i->second;
+		Client const *requester = get_client(i->requester);
+
+		if (!requester || !requester->has_pending_output())
+			return true;
+	}
+	return false;
+}
+
+
+
+// ============================
+//             LIST
+// ============================
+
+ListFilter::ListFilter() :
+	min_users(1),
+	max_users(static_cast<unsigned long>(-1)),
+	min_created(0),
+	max_created(std::numeric_limits<std::time_t>::max()),
+	min_topic_time(0),
+	max_topic_time(max_created)
+{}
+
+/*
+False when the item is none of >n, <n, C>n, C<n, T>n, T<n, a mask or a
+'!' mask, which leaves a channel name. Times are in minutes; a T
+condition leaves out channels without a topic.
+*/
+bool ListFilter::add_condition(std::string const &condition, std::time_t now)
+{
+	size_t op = condition[0] == 'C' || condition[0] == 'T' ? 1 : 0;
+	char *end;
+	unsigned long n;
+	std::time_t at;
+
+	if (condition[0] == '!')
+	{
+		excluded.push_back(Mask(condition.substr(1)));
+		return true;
+	}
+	if (Mask::has_wildcards(condition))
+	{
+		masks.push_back(Mask(condition));
+		return true;
+	}
+	if (condition.size() <= op + 1 || (condition[op] != '<' && condition[op] != '>')
+		|| !std::isdigit(static_cast<unsigned char>(condition[op + 1])))
+		return false;
+	n = std::strtoul(condition.c_str() + op + 1, &end, 10);
+	if (*end)
+		return false;
+	at = now - static_cast<std::time_t>(n) * 60;
+	if (op == 0 && condition[0] == '>')
+		min_users = std::max(min_users, n + 1);
+	else if (op == 0)
+		max_users = n ? std::min(max_users, n - 1) : 0;
+	else if (condition[op] == '>')
+		(condition[0] == 'C' ? max_created : max_topic_time) = at;
+	else
+		(condition[0] == 'C' ? min_created : min_topic_time) = at + 1;
+	if (condition[0] == 'T')
+		min_topic_time = std::max(min_topic_time, static_cast<std::time_t>(1));
+	return true;
+}
+
+bool ListFilter::accepts(Channel const &channel) const
+{
+	unsigned long users = channel.get_client_count();
+	bool named = masks.empty();
+
+	if (users < min_users || users > max_users)
+		return false;
+	if (channel.get_created_at() < min_created || channel.get_created_at() > max_created
+		|| channel.get_topic_time() < min_topic_time || channel.get_topic_time() > max_topic_time)
+		return false;
+	for (std::vector<Mask>::const_iterator i = masks.begin(); i != masks.end() && !named; i++)
+		named = i->matches(channel.name);
+	for (std::vector<Mask>::const_iterator i = excluded.begin(); i != excluded.end() && named; i++)
+		named = !i->matches(channel.name);
+	return named;
+}
+
+void App::start_list(Client const &requester, ListFilter const &filter)
+{
+	ListQuery query;
+
+	query.requester = requester.get_uuid();
+	query.cursor = channel_sizes.open_cursor(filter.min_users, filter.max_users);
+	query.filter = filter;
+	list_queries.push_back(query);
+}
+
+/*
+Paced like run_who_queries(): at most list_channels_per_turn channels a
+turn, and nothing while the requester has output queued. Only the
+buckets that can hold the requested member counts are walked.
+*/
+void App::run_list_queries(void)
+{
+	std::string line;
+	std::map<std::string, std::string> info;
+
+	for (size_t q = 0; q < list_queries.size(); )
+	{
+		ListQuery &query = list_queries[q];
+		Client *requester = get_client(query.requester);
+		Channel *channel = NULL;
+		bool waiting = false;
+
+		if (!requester || !requester->get_quit_reason().empty())
+		{
+			channel_sizes.close_cursor(query.cursor);
+			list_queries.erase(list_queries.begin() + q);
+			continue ;
+		}
+		for (size_t earlier = 0; earlier < q && !waiting; earlier++)
+			waiting = list_queries[earlier].requester == query.requester;
+		if (waiting || requester->has_pending_output())
+		{
+			q++;
+			continue ;
+		}
+		for (size_t visited = 0; visited < list_channels_per_turn && !requester->has_pending_output(); visited++)
+		{
+			channel = channel_sizes.next(query.cursor);
+			if (!channel)
+				break ;
+			if (query.filter.accepts(*channel))
+				requester->send_list_reply(*channel, line);
+		}
+		if (channel)
+		{
+			q++;
+			continue ;
+		}
+		channel_sizes.close_cursor(query.cursor);
+		info["client"] = requester->get_full_nickname();
+		requester->send_numeric_reply(RPL_LISTEND, info);
+		list_queries.erase(list_queries.begin() + q);
+	}
+}
+
+bool App::has_runnable_list(void) const
+{
+	for (std::vector<ListQuery>::const_iterator i = list_queries.begin(); i != list_queries.end(); i++)
+	{
+		Client const *requester = get_client(i->requester);
+
+		if (!requester || !requester->has_pending_output())
+			return true;
+	}
+	return false;
+}
+
+/*
+Before an upgrade hands the clients over: queries in progress are not
+part of the state, so each one is ended with what it sent so far and
+its RPL_ENDOFWHO or RPL_LISTEND, which goes over in the send queue.
+*/
+void App::end_pending_queries(void)
+{
+	std::map<std::string, std::string> info;
+
+	for (std::vector<WhoQuery>::const_iterator i = who_queries.begin(); i != who_queries.end(); i++)
+	{
+		Client *requester = get_client(i->requester);
+
+		if (!requester || !requester->get_quit_reason().empty())
+			continue ;
+		info["client"] = requester->get_full_nickname();
+		info["mask"] = i->mask_text;
+		requester->send_numeric_reply(RPL_ENDOFWHO, info);
+	}
+	who_queries.clear();
+	for (std::vector<ListQuery>::const_iterator i = list_queries.begin(); i != list_queries.end(); i++)
+	{
+		Client *requester = get_client(i->requester);
+
+		channel_sizes.close_cursor(i->cursor);
+		if (!requester || !requester->get_quit_reason().empty())
+			continue ;
+		info["client"] = requester->get_full_nickname();
+		requester->send_numeric_reply(RPL_LISTEND, info);
+	}
+	list_queries.clear();
+}
+
+/*
+When the counter wraps, every client's mark is cleared first so that a
+mark left from long ago cannot pass for the new epoch.
+*/
+unsigned int App::next_fanout_epoch(void)
+{
+	if (++fanout_epoch == 0)
+	{
+		for (std::vector<ClientSlot>::const_iterator i = client_slots.begin(); i != client_slots.end(); i++)
+		{
+			if (i->client)
+				i->client->clear_fanout_mark();
+		}
+		fanout_epoch = 1;
+	}
+	return fanout_epoch;
+}
+
+
+// ============================
+//        Server links
+// ============================
+
+void App::add_link(Client *link)
+{
+	links.push_back(link);
+}
+
+/*
+The link a server is behind, whether it is the peer itself or a server
+further away that introduced users through it.
+*/
+Client *App::find_link_by_sid(std::string const &sid) const
+{
+	for (std::vector<Client *>::const_iterator i = links.begin(); i != links.end(); i++)
+	{
+		if ((*i)->get_link()->sids.count(sid))
+			return *i;
 	}
 	return NULL;
 }
 
-Client *App::find_client_by_fd(int fd) const
+/*
+The link made with the link block of that name, in either direction; also
+finds the outgoing links still connecting, which are not in links yet.
+*/
+Client *App::find_link_by_block(std::string const &block) const
 {
-	for (std::map<uint32, Client *>::const_iterator i = clients.begin(); i != clients.end(); i++)
+	for (std::vector<ClientSlot>::const_iterator i = client_slots.begin(); i != client_slots.end(); i++)
 	{
-		if (i->second->get_fd() == fd)
-			return i->second;
+		if (i->client && i->client->get_link() && i->client->get_link()->block == block)
+			return i->client;
 	}
 	return NULL;
 }
 
+bool App::has_links(void) const
+{
+	return !links.empty();
+}
+
+/*
+Sends a server command to every linked server but the one it came from.
+*/
+void App::propagate(Client const *origin, std::string const &line) const
+{
+	for (std::vector<Client *>::const_iterator i = links.begin(); i != links.end(); i++)
+	{
+		if (*i != origin)
+			(*i)->send_message(line);
+	}
+}
+
+
 // ============================
 //          Channels
 // ============================
 
-Channel *App::create_channel(std::string const &nick, std::string const &channel_name)
+Channel *App::create_channel(std::string const &channel_name)
 {
 	Channel *channel;
 
-	channel = new Channel(*this, nick, channel_name);
+	channel = new Channel(*this, channel_name);
 
 	return channel;
 }
 
 void App::add_channel(Channel *channel)
 {
-	channels[channel->name] = channel;
+	channels[channel->get_key()] = channel;
+	channel_sizes.add(channel);
+	save_channel(*channel);
 }
 
 void App::remove_channel(std::string const &channel_name)
 {
-	std::map<std::string, Channel *>::iterator it;
+	ChannelKey key(channel_name);
+	Channel **channel;
 
-	it = channels.find(channel_name);
-	if (it == channels.end())
+	channel = channels.find(key);
+	if (!channel)
 		return ;
 
-	delete it->second;
-	channels.erase(it);
+	channel_store->record_remove((*channel)->name);
+	channel_sizes.remove(*channel);
+	delete *channel;
+	channels.erase(key);
 }
 
+/*
+Channel names are case-insensitive: "#Foo" finds "#foo".
+*/
 Channel *App::find_channel_by_name(std::string const &channel_name) const
 {
-	std::map<std::string, Channel *>::const_iterator it;
+	Channel *const *channel = channels.find(ChannelKey(channel_name));
 
-	it = channels.find(channel_name);
-	if (it == channels.end())
-		return NULL;
-	return it->second;
+	return channel ? *channel : NULL;
+}
+
+std::vector<Channel *> App::get_channels(void) const
+{
+	std::vector<Channel *> res;
+
+	res.reserve(channels.size());
+	for (HashMap<ChannelKey, Channel *, ChannelKeyHash>::const_iterator i = channels.begin(); i != channels.end(); i++)
+		res.push_back(i->second);
+	return res;
+}
+
+/*
+Journals the channel settings after a mutation; the record is written by
+sync_channel_store().
+*/
+void App::save_channel(Channel const &channel)
+{
+	channel_store->record_channel(channel);
+}
+
+/*
+Once per loop turn: writes the records of the turn with one write(), or
+folds the journal into a new snapshot once it outgrows the previous one.
+*/
+void App::sync_channel_store(void)
+{
+	if (channel_store->needs_compaction())
+		channel_store->compact(get_channels());
+	else
+		channel_store->flush();
+}
+
+void App::load_saved_channels(void)
+{
+	channel_store->load(*this);
+}
+
+void App::start_channel_journal(void)
+{
+	channel_store->open_journal();
+	channel_store->compact(get_channels());
 }
 
 
@@ -168,6 +891,31 @@ Channel *App::find_channel_by_name(std::string const &channel_name) const
 //       Helper functions
 // ============================
 
+/*
+rfc1459 casemapping: besides A-Z, the characters [\]^ are the
+uppercase forms of {|}~.
+*/
+std::string App::casefold(std::string const &name)
+{
+	std::string res(name);
+
+	for (std::string::iterator c = res.begin(); c != res.end(); c++)
+	{
+		if (*c >= 'A' && *c <= '^')
+			*c += 'a' - 'A';
+	}
+	return res;
+}
+
+ChannelKey::ChannelKey() : hash(0) {}
+
+ChannelKey::ChannelKey(std::string const &name) : folded(App::casefold(name)), hash(StringHash()(folded)) {}
+
+bool ChannelKey::operator==(ChannelKey const &other) const
+{
+	return hash == other.hash && folded == other.folded;
+}
+
 static void skip_space(std::istringstream &msg_stream)
 {
 	while (msg_stream.peek() == ' ')
@@ -185,25 +933,137 @@ std::string App::create_message(std::string const &prefix, std::string const &cm
 // ============================
 
 /*
-Runs the command and sends appropriate replies.
+Runs the complete lines of [data, data + size), the client's input,
+stopping when the client quits or runs out of flood budget. What is left
+is saved in the client. A throttled client is resumed
+from run_timers(); one whose waiting input outgrows the recvq of its
+class (never less than one line) is disconnected. A line longer than
+max_msg_size is cut there and the lines after it still run. Until its
+CRLF comes, only its first bytes are kept, along with its last byte in
+case that is the CR.
+*/
+void App::run_input(Client &user, char const *data, size_t size)
+{
+	size_t const max_msg_size = config.max_msg_size;
+	char const *end = data + size;
+	unsigned long now_us = CycleClock::monotonic_ns() / 1000;
+	ConnClass const *conn_class = user.get_class();
+	std::string line;
+	char const *crlf;
+	Message message;
+	bool overlong = false;
+
+	while (user.get_quit_reason().empty())
+	{
+		crlf = std::search(data, end, CRLF, CRLF + 2);
+		if (crlf == end)
+		{
+			overlong = static_cast<size_t>(end - data) > max_msg_size;
+			break ;
+		}
+		if (!user.take_flood_token(now_us))
+		{
+			if (!user.is_throttled())
+			{
+				user.set_throttled(true);
+				throttled.push_back(user.get_uuid());
+			}
+			break ;
+		}
+		line.assign(data, std::min(static_cast<size_t>(crlf - data), max_msg_size - 2));
+		data = crlf + 2;
+		std::cout << "Completed msg from uuid:" << user.pretty_uuid() << " ->" << line << "\n";
+		if (-1 == parse_message(user, line, message))
+			std::cerr << "Cannot parse message from uuid:" << user.pretty_uuid() << " ->" << line << "\n";
+		else
+		{
+			std::cout << "EXEC msg from uuid:" << user.pretty_uuid() << " ->" << line << "\n";
+			execute_message(user, message);
+		}
+	}
+	if (overlong)
+	{
+		line.assign(data, max_msg_size - 1);
+		line += end[-1];
+		return user.set_msg_buff(line.data(), line.size());
+	}
+	user.set_msg_buff(data, end - data);
+	if (conn_class && !user.get_link()
+			&& static_cast<size_t>(end - data) > std::max(static_cast<size_t>(conn_class->spec.recvq), max_msg_size))
+		user.evict("Excess Flood");
+}
+
+/*
+Runs the command and times it. The latency goes to the histogram of the
+command, and runs of at least slow_command_us also go to the slow log.
 */
 void App::execute_message(Client &user, Message const &msg)
+{
+	unsigned long bytes = stats.get_bytes_out();
+	unsigned long start = CycleClock::now();
+	LatencyHistogram *latency;
+	unsigned long ns;
+
+	latency = run_command(user, msg);
+	ns = CycleClock::to_ns(CycleClock::now() - start);
+	latency->record(ns);
+	if (stats.slow_threshold_ns && ns >= stats.slow_threshold_ns)
+		report_slow_command(user, msg, ns, stats.get_bytes_out() - bytes);
+}
+
+/*
+Returns the histogram the run should be counted in. Unknown commands
+share the "*" one so that junk from clients cannot grow the table; so
+does whatever a server link sent that ServerLink::execute() ignored.
+*/
+LatencyHistogram *App::run_command(Client &user, Message const &msg)
 {
 	std::map<std::string, std::string> info;
-	
+
+	if (user.is_server_link())
+	{
+		if (user.get_link()->execute(msg))
+			return stats.histogram(msg.command);
+		return stats.histogram("*");
+	}
 	for (std::vector<Command>::const_iterator i = commands.begin(); i < commands.end(); i++)
 	{
 		if (i->name == msg.command)
 		{
 			if (i->cmd_func)
-				return (user.*(i->cmd_func))(msg.params);
-			else
-				return ;
+				(user.*(i->cmd_func))(msg.params);
+			return i->latency;
 		}
 	}
 	info["client"] = user.get_full_nickname();
 	info["command"] = msg.command;
 	user.send_numeric_reply(ERR_UNKNOWNCOMMAND, info);
+	return stats.histogram("*");
+}
+
+/*
+The target is the first parameter; when it names a channel (the first
+one of a list), its size is logged too since it drives the fanout cost.
+*/
+void App::report_slow_command(Client const &user, Message const &msg, unsigned long ns, unsigned long bytes)
+{
+	CommandStats::SlowEntry entry;
+	Channel *channel;
+
+	entry.when = std::time(NULL);
+	entry.command = msg.command;
+	entry.source = user.is_server_link() ? user.get_link()->name : user.get_nickname();
+	entry.channel_size = -1;
+	entry.ns = ns;
+	entry.bytes = bytes;
+	if (!msg.params.empty())
+	{
+		entry.target = msg.params[0];
+		channel = find_channel_by_name(entry.target.substr(0, entry.target.find(',')));
+		if (channel)
+			entry.channel_size = channel->get_client_count();
+	}
+	stats.add_slow(entry);
 }
 
 
@@ -222,12 +1082,13 @@ int App::parse_message(Client &user, std::string const &msg_string, Message &msg
 
 	if (!msg.params.empty())
 		msg.params.clear();
+	msg.prefix.clear();
 
 	if (msg_stream.peek() == ':')
 	{
 		msg_stream.ignore(1);
 		std::getline(msg_stream, msg.prefix, ' ');
-		if (!user.is_registered_client() || user.get_nickname() != msg.prefix)
+		if (!user.is_server_link() && (!user.is_registered_client() || user.get_nickname() != msg.prefix))
 			return -1;
 		skip_space(msg_stream);
 	}
@@ -254,6 +1115,82 @@ int App::parse_message(Client &user, std::string const &msg_string, Message &msg
 
 	return 0;
 }
+// ============================
+//        Saved state
+// ============================
+
+/*
+Writes the slot map, every client and every channel. Sockets cannot be
+serialized, so the fd of each written client is appended to client_fds
+in the same order and has to travel next to the data.
+*/
+void App::serialize_state(StateWriter &out, std::vector<int> &client_fds) const
+{
+	std::vector<Client *> clients = get_clients();
+
+	out.put_string(created_at);
+	out.put_u32(client_slots.size());
+	for (std::vector<ClientSlot>::const_iterator i = client_slots.begin(); i != client_slots.end(); i++)
+		out.put_u32(i->generation);
+	out.put_u32(free_client_slots.size());
+	for (std::vector<uint32>::const_iterator i = free_client_slots.begin(); i != free_client_slots.end(); i++)
+		out.put_u32(*i);
+
+	out.put_u32(clients.size());
+	for (std::vector<Client *>::const_iterator i = clients.begin(); i != clients.end(); i++)
+	{
+		out.put_u32((*i)->get_uuid());
+		(*i)->serialize(out);
+		client_fds.push_back((*i)->get_fd());
+	}
+
+	out.put_u32(channels.size());
+	for (HashMap<ChannelKey, Channel *, ChannelKeyHash>::const_iterator i = channels.begin(); i != channels.end(); i++)
+		i->second->serialize(out);
+}
+
+/*
+Counterpart of serialize_state(). Client uuids are kept as they were,
+so the slot map is rebuilt exactly instead of allocating new slots.
+*/
+void App::restore_state(StateReader &in, std::vector<int> const &client_fds)
+{
+	uint32 count;
+	uint32 uuid;
+	uint32 index;
+
+	created_at = in.get_string();
+	count = in.get_u32();
+	if (count > uuid_index_mask + 1)
+		throw (IEC_BADSTATE);
+	client_slots.assign(count, ClientSlot());
+	for (uint32 i = 0; i < count; i++)
+		client_slots[i].generation = in.get_u32();
+	count = in.get_u32();
+	free_client_slots.clear();
+	for (uint32 i = 0; i < count; i++)
+		free_client_slots.push_back(in.get_u32());
+
+	count = in.get_u32();
+	if (count != client_fds.size())
+		throw (IEC_BADSTATE);
+	for (uint32 i = 0; i < count; i++)
+	{
+		uuid = in.get_u32();
+		index = uuid & uuid_index_mask;
+		if (index >= client_slots.size() || client_slots[index].client)
+			throw (IEC_BADSTATE);
+		client_slots[index].client = Client::deserialize(*this, client_fds[i], in);
+		client_slots[index].client->set_uuid(uuid);
+		index_nick(client_slots[index].client, "");
+	}
+
+	count = in.get_u32();
+	for (uint32 i = 0; i < count; i++)
+		add_channel(Channel::deserialize(*this, in));
+}
+
+
 // ==========================
 //		   Misc
 // ==========================
@@ -1,9 +1,15 @@
 #include "Channel.hpp"
+#include "ChannelSizeIndex.hpp"
 #include "Client.hpp"
 #include "IRCReply.hpp"
+#include "InternalError.hpp"
+#include "ServerLink.hpp"
+#include "StateCodec.hpp"
 
 #include <algorithm>
+#include <ctime>
 #include <limits>
+#include <sstream>
 
 
 // ============================
@@ -15,20 +21,58 @@ Channel::chan_mode_map_t Channel::supported_modes[] = {
 	{TOPIC_LOCK, 't', 'd'},
 	{CHANNEL_KEY, 'k', 'c'},
 	{USER_LIMIT, 'l', 'c'},
-	{CHAN_OP, 'o', 'b'}
+	{CHAN_OP, 'o', 'b'},
+	{BAN, 'b', 'a'},
+	{BAN_EXCEPT, 'e', 'a'}
 };
 
+/*
+Mode character to its supported_modes entry, NULL when unsupported.
+Filled from supported_modes during static initialization.
+*/
+Channel::chan_mode_map_t const *Channel::mode_table[256];
+bool const Channel::mode_table_ready = Channel::init_mode_table();
+
+bool Channel::init_mode_table(void)
+{
+	for (size_t i = 0; i < sizeof(supported_modes) / sizeof(chan_mode_map_t); i++)
+		mode_table[static_cast<unsigned char>(supported_modes[i].mode_char)] = &supported_modes[i];
+	return true;
+}
+
 
 // ============================
 //         CONSTRUCTOR
 // ============================
 
-Channel::Channel(App &app, std::string const &nick, std::string const &name): app(app), name(name)
+Channel::Channel(App &app, std::string const &name): app(app), key(name), name(name)
 {
+	this->members = NULL;
+	this->members_tail = NULL;
+	this->member_count = 0;
 	this->mode = 0;
 	this->topic = ":";
+	this->topic_time = 0;
+	this->created_at = std::time(NULL);
+	this->size_prev = NULL;
+	this->size_next = NULL;
+	this->size_bucket = ChannelSizeIndex::not_indexed;
+	this->size_cursors = 0;
 	user_limit = std::numeric_limits<unsigned int>::max();
-	add_type_b_param(CHAN_OP, nick);
+}
+
+Channel::~Channel()
+{
+	Membership *member;
+
+	while (members)
+	{
+		member = members;
+		members = member->channel_next;
+		member->client->unlink_membership(member);
+		delete member;
+	}
+	app.invites.remove_channel(this);
 }
 
 
@@ -36,56 +80,92 @@ Channel::Channel(App &app, std::string const &nick, std::string const &name): ap
 //          CLIENTS
 // ============================
 
-void Channel::add_client(Client *client)
+Membership *Channel::add_client(Client *client, bool op)
 {
+	Membership *member;
+
 	if (is_in_mode(INVITE_ONLY))
-	{
 		remove_invite(client);
-		client->remove_invite(this);
-	}
 
-	clients.push_back(client);
-	client->add_channel(this);
+	member = new Membership();
+	member->channel = this;
+	member->client = client;
+	member->op = op;
+	member->channel_prev = members_tail;
+	member->channel_next = NULL;
+	if (members_tail)
+		members_tail->channel_next = member;
+	else
+		members = member;
+	members_tail = member;
+	member_count++;
+	app.channel_sizes.update(this);
+	client->link_membership(member);
+	return member;
 }
 
 void Channel::remove_client(Client *client)
 {
-	std::vector<Client *>::iterator it;
+	Membership *member = find_member(client);
 
-	it = std::find(clients.begin(), clients.end(), client);
-	if (it == clients.end())
-		return ;
+	if (member)
+		remove_member(member);
+}
 
-	clients.erase(it);
-	remove_type_b_param(CHAN_OP, client->get_nickname());
+/*
+Unlinks the membership from both of its lists. The channel is gone
+when its last member leaves.
+*/
+void Channel::remove_member(Membership *member)
+{
+	if (member->channel_prev)
+		member->channel_prev->channel_next = member->channel_next;
+	else
+		members = member->channel_next;
+	if (member->channel_next)
+		member->channel_next->channel_prev = member->channel_prev;
+	else
+		members_tail = member->channel_prev;
+	member_count--;
+	app.channel_sizes.update(this);
+	member->client->unlink_membership(member);
+	delete member;
 
-	if (clients.size() == 0)
+	if (!members)
 		app.remove_channel(this->name);
 }
 
+/*
+Walks the client's channels, which the class channel limit keeps short,
+rather than this channel's members.
+*/
+Membership *Channel::find_member(Client const *client) const
+{
+	for (Membership *member = client->get_memberships(); member; member = member->client_next)
+	{
+		if (member->channel == this)
+			return member;
+	}
+	return NULL;
+}
+
 
 // ============================
 //          INVITES
 // ============================
 
+/*
+Invites live in App::invites, which expires them and caps them per
+channel (invite_ttl_s, invite_channel_limit).
+*/
 void Channel::add_invite(Client *client)
 {
-	if (is_invited(client))
-		return ;
-		
-	invites.push_back(client);
-	client->add_invite(this);
+	app.invites.add(this, client, std::time(NULL));
 }
 
 void Channel::remove_invite(Client *client)
 {
-	std::vector<Client *>::iterator it;
-
-	it = std::find(invites.begin(), invites.end(), client);
-	if (it == invites.end())
-		return ;
-
-	invites.erase(it);
+	app.invites.remove(this, client);
 }
 
 
@@ -102,24 +182,77 @@ std::string Channel::get_client_nicks_str(void) const
 {
 	std::string res;
 
-	for (std::vector<Client *>::const_iterator i = clients.begin(); i < clients.end(); i++)
+	for (Membership const *member = members; member; member = member->channel_next)
 	{
-		if (i < clients.end() - 1)
-			res += (*i)->get_nickname() + ' ';
-		else
-			res += (*i)->get_nickname();
+		if (member != members)
+			res += ' ';
+		res += member->client->get_nickname();
 	}
 	return res;
 }
 
+Membership const *Channel::get_members(void) const
+{
+	return members;
+}
+
+/*
+Mode string with every parameter, key included, as carried by SJOIN.
+*/
+std::string Channel::get_burst_modes(void) const
+{
+	size_t arr_size = sizeof(supported_modes) / sizeof(chan_mode_map_t);
+	std::string modes("+");
+	std::string params;
+
+	for (size_t i = 0; i < arr_size; i++)
+	{
+		if (!(this->mode & supported_modes[i].mode))
+			continue ;
+		modes += supported_modes[i].mode_char;
+		if (supported_modes[i].mode_type == 'c')
+			params += ' ' + get_type_c_param(supported_modes[i].mode);
+	}
+	return modes + params;
+}
+
+ChannelKey const &Channel::get_key(void) const
+{
+	return key;
+}
+
+MaskList const &Channel::get_list(chan_mode_enum mode) const
+{
+	return mode == BAN ? bans : exceptions;
+}
+
+ChannelHistory const &Channel::get_history(void) const
+{
+	return history;
+}
+
 std::string const &Channel::get_topic(void) const
 {
 	return topic;
 }
 
+/*
+When the topic was last set, 0 for a channel that never had one. Channels
+loaded from disk count from the time they were loaded.
+*/
+std::time_t Channel::get_topic_time(void) const
+{
+	return topic_time;
+}
+
+std::time_t Channel::get_created_at(void) const
+{
+	return created_at;
+}
+
 int Channel::get_client_count(void) const
 {
-	return clients.size();
+	return member_count;
 }
 
 
@@ -135,6 +268,8 @@ void Channel::set_user_limit(int limit)
 void Channel::set_topic(std::string const &topic)
 {
 	this->topic = topic;
+	this->topic_time = std::time(NULL);
+	app.save_channel(*this);
 }
 
 
@@ -149,23 +284,33 @@ bool Channel::is_matching_key(std::string const &key) const
 
 bool Channel::is_on_channel(Client const *client) const
 {
-	return std::find(clients.begin(), clients.end(), client) != clients.end();
+	return find_member(client) != NULL;
 }
 
-bool Channel::is_channel_operator(std::string const &nick) const
+bool Channel::is_channel_operator(Client const *client) const
 {
-	return is_type_b_param(CHAN_OP, nick);
+	Membership const *member = find_member(client);
+
+	return member && member->op;
+}
+
+/*
+Matched against nick!user@host; an exception overrides a ban.
+*/
+bool Channel::is_banned(Client const *client) const
+{
+	return bans.matches(client->get_full_nickname()) && !exceptions.matches(client->get_full_nickname());
 }
 
 bool Channel::is_invited(Client const *client) const
 {
-	return std::find(invites.begin(), invites.end(), client) != invites.end();
+	return app.invites.contains(this, client);
 }
 
 bool Channel::is_full(void) const
 {
 	if (is_in_mode(USER_LIMIT))
-		return clients.size() == user_limit;
+		return member_count >= user_limit;
 	return false;
 }
 
@@ -212,180 +357,243 @@ void Channel::set_type_c_param(chan_mode_enum mode, std::string const &value)
 		user_limit = std::atoi(value.c_str());
 }
 
-bool Channel::is_type_b_param(chan_mode_enum mode, std::string const &value) const
+
+// ============================
+//            MODE
+// ============================
+
+static void report_mode_error(Client const &user, Channel const &channel, std::map<std::string, std::string> &info,
+	IRCReplyCodeEnum code, std::string const &key, std::string const &value)
 {
-	if (type_b_params.count(mode) == 0)
-		return false;
-	if (std::find(type_b_params.at(mode).begin(), type_b_params.at(mode).end(), value) == type_b_params.at(mode).end())
-		return false;
-	return true;
+	if (info.empty())
+	{
+		info["client"] = user.get_full_nickname();
+		info["channel"] = channel.name;
+	}
+	info[key] = value;
+	user.send_numeric_reply(code, info);
 }
 
-void Channel::add_type_b_param(chan_mode_enum mode, std::string const &value)
+/*
+A later change to the same mode (and the same nick or mask, for type b
+and type a modes) replaces the earlier one, so "+i-i" or "+o-o bob bob"
+leave one change.
+*/
+static void add_mode_change(Channel::chan_mode_delta_t &delta, Channel::chan_mode_map_t const *map, char sign,
+	std::string const &param, std::string const &setter = std::string())
 {
-	type_b_params[mode].push_back(value);
+	for (size_t i = 0; i < delta.size(); i++)
+	{
+		if (delta[i].map == map && ((map->mode_type != 'a' && map->mode_type != 'b') || delta[i].param == param))
+		{
+			delta[i].sign = sign;
+			delta[i].param = param;
+			delta[i].setter = setter;
+			return ;
+		}
+	}
+	Channel::chan_mode_change_t &change = delta.append();
+	change.map = map;
+	change.sign = sign;
+	change.param = param;
+	change.setter = setter;
 }
 
-void Channel::remove_type_b_param(chan_mode_enum mode, std::string const &value)
+/*
+Masks a delta adds to the list of map, so that several masks in one
+MODE line cannot go past ban_list_limit together.
+*/
+static size_t count_added(Channel::chan_mode_delta_t const &delta, Channel::chan_mode_map_t const *map)
 {
-	std::vector<std::string>::iterator it;
+	size_t count = 0;
 
-	it = std::find(type_b_params[mode].begin(), type_b_params[mode].end(), value);
-	if (it == type_b_params[mode].end())
-		return ;
-	type_b_params[mode].erase(it);
+	for (size_t i = 0; i < delta.size(); i++)
+	{
+		if (delta[i].map == map && delta[i].sign == '+')
+			count++;
+	}
+	return count;
 }
 
-
-// ============================
-//            MODE
-// ============================
-
-Channel::chan_mode_set_t Channel::parse_mode(Client const &user, std::string const &mode_str, std::vector<std::string> const &params) const
+/*
+Turns a mode string into the list of changes it asks for, taking mode
+parameters from params[2] on. Invalid changes are reported to the user
+and left out. Nothing is applied here, see change_mode(). The ban list
+limit only holds for local users: a peer server has already checked it.
+*/
+void Channel::parse_mode(Client const &user, std::string const &mode_str, std::vector<std::string> const &params,
+	chan_mode_delta_t &delta) const
 {
 	std::map<std::string, std::string> info;
-	chan_mode_set_t mode_set;
+	chan_mode_map_t const *map;
+	unsigned short pending = mode;
+	std::string mask;
+	size_t index = 2;
+	char sign = '+';
 	Client *target;
 
-	mode_set.mode = mode;
-	mode_set.type_c_params[CHANNEL_KEY] = get_type_c_param(CHANNEL_KEY);
-	mode_set.user_limit = user_limit;
-	info["channel"] = name;
-	info["client"] = user.get_full_nickname();
-
-	char sign = mode_str[0];
-	size_t index = 2;
-	size_t supported_modes_size = sizeof(supported_modes) / sizeof(chan_mode_map_t);
+	delta.clear();
 	for (std::string::const_iterator ch = mode_str.begin(); ch < mode_str.end(); ch++)
 	{
 		if (*ch == '+' || *ch == '-')
+		{
 			sign = *ch;
-		else
+			continue ;
+		}
+		map = mode_table[static_cast<unsigned char>(*ch)];
+		if (!map)
 		{
-			bool unknown = true;
-			for (size_t i = 0; i < supported_modes_size; i++)
+			report_mode_error(user, *this, info, ERR_UNKNOWNMODE, "char", std::string(1, *ch));
+			continue ;
+		}
+		if (mode_requires_param(*ch, sign) && index >= params.size())
+			break ;
+		switch (map->mode_type)
+		{
+		case 'a':
+			mask = MaskList::normalize(params[index]);
+			if (sign == '+' && !user.is_remote() && !user.get_link()
+				&& get_list(map->mode).size() + count_added(delta, map) >= static_cast<size_t>(app.config.ban_list_limit))
+				report_mode_error(user, *this, info, ERR_BANLISTFULL, "char", std::string(1, *ch));
+			else
+				add_mode_change(delta, map, sign, mask, user.get_link() ? user.get_link()->name : user.get_full_nickname());
+			index++;
+			break;
+
+		case 'b':
+			target = app.find_client_by_nick(params[index]);
+			if (!target)
+				report_mode_error(user, *this, info, ERR_NOSUCHNICK, "nick", params[index]);
+			else if (!is_on_channel(target))
+				report_mode_error(user, *this, info, ERR_NOTONCHANNEL, "nick", params[index]);
+			else
+				add_mode_change(delta, map, sign, target->get_nickname());
+			index++;
+			break;
+
+		case 'c':
+			if (sign == '-')
 			{
-				if (supported_modes[i].mode_char == *ch)
-				{
-					switch (supported_modes[i].mode_type)
-					{
-					case 'b':
-						target = app.find_client_by_nick(params[index]);
-						info["nick"] = params[index++];
-						if (!target)
-							user.send_numeric_reply(ERR_NOSUCHNICK, info);
-						else if (!is_on_channel(target))
-							user.send_numeric_reply(ERR_NOTONCHANNEL, info);
-						else
-							parse_type_b_mode(mode_set, supported_modes[i].mode, sign, target->get_nickname());
-						break;
-					
-					case 'c':
-						if (*ch == 'k' && sign == '+' && mode_set.mode & CHANNEL_KEY)
-							user.send_numeric_reply(ERR_KEYSET, info);
-						else
-							parse_type_c_mode(mode_set, supported_modes[i].mode, sign, params[index]);
-						if (sign == '+')
-							++index;
-						break;
-					
-					case 'd':
-						parse_type_d_mode(mode_set, supported_modes[i].mode, sign);
-						break;
-					
-					default:
-						break;
-					}
-					unknown = false;
-					break;
-				}
+				pending &= ~map->mode;
+				add_mode_change(delta, map, sign, "");
 			}
-			if (unknown)
+			else if (map->mode == CHANNEL_KEY && pending & CHANNEL_KEY)
+				report_mode_error(user, *this, info, ERR_KEYSET, "channel", name);
+			else
 			{
-				info["char"] = *ch;
-				user.send_numeric_reply(ERR_UNKNOWNMODE, info);
+				pending |= map->mode;
+				add_mode_change(delta, map, sign, params[index]);
 			}
+			if (sign == '+')
+				index++;
+			break;
+
+		case 'd':
+			add_mode_change(delta, map, sign, "");
+			break;
+
+		default:
+			break;
 		}
 	}
-	return mode_set;
 }
 
-std::string Channel::change_mode(chan_mode_set_t const &new_mode)
+/*
+Applies the changes in one pass. The ones that changed something come
+back as MODE parameter strings, at most modes_per_line mode parameters
+each. The channel key itself is never shown.
+*/
+void Channel::change_mode(chan_mode_delta_t const &delta, std::vector<std::string> &lines)
 {
-	unsigned short old_mode;
-	std::string add_params;
-	std::string rm_params;
-	std::string add;
-	std::string rm;
-
-	old_mode = this->mode;
-	this->mode = new_mode.mode;
+	std::string modes;
+	std::string args;
+	int arg_count = 0;
+	char last_sign = 0;
+	bool changed_any = false;
 
-	size_t arr_size = sizeof(supported_modes) / sizeof(chan_mode_map_t);
-	for (size_t i = 0; i < arr_size; i++)
+	for (size_t i = 0; i < delta.size(); i++)
 	{
-		Channel::chan_mode_map_t mode_map = supported_modes[i];
-		std::string value;
-		switch (mode_map.mode_type)
+		chan_mode_change_t const &change = delta[i];
+		chan_mode_enum bit = change.map->mode;
+		bool changed = false;
+		bool shown = false;
+		Membership *member;
+		Client *target;
+		MaskList *list;
+
+		switch (change.map->mode_type)
 		{
+		case 'a':
+			list = bit == BAN ? &bans : &exceptions;
+			if (change.sign == '+')
+				changed = list->add(change.param, change.setter, std::time(NULL));
+			else
+				changed = list->remove(change.param);
+			shown = true;
+			break;
+
 		case 'b':
-			if (new_mode.type_b_params.count(mode_map.mode) == 0)
-				break;
-			for (std::map<std::string, std::stack<char> >::const_iterator it = new_mode.type_b_params.at(mode_map.mode).begin(); \
-				it != new_mode.type_b_params.at(mode_map.mode).end(); it++)
-			{
-				if (it->second.top() == '+' && !is_type_b_param(mode_map.mode, it->first))
-				{
-					add += mode_map.mode_char;
-					add_params += ' ' + it->first;
-					add_type_b_param(mode_map.mode, it->first);
-				}
-				else if (it->second.top() == '-' && is_type_b_param(mode_map.mode, it->first))
-				{
-					rm += mode_map.mode_char;
-					rm_params += ' ' + it->first;
-					remove_type_b_param(mode_map.mode, it->first);
-				}
-			}
+			target = app.find_client_by_nick(change.param);
+			member = target ? find_member(target) : NULL;
+			changed = member && (change.sign == '+') != member->op;
+			if (changed)
+				member->op = !member->op;
+			shown = true;
 			break;
-		
+
 		case 'c':
-			if (old_mode & mode_map.mode && ~new_mode.mode & mode_map.mode)
+			if (change.sign == '+' && (!(mode & bit) || get_type_c_param(bit) != change.param))
 			{
-				rm += mode_map.mode_char;
-				set_type_c_param(mode_map.mode, "");
-				break;
+				mode |= bit;
+				set_type_c_param(bit, change.param);
+				changed = true;
+				shown = bit != CHANNEL_KEY;
 			}
-			else if (new_mode.mode & mode_map.mode)
+			else if (change.sign == '-' && mode & bit)
 			{
-				if (new_mode.type_c_params.count(mode_map.mode) == 0)
-					break;
-				value = new_mode.type_c_params.at(mode_map.mode);
-				if (get_type_c_param(mode_map.mode) != value)
-				{
-					set_type_c_param(mode_map.mode, value);
-					add += mode_map.mode_char;
-					if (mode_map.mode != CHANNEL_KEY)
-						add_params += ' ' + value;
-				}
+				mode &= ~bit;
+				set_type_c_param(bit, "");
+				changed = true;
 			}
 			break;
-		
+
 		case 'd':
-			if (mode_map.mode & new_mode.mode && mode_map.mode & ~old_mode)
-				add += mode_map.mode_char;
-			else if (mode_map.mode & old_mode && mode_map.mode & ~new_mode.mode)
-				rm += mode_map.mode_char;
+			changed = (change.sign == '+') != static_cast<bool>(mode & bit);
+			if (changed)
+				mode ^= bit;
 			break;
-		
+
 		default:
 			break;
 		}
+		if (!changed)
+			continue ;
+		changed_any = true;
+		if (shown && arg_count == modes_per_line)
+		{
+			lines.push_back(modes + args);
+			modes.clear();
+			args.clear();
+			arg_count = 0;
+			last_sign = 0;
+		}
+		if (change.sign != last_sign)
+			modes += change.sign;
+		last_sign = change.sign;
+		modes += change.map->mode_char;
+		if (shown)
+		{
+			args += ' ' + change.param;
+			arg_count++;
+		}
 	}
-	return (add.empty() ? add : '+' + add) + (rm.empty() ? rm : '-' + rm) + add_params + rm_params;
+	if (!modes.empty())
+		lines.push_back(modes + args);
+	if (changed_any)
+		app.save_channel(*this);
 }
 
-void Channel::get_mode_with_params(std::string const &nick, std::map<std::string, std::string> &info) const
+void Channel::get_mode_with_params(Client const *client, std::map<std::string, std::string> &info) const
 {
 	std::string mode_string("+");
 	std::string params;
@@ -401,7 +609,7 @@ void Channel::get_mode_with_params(std::string const &nick, std::map<std::string
 			info["mode"] += supported_modes[i].mode_char;
 			if (supported_modes[i].mode_type == 'c')
 			{
-				if (supported_modes[i].mode == CHANNEL_KEY && !this->is_channel_operator(nick))
+				if (supported_modes[i].mode == CHANNEL_KEY && !this->is_channel_operator(client))
 					continue;
 				info["mode params"] += this->get_type_c_param(supported_modes[i].mode) + ' ';
 			}
@@ -432,73 +640,211 @@ bool Channel::mode_str_has_enough_params(std::string const &mode_str, size_t par
 
 bool Channel::mode_requires_param(char mode, char sign)
 {
-	char type;
+	chan_mode_map_t const *map = mode_table[static_cast<unsigned char>(mode)];
 
-	size_t arr_size = sizeof(supported_modes) / sizeof(chan_mode_map_t);
-	for (size_t i = 0; i < arr_size; i++)
-	{
-		if (supported_modes[i].mode_char == mode)
-		{
-			type = supported_modes[i].mode_type;
-			return type == 'a' || type == 'b' || (type == 'c' && sign == '+');
-		}
-	}
-	return false;
+	if (!map)
+		return false;
+	return map->mode_type == 'a' || map->mode_type == 'b' || (map->mode_type == 'c' && sign == '+');
 }
 
-void Channel::parse_type_b_mode(chan_mode_set_t &mode_set, chan_mode_enum mode, char sign, std::string const &param)
+/*
+"MODE #chan b" or "+b" with no mask lists the bans, the same with e the
+exceptions.
+*/
+bool Channel::is_list_query(std::vector<std::string> const &params)
+{
+	chan_mode_map_t const *map;
+	size_t start;
+
+	if (params.size() != 2 || params[1].empty())
+		return false;
+	start = params[1][0] == '+' ? 1 : 0;
+	if (params[1].size() != start + 1)
+		return false;
+	map = mode_table[static_cast<unsigned char>(params[1][start])];
+	return map && map->mode_type == 'a';
+}
+
+void Channel::send_list(Client const &user, chan_mode_enum mode) const
 {
-	if (!mode_set.type_b_params[mode][param].empty())
+	std::vector<MaskList::Entry *> const &entries = get_list(mode).get_entries();
+	std::map<std::string, std::string> info;
+	std::ostringstream set_at;
+
+	info["client"] = user.get_full_nickname();
+	info["channel"] = name;
+	for (std::vector<MaskList::Entry *>::const_iterator i = entries.begin(); i != entries.end(); i++)
 	{
-		if ((sign == '+' && mode_set.type_b_params[mode][param].top() == '-') || \
-			(sign == '-' && mode_set.type_b_params[mode][param].top() == '+'))
-			mode_set.type_b_params[mode][param].pop();
+		set_at.str("");
+		set_at << (*i)->set_at;
+		info["mask"] = (*i)->mask;
+		info["who"] = (*i)->setter;
+		info["set-ts"] = set_at.str();
+		user.send_numeric_reply(mode == BAN ? RPL_BANLIST : RPL_EXCEPTLIST, info);
 	}
-	mode_set.type_b_params[mode][param].push(sign);
+	user.send_numeric_reply(mode == BAN ? RPL_ENDOFBANLIST : RPL_ENDOFEXCEPTLIST, info);
 }
 
-void Channel::parse_type_c_mode(chan_mode_set_t &mode_set, chan_mode_enum mode, char sign, std::string const &param)
+// ============================
+//       Sending messages
+// ============================
+
+/*
+Members on other servers are told by their own server.
+*/
+void Channel::notify(std::string const &source, std::string const &cmd, std::string const &param) const
 {
-	if (sign == '+')
+	std::string message;
+	
+	message = app.create_message(source, cmd, name + ' ' + param);
+	for (Membership const *member = members; member; member = member->channel_next)
 	{
-		mode_set.mode |= mode;
-		mode_set.type_c_params[mode] = param;
+		if (!member->client->is_remote())
+			member->client->send_message(message);
 	}
-	else
-		mode_set.mode &= ~mode;
 }
 
-void Channel::parse_type_d_mode(chan_mode_set_t &mode_set, chan_mode_enum mode, char sign)
+void Channel::add_history(std::string const &source, std::string const &cmd, std::string const &text)
 {
-	if (sign == '+')
-		mode_set.mode |= mode;
-	else
-		mode_set.mode &= ~mode;
+	history.append(source, cmd, name, text);
 }
 
 
 // ============================
-//       Sending messages
+//         Saved state
 // ============================
 
-void Channel::notify(std::string const &source, std::string const &cmd, std::string const &param) const
+/*
+Settings are what outlives the members: name, topic, modes and their
+parameters (the ban and exception lists). Used by the on-disk store.
+Operator status is not a setting: a nick says nothing about who holds it
+after a restart. A ban or exception is its mask, setter and time.
+*/
+void Channel::serialize_settings(StateWriter &out) const
 {
-	std::string message;
-	
-	message = app.create_message(source, cmd, name + ' ' + param);
-	for (std::vector<Client *>::const_iterator i = clients.begin(); i < clients.end(); i++)
-		(*i)->send_message(message);
+	out.put_string(name);
+	out.put_string(topic);
+	out.put_u32(mode);
+	out.put_u32(user_limit);
+
+	out.put_u32(type_c_params.size());
+	for (std::map<chan_mode_enum, std::string>::const_iterator i = type_c_params.begin(); i != type_c_params.end(); i++)
+	{
+		out.put_u32(i->first);
+		out.put_string(i->second);
+	}
+	out.put_u32((bans.size() != 0) + (exceptions.size() != 0));
+	for (int mode = BAN; mode <= BAN_EXCEPT; mode <<= 1)
+	{
+		std::vector<MaskList::Entry *> const &entries = get_list(static_cast<chan_mode_enum>(mode)).get_entries();
+
+		if (entries.empty())
+			continue ;
+		out.put_u32(mode);
+		out.put_u32(entries.size());
+		for (std::vector<MaskList::Entry *>::const_iterator i = entries.begin(); i != entries.end(); i++)
+		{
+			out.put_string((*i)->mask);
+			out.put_string((*i)->setter);
+			out.put_u32((*i)->set_at);
+		}
+	}
 }
 
-void Channel::privmsg(std::string const &source, std::string const &msg) const
+/*
+Reads what serialize_settings() wrote after the name, replacing the current settings.
+The operator lists of older files are skipped.
+*/
+void Channel::restore_settings(StateReader &in)
+{
+	chan_mode_enum mode;
+	uint32 count;
+	uint32 param_count;
+	std::string mask;
+	std::string setter;
+
+	type_c_params.clear();
+	bans.clear();
+	exceptions.clear();
+	this->topic = in.get_string();
+	this->topic_time = this->topic == ":" ? 0 : std::time(NULL);
+	this->mode = in.get_u32();
+	this->user_limit = in.get_u32();
+
+	count = in.get_u32();
+	for (uint32 i = 0; i < count; i++)
+	{
+		mode = static_cast<chan_mode_enum>(in.get_u32());
+		type_c_params[mode] = in.get_string();
+	}
+	count = in.get_u32();
+	for (uint32 i = 0; i < count; i++)
+	{
+		mode = static_cast<chan_mode_enum>(in.get_u32());
+		param_count = in.get_u32();
+		for (uint32 j = 0; j < param_count; j++)
+		{
+			if (mode == BAN || mode == BAN_EXCEPT)
+			{
+				mask = in.get_string();
+				setter = in.get_string();
+				(mode == BAN ? bans : exceptions).add(mask, setter, in.get_u32());
+			}
+			else
+				in.get_string();
+		}
+	}
+}
+
+void Channel::serialize(StateWriter &out) const
 {
-	std::string message;
-	
-	message = app.create_message(source, "PRIVMSG", name + ' ' + msg);
-	for (std::vector<Client *>::const_iterator i = clients.begin(); i < clients.end(); i++)
+	std::vector<Client *> invited;
+
+	serialize_settings(out);
+	out.put_u32(member_count);
+	for (Membership const *member = members; member; member = member->channel_next)
 	{
-		if ((*i)->get_full_nickname() == source)
-			continue;
-		(*i)->send_message(message);
+		out.put_u32(member->client->get_uuid());
+		out.put_u8(member->op);
 	}
-}
\ No newline at end of file
+	app.invites.get_clients(this, invited);
+	out.put_u32(invited.size());
+	for (std::vector<Client *>::const_iterator i = invited.begin(); i != invited.end(); i++)
+		out.put_u32((*i)->get_uuid());
+	out.put_u32(created_at);
+	out.put_u32(topic_time);
+}
+
+/*
+Clients have to be restored before their channels: members and
+invited clients are referenced by uuid.
+*/
+Channel *Channel::deserialize(App &app, StateReader &in)
+{
+	Channel *channel;
+	Client *client;
+	uint32 count;
+
+	channel = new Channel(app, in.get_string());
+	channel->restore_settings(in);
+
+	count = in.get_u32();
+	for (uint32 i = 0; i < count; i++)
+	{
+		client = app.get_client(in.get_u32());
+		if (!client)
+			throw (IEC_BADSTATE);
+		channel->add_client(client, in.get_u8());
+	}
+	count = in.get_u32();
+	for (uint32 i = 0; i < count; i++)
+	{
+		client = app.get_client(in.get_u32());
+		if (!client)
+			throw (IEC_BADSTATE);
+		channel->add_invite(client);
+	}
+	channel->created_at = in.get_u32();
+	channel->topic_time = in.get_u32();
+	return channel;
+}
@@ -0,0 +1,221 @@
+#include "ChannelHistory.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <sstream>
+#include <sys/time.h>
+
+size_t ChannelHistory::max_channel_bytes = 64 * 1024;
+size_t ChannelHistory::max_total_bytes = 16 * 1024 * 1024;
+size_t ChannelHistory::total_bytes = 0;
+const size_t ChannelHistory::min_arena_bytes;
+const size_t ChannelHistory::max_query_limit;
+
+
+// ============================
+//   Constructor & Destructor
+// ============================
+
+ChannelHistory::ChannelHistory() : head(0), used(0), next_msgid(1) {}
+
+ChannelHistory::~ChannelHistory()
+{
+	total_bytes -= arena.size();
+}
+
+
+// ============================
+//          Arena
+// ============================
+
+/*
+Doubles the arena (relinearizing the ring) until needed bytes fit or a cap is hit.
+*/
+bool ChannelHistory::grow(size_t needed)
+{
+	size_t new_size = std::max(arena.size(), min_arena_bytes);
+
+	while (new_size < needed)
+		new_size *= 2;
+	new_size = std::min(new_size, max_channel_bytes);
+	if (new_size <= arena.size() || total_bytes + new_size - arena.size() > max_total_bytes)
+		return false;
+
+	std::vector<char> new_arena(new_size);
+	size_t offset = 0;
+	for (std::deque<Entry>::iterator i = entries.begin(); i != entries.end(); i++)
+	{
+		size_t first_part = std::min(i->len, arena.size() - i->offset);
+
+		std::memcpy(&new_arena[offset], &arena[i->offset], first_part);
+		std::memcpy(&new_arena[offset + first_part], &arena[0], i->len - first_part);
+		i->offset = offset;
+		offset += i->len;
+	}
+	total_bytes += new_size - arena.size();
+	arena.swap(new_arena);
+	head = offset % arena.size();
+	return true;
+}
+
+void ChannelHistory::evict_oldest(void)
+{
+	used -= entries.front().len;
+	entries.pop_front();
+}
+
+/*
+Copies size bytes to the arena at offset, wrapping at its end, and
+returns the offset that follows them.
+*/
+size_t ChannelHistory::put(size_t offset, char const *data, size_t size)
+{
+	size_t first_part = std::min(size, arena.size() - offset);
+
+	std::memcpy(&arena[offset], data, first_part);
+	std::memcpy(&arena[0], data + first_part, size - first_part);
+	return (offset + size) % arena.size();
+}
+
+size_t ChannelHistory::put(size_t offset, std::string const &str)
+{
+	return put(offset, str.data(), str.size());
+}
+
+/*
+Stores ":<prefix> <cmd> <target> <text>", the line App::create_message()
+would build. A line larger than the whole arena is not kept.
+*/
+void ChannelHistory::append(std::string const &prefix, std::string const &cmd, std::string const &target,
+	std::string const &text)
+{
+	struct timeval tv;
+	Entry entry;
+	size_t len = prefix.size() + cmd.size() + target.size() + text.size() + 4;
+
+	if (arena.size() - used < len)
+		grow(used + len);
+	if (len > arena.size())
+		return ;
+	while (arena.size() - used < len)
+		evict_oldest();
+
+	gettimeofday(&tv, NULL);
+	entry.sec = tv.tv_sec;
+	entry.msec = tv.tv_usec / 1000;
+	entry.msgid = next_msgid++;
+	entry.offset = head;
+	entry.len = len;
+
+	head = put(head, ":", 1);
+	head = put(head, prefix);
+	head = put(head, " ", 1);
+	head = put(head, cmd);
+	head = put(head, " ", 1);
+	head = put(head, target);
+	head = put(head, " ", 1);
+	head = put(head, text);
+	used += len;
+	entries.push_back(entry);
+}
+
+
+// ============================
+//          Queries
+// ============================
+
+size_t ChannelHistory::size(void) const
+{
+	return entries.size();
+}
+
+ChannelHistory::Entry const &ChannelHistory::at(size_t index) const
+{
+	return entries[index];
+}
+
+std::string ChannelHistory::text(Entry const &entry) const
+{
+	size_t first_part = std::min(entry.len, arena.size() - entry.offset);
+	std::string res(&arena[entry.offset], first_part);
+
+	res.append(&arena[0], entry.len - first_part);
+	return res;
+}
+
+static bool entry_before(ChannelHistory::Entry const &entry, std::pair<uint32, unsigned short> const &time)
+{
+	return entry.sec < time.first || (entry.sec == time.first && entry.msec < time.second);
+}
+
+static bool time_before(std::pair<uint32, unsigned short> const &time, ChannelHistory::Entry const &entry)
+{
+	return time.first < entry.sec || (time.first == entry.sec && time.second < entry.msec);
+}
+
+/*
+Resolves a CHATHISTORY message reference: "*", "timestamp=YYYY-MM-DDThh:mm:ss.sssZ"
+or "msgid=<id>". Entries before the reference are [0, before_end), entries
+after it are [after_begin, size()). Returns false for a malformed reference.
+*/
+bool ChannelHistory::ref_bounds(std::string const &ref, size_t &before_end, size_t &after_begin) const
+{
+	if (ref == "*")
+	{
+		before_end = entries.size();
+		after_begin = 0;
+		return true;
+	}
+	if (ref.compare(0, 6, "msgid=") == 0)
+	{
+		char *end;
+		unsigned long id = std::strtoul(ref.c_str() + 6, &end, 10);
+		if (*end != '\0' || end == ref.c_str() + 6)
+			return false;
+		before_end = 0;
+		after_begin = entries.size();
+		for (size_t i = 0; i < entries.size(); i++)
+		{
+			if (entries[i].msgid == id)
+			{
+				before_end = i;
+				after_begin = i + 1;
+				break ;
+			}
+		}
+		return true;
+	}
+	if (ref.compare(0, 10, "timestamp=") == 0)
+	{
+		struct tm tm;
+		int msec = 0;
+		std::memset(&tm, 0, sizeof(tm));
+		if (std::sscanf(ref.c_str() + 10, "%4d-%2d-%2dT%2d:%2d:%2d.%3dZ", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+				&tm.tm_hour, &tm.tm_min, &tm.tm_sec, &msec) < 6)
+			return false;
+		tm.tm_year -= 1900;
+		tm.tm_mon -= 1;
+		std::pair<uint32, unsigned short> time(timegm(&tm), msec);
+		before_end = std::lower_bound(entries.begin(), entries.end(), time, entry_before) - entries.begin();
+		after_begin = std::upper_bound(entries.begin(), entries.end(), time, time_before) - entries.begin();
+		return true;
+	}
+	return false;
+}
+
+std::string ChannelHistory::format_time(Entry const &entry)
+{
+	std::ostringstream oss;
+	char buff[32];
+	time_t sec = entry.sec;
+	struct tm tm;
+
+	gmtime_r(&sec, &tm);
+	std::strftime(buff, sizeof(buff), "%Y-%m-%dT%H:%M:%S", &tm);
+	oss << buff << '.' << std::setfill('0') << std::setw(3) << entry.msec << 'Z';
+	return oss.str();
+}
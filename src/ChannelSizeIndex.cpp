@@ -0,0 +1,171 @@
+#include "ChannelSizeIndex.hpp"
+#include "Channel.hpp"
+
+#include <limits>
+
+
+// ============================
+//         Constructor
+// ============================
+
+ChannelSizeIndex::ChannelSizeIndex()
+{
+	Bucket empty = {NULL, NULL};
+
+	buckets.assign(bucket_of(std::numeric_limits<unsigned long>::max()) + 1, empty);
+}
+
+
+// ============================
+//           Buckets
+// ============================
+
+size_t ChannelSizeIndex::bucket_of(unsigned long count)
+{
+	size_t bucket = exact_buckets;
+
+	if (count < exact_buckets)
+		return count;
+	for (count /= exact_buckets; count > 1; count >>= 1)
+		bucket++;
+	return bucket;
+}
+
+void ChannelSizeIndex::link(Channel *channel, size_t bucket)
+{
+	channel->size_bucket = bucket;
+	channel->size_prev = buckets[bucket].tail;
+	channel->size_next = NULL;
+	if (buckets[bucket].tail)
+		buckets[bucket].tail->size_next = channel;
+	else
+		buckets[bucket].head = channel;
+	buckets[bucket].tail = channel;
+}
+
+void ChannelSizeIndex::unlink(Channel *channel)
+{
+	Bucket &bucket = buckets[channel->size_bucket];
+
+	for (size_t i = 0; i < open_ids.size() && channel->size_cursors; i++)
+	{
+		if (cursors[open_ids[i]].next == channel)
+			point(cursors[open_ids[i]], channel->size_next);
+	}
+	if (channel->size_prev)
+		channel->size_prev->size_next = channel->size_next;
+	else
+		bucket.head = channel->size_next;
+	if (channel->size_next)
+		channel->size_next->size_prev = channel->size_prev;
+	else
+		bucket.tail = channel->size_prev;
+	channel->size_bucket = not_indexed;
+}
+
+
+// ============================
+//           Changes
+// ============================
+
+void ChannelSizeIndex::add(Channel *channel)
+{
+	link(channel, bucket_of(channel->get_client_count()));
+}
+
+/*
+After a join or a part; a channel not added yet is left alone.
+*/
+void ChannelSizeIndex::update(Channel *channel)
+{
+	size_t bucket = bucket_of(channel->get_client_count());
+
+	if (channel->size_bucket == not_indexed || channel->size_bucket == bucket)
+		return ;
+	unlink(channel);
+	link(channel, bucket);
+}
+
+void ChannelSizeIndex::remove(Channel *channel)
+{
+	if (channel->size_bucket != not_indexed)
+		unlink(channel);
+}
+
+
+// ============================
+//           Cursors
+// ============================
+
+/*
+Moves the cursor to channel, keeping the counts of both channels.
+*/
+void ChannelSizeIndex::point(Cursor &cursor, Channel *channel)
+{
+	if (cursor.next)
+		cursor.next->size_cursors--;
+	cursor.next = channel;
+	if (channel)
+		channel->size_cursors++;
+}
+
+/*
+The walk covers the buckets that can hold a count in [min_count,
+max_count]; the caller still checks each channel's exact count.
+*/
+size_t ChannelSizeIndex::open_cursor(unsigned long min_count, unsigned long max_count)
+{
+	size_t id;
+
+	if (free_ids.empty())
+	{
+		id = cursors.size();
+		cursors.resize(id + 1);
+	}
+	else
+	{
+		id = free_ids.back();
+		free_ids.pop_back();
+	}
+	Cursor &cursor = cursors[id];
+	cursor.bucket = bucket_of(max_count);
+	cursor.last_bucket = bucket_of(min_count);
+	cursor.next = NULL;
+	cursor.position = open_ids.size();
+	point(cursor, buckets[cursor.bucket].head);
+	open_ids.push_back(id);
+	return id;
+}
+
+/*
+NULL once every bucket of the range has been walked.
+*/
+Channel *ChannelSizeIndex::next(size_t id)
+{
+	Cursor &cursor = cursors[id];
+	Channel *channel;
+
+	while (!cursor.next && cursor.bucket > cursor.last_bucket)
+		point(cursor, buckets[--cursor.bucket].head);
+	channel = cursor.next;
+	if (channel)
+		point(cursor, channel->size_next);
+	return channel;
+}
+
+void ChannelSizeIndex::close_cursor(size_t id)
+{
+	Cursor &cursor = cursors[id];
+
+	point(cursor, NULL);
+	cursors[open_ids.back()].position = cursor.position;
+	open_ids[cursor.position] = open_ids.back();
+	open_ids.pop_back();
+	if (open_ids.empty())
+	{
+		cursors.clear();
+		free_ids.clear();
+	}
+	else
+		free_ids.push_back(id);
+}
@@ -0,0 +1,344 @@
+#include "ChannelStore.hpp"
+#include "Channel.hpp"
+#include "InternalError.hpp"
+#include "SystemCallErrorMessage.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+Snapshot: magic, version, channel count, Channel::serialize_settings() per channel.
+Journal:  magic, version, then records of
+          length (u32, counts the type byte and the body), type (u8), body.
+          REC_CHANNEL carries Channel::serialize_settings(), REC_REMOVE the name.
+A record cut short by a crash ends the replay and is trimmed off the file.
+*/
+
+// ============================
+//   Constructor & Destructor
+// ============================
+
+ChannelStore::ChannelStore(std::string const &snapshot_path, std::string const &journal_path)
+	: snapshot_path(snapshot_path), journal_path(journal_path), journal_fd(-1), journal_size(0), snapshot_size(0) {}
+
+ChannelStore::~ChannelStore()
+{
+	close_journal();
+}
+
+
+// ============================
+//        File helpers
+// ============================
+
+/*
+Maps the whole file read-only. Returns NULL for a missing or empty file.
+*/
+static char const *map_file(std::string const &path, size_t &size)
+{
+	struct stat st;
+	void *data;
+	int fd;
+
+	size = 0;
+	fd = open(path.c_str(), O_RDONLY);
+	if (fd == -1)
+	{
+		if (errno == ENOENT)
+			return NULL;
+		throw (SCEM_OPEN);
+	}
+	if (fstat(fd, &st) == -1 || st.st_size == 0)
+	{
+		close(fd);
+		return NULL;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		throw (SCEM_MMAP);
+	size = st.st_size;
+	return static_cast<char const *>(data);
+}
+
+static void write_file(int fd, std::string const &data)
+{
+	size_t written = 0;
+	ssize_t res;
+
+	while (written < data.size())
+	{
+		res = write(fd, data.data() + written, data.size() - written);
+		if (res == -1 && errno == EINTR)
+			continue ;
+		if (res == -1)
+			throw (SCEM_WRITE);
+		written += res;
+	}
+}
+
+
+// ============================
+//          Loading
+// ============================
+
+/*
+Fills the App with the stored channels. Must run before open_journal(),
+otherwise every restored channel would be journaled again.
+*/
+void ChannelStore::load(App &app)
+{
+	try
+	{
+		load_snapshot(app);
+		replay_journal(app);
+	}
+	catch (internal_error_code iec)
+	{
+		std::cerr << "Channel store: " << InternalError::get_error_message(iec) << ", ignoring the rest\n";
+	}
+	catch (scem_function sf)
+	{
+		std::cerr << "Channel store: " << SystemCallErrorMessage::get_func_name(sf) << ": "
+			<< std::strerror(errno) << "\n";
+	}
+}
+
+void ChannelStore::load_snapshot(App &app)
+{
+	char const *data;
+	uint32 count;
+
+	data = map_file(snapshot_path, snapshot_size);
+	if (!data)
+		return ;
+
+	StateReader in(data, snapshot_size);
+	try
+	{
+		if (in.get_u32() != snapshot_magic || in.get_u32() != version)
+			throw (IEC_BADSTATE);
+		count = in.get_u32();
+		for (uint32 i = 0; i < count; i++)
+		{
+			Channel *channel = app.create_channel(in.get_string());
+			channel->restore_settings(in);
+			app.add_channel(channel);
+		}
+	}
+	catch (internal_error_code)
+	{
+		munmap(const_cast<char *>(data), snapshot_size);
+		throw ;
+	}
+	munmap(const_cast<char *>(data), snapshot_size);
+}
+
+void ChannelStore::replay_journal(App &app)
+{
+	char const *data;
+	size_t size;
+	size_t valid_size;
+	uint32 len;
+
+	data = map_file(journal_path, size);
+	if (!data)
+		return ;
+
+	StateReader in(data, size);
+	valid_size = 0;
+	try
+	{
+		if (in.get_u32() != journal_magic || in.get_u32() != version)
+			throw (IEC_BADSTATE);
+		valid_size = in.get_pos();
+		while (!in.at_end())
+		{
+			len = in.get_u32();
+			if (len == 0 || len > size - in.get_pos())
+				break ;
+			StateReader rec(data + in.get_pos(), len);
+			unsigned char type = rec.get_u8();
+			std::string name = rec.get_string();
+			Channel *channel = app.find_channel_by_name(name);
+			if (type == REC_CHANNEL)
+			{
+				if (!channel)
+				{
+					channel = app.create_channel(name);
+					app.add_channel(channel);
+				}
+				channel->restore_settings(rec);
+			}
+			else if (type == REC_REMOVE && channel)
+				app.remove_channel(name);
+			in.skip(len);
+			valid_size = in.get_pos();
+		}
+	}
+	catch (internal_error_code)
+	{
+		munmap(const_cast<char *>(data), size);
+		throw ;
+	}
+	munmap(const_cast<char *>(data), size);
+
+	if (valid_size < size && truncate(journal_path.c_str(), valid_size) == -1)
+		throw (SCEM_WRITE);
+	journal_size = valid_size;
+}
+
+
+// ============================
+//          Journal
+// ============================
+
+void ChannelStore::open_journal(void)
+{
+	struct stat st;
+
+	journal_fd = open(journal_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if (journal_fd == -1)
+	{
+		std::cerr << "Channel store: cannot open " << journal_path << ": " << std::strerror(errno)
+			<< ", channel state will not be saved\n";
+		return ;
+	}
+	if (fstat(journal_fd, &st) == 0 && st.st_size == 0)
+	{
+		record.clear();
+		record.put_u32(journal_magic);
+		record.put_u32(version);
+		write_file(journal_fd, record.data());
+		st.st_size = record.data().size();
+	}
+	journal_size = st.st_size;
+}
+
+void ChannelStore::close_journal(void)
+{
+	flush();
+	if (journal_fd != -1)
+		close(journal_fd);
+	journal_fd = -1;
+}
+
+/*
+record holds the type and the body; prefix it with its length and queue it.
+*/
+void ChannelStore::append_record(void)
+{
+	StateWriter len;
+
+	len.put_u32(record.data().size());
+	pending += len.data();
+	pending += record.data();
+	journal_size += len.data().size() + record.data().size();
+}
+
+void ChannelStore::flush(void)
+{
+	if (journal_fd == -1 || pending.empty())
+		return ;
+	try
+	{
+		write_file(journal_fd, pending);
+		pending.clear();
+	}
+	catch (scem_function sf)
+	{
+		std::cerr << "Channel store: " << SystemCallErrorMessage::get_func_name(sf) << ": "
+			<< std::strerror(errno) << ", channel state will not be saved\n";
+		pending.clear();
+		close_journal();
+	}
+}
+
+void ChannelStore::record_channel(Channel const &channel)
+{
+	if (journal_fd == -1)
+		return ;
+	record.clear();
+	record.put_u8(REC_CHANNEL);
+	channel.serialize_settings(record);
+	append_record();
+}
+
+void ChannelStore::record_remove(std::string const &channel_name)
+{
+	if (journal_fd == -1)
+		return ;
+	record.clear();
+	record.put_u8(REC_REMOVE);
+	record.put_string(channel_name);
+	append_record();
+}
+
+
+// ============================
+//         Compaction
+// ============================
+
+bool ChannelStore::needs_compaction(void) const
+{
+	return journal_fd != -1 && journal_size > min_compact_size && journal_size > snapshot_size;
+}
+
+/*
+Writes a fresh snapshot next to the old one, swaps it in with rename()
+and restarts the journal, so a crash at any point leaves a loadable pair.
+The snapshot holds what the queued records would have written.
+*/
+void ChannelStore::compact(std::vector<Channel *> const &channels)
+{
+	std::string tmp_path = snapshot_path + ".tmp";
+	StateWriter out;
+	int fd;
+
+	if (journal_fd == -1)
+		return ;
+	out.put_u32(snapshot_magic);
+	out.put_u32(version);
+	out.put_u32(channels.size());
+	for (std::vector<Channel *>::const_iterator i = channels.begin(); i != channels.end(); i++)
+		(*i)->serialize_settings(out);
+
+	try
+	{
+		fd = open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (fd == -1)
+			throw (SCEM_OPEN);
+		try
+		{
+			write_file(fd, out.data());
+		}
+		catch (scem_function)
+		{
+			close(fd);
+			throw ;
+		}
+		close(fd);
+		if (std::rename(tmp_path.c_str(), snapshot_path.c_str()) == -1)
+			throw (SCEM_RENAME);
+		snapshot_size = out.data().size();
+		if (ftruncate(journal_fd, 0) == -1)
+			throw (SCEM_WRITE);
+		record.clear();
+		record.put_u32(journal_magic);
+		record.put_u32(version);
+		write_file(journal_fd, record.data());
+		journal_size = record.data().size();
+		pending.clear();
+	}
+	catch (scem_function sf)
+	{
+		std::cerr << "Channel store: snapshot failed: " << SystemCallErrorMessage::get_func_name(sf) << ": "
+			<< std::strerror(errno) << "\n";
+	}
+}
@@ -1,31 +1,46 @@
 #include "Client.hpp"
 #include "Channel.hpp"
+#include "ChannelHistory.hpp"
+#include "InternalError.hpp"
+#include "ServerLink.hpp"
+#include "StateCodec.hpp"
+#include "SystemCallErrorMessage.hpp"
+#include "connection.hpp"
 
-#include <ctime>
 #include <iomanip>
 #include <iostream>
 #include <sstream>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <ctime>
 
 
 // ============================
 //   Constructor & Destructor
 // ============================
 
-Client::Client(App &app, int fd) : app(app), fd(fd), is_registered(false), has_valid_pwd(false)
+Client::Client(App &app, int fd) : app(app), fd(fd), seen_epoch(0), is_registered(false), remote(false),
+	write_wanted(false), evicted(false), throttled(false), connecting(false),
+	closing(false), conn_class(NULL), uplink(NULL), link(NULL),
+	memberships(NULL), channel_count(0), uuid(0), has_valid_pwd(false),
+	cap_negotiating(false), caps(0), flood_clock(0) {}
+
+Client::~Client()
 {
-	uuid = generate_uuid();
+	set_class(NULL);
+	delete link;
 }
 
-Client::~Client() {}
-
 
 // ============================
 //         Getters
 // ============================
 
-std::string Client::get_nickname(void) const
+std::string const &Client::get_nickname(void) const
 {
 	return nickname;
 }
@@ -35,7 +50,7 @@ int Client::get_fd(void) const
 	return fd;
 }
 
-std::string Client::get_full_nickname() const
+std::string const &Client::get_full_nickname() const
 {
 	return full_nickname;
 }
@@ -45,40 +60,252 @@ uint32 Client::get_uuid() const
 	return uuid;
 }
 
-std::string Client::get_msg_buff(void) const
+std::string const &Client::get_uid(void) const
+{
+	return uid;
+}
+
+std::string const &Client::get_username(void) const
+{
+	return username;
+}
+
+std::string const &Client::get_realname(void) const
+{
+	return realname;
+}
+
+/*
+Users of peer servers are shown behind the link they come through.
+*/
+std::string const &Client::get_server_name(void) const
+{
+	if (uplink && uplink->link)
+		return uplink->link->name;
+	return app.server_name;
+}
+
+ServerLink *Client::get_link(void) const
+{
+	return link;
+}
+
+Client *Client::get_uplink(void) const
+{
+	return uplink;
+}
+
+Membership *Client::get_memberships(void) const
+{
+	return memberships;
+}
+
+std::string const &Client::get_quit_reason(void) const
+{
+	return quit_reason;
+}
+
+std::string const &Client::get_msg_buff(void) const
 {
 	return msg_buff;
 }
 
+ConnClass *Client::get_class(void) const
+{
+	return conn_class;
+}
+
+bool Client::is_throttled(void) const
+{
+	return throttled;
+}
+
+bool Client::is_connecting(void) const
+{
+	return connecting;
+}
+
+bool Client::is_closing(void) const
+{
+	return closing;
+}
+
 // ============================
 //         Setters
 // ============================
 
-void Client::set_msg_buff(std::string const &s)
+/*
+The uid names the client on linked servers: server id + hex uuid.
+*/
+void Client::set_uuid(uint32 uuid)
 {
-	msg_buff = s;
+	std::ostringstream oss;
+
+	this->uuid = uuid;
+	oss << app.server_id << std::hex << std::uppercase << std::setfill('0') << std::setw(8) << uuid;
+	this->uid = oss.str();
 }
 
-// ============================
-//         UUID
-// ============================
+/*
+Turns the client into a user of a peer server, reachable through uplink.
+*/
+void Client::set_remote(Client *uplink, std::string const &uid, std::string const &nick,
+	std::string const &username, std::string const &host, std::string const &realname)
+{
+	std::string old_nick = this->nickname;
+
+	this->uplink = uplink;
+	this->remote = true;
+	this->uid = uid;
+	this->nickname = nick;
+	this->username = username;
+	this->realname = realname;
+	this->full_nickname = nick + '!' + username + '@' + host;
+	this->has_valid_pwd = true;
+	this->is_registered = true;
+	app.index_nick(this, old_nick);
+}
+
+/*
+The local users sharing a channel with the remote user see the change.
+*/
+void Client::set_remote_nick(std::string const &nick)
+{
+	std::string old_nick = this->nickname;
+	std::string message = app.create_message(full_nickname, "NICK", ':' + nick);
+
+	this->full_nickname = nick + full_nickname.substr(full_nickname.find('!'));
+	this->nickname = nick;
+	app.index_nick(this, old_nick);
+	send_to_peers(message);
+}
+
+void Client::set_quit_reason(std::string const &reason)
+{
+	this->quit_reason = reason;
+}
+
+/*
+Shutting the socket down makes the event loop report a hangup and close
+the connection the usual way, without freeing the client mid-command.
+*/
+void Client::request_close(void) const
+{
+	if (fd != -1)
+		app.transport->shutdown(fd, SHUT_RDWR);
+}
+
+/*
+Lets what is queued go out first, so that a final ERROR reaches the
+client; flush_output() closes the connection once the queue is empty.
+*/
+void Client::close_when_flushed(void) const
+{
+	closing = true;
+	if (send_queue.empty())
+		request_close();
+}
+
+/*
+Builds a fresh string rather than assigning, so that a long line once
+received does not pin its capacity, and an idle client holds no input
+memory at all.
+*/
+void Client::set_msg_buff(char const *data, size_t size)
+{
+	if (size)
+		std::string(data, size).swap(msg_buff);
+	else
+		std::string().swap(msg_buff);
+}
 
 /*
-As the upper limit of connections is WELL below MAX_INT there is little chance of conflict.
- */
-uint32 Client::generate_uuid(void) const
+Drops whatever is still queued for a client that cannot keep up and
+closes the connection; the quit reason tells its channels why.
+*/
+void Client::evict(std::string const &reason) const
 {
-	uint32 candidate;
+	if (evicted)
+		return ;
+	evicted = true;
+	std::cerr << "Evicting uuid:" << pretty_uuid() << ": " << reason << "\n";
+	if (conn_class)
+	{
+		conn_class->sendq_bytes -= send_queue.size();
+		conn_class->evictions++;
+	}
+	send_queue.clear();
+	quit_reason = reason;
+	request_close();
+}
 
-	for (;;)
+/*
+Moves the client and its queued output from one class's counters to the
+other's. NULL takes the client out of any class.
+*/
+void Client::set_class(ConnClass *conn_class)
+{
+	if (this->conn_class)
+	{
+		this->conn_class->clients--;
+		this->conn_class->sendq_bytes -= send_queue.size();
+	}
+	this->conn_class = conn_class;
+	if (conn_class)
 	{
-		srand(time(0));
-		candidate = (uint32) rand();
-		if (app.get_client(candidate) == NULL)
-			return candidate;
+		conn_class->clients++;
+		conn_class->sendq_bytes += send_queue.size();
 	}
 }
 
+void Client::set_throttled(bool throttled)
+{
+	this->throttled = throttled;
+}
+
+/*
+Until the connect completes, output only queues up; the first writable
+event ends it (see flush_conn()).
+*/
+void Client::set_connecting(bool connecting)
+{
+	this->connecting = connecting;
+}
+
+
+// ============================
+//        Flood control
+// ============================
+
+/*
+Every line moves flood_clock on by 1/flood of a second, and lines are
+taken while the clock is less than a second ahead of now: a client may
+send a burst of flood lines, then flood lines a second. Server links and
+classes with flood = 0 are not limited.
+*/
+bool Client::take_flood_token(unsigned long now_us)
+{
+	if (!conn_class || is_server_link() || !conn_class->spec.flood)
+		return true;
+	if (flood_clock < now_us)
+		flood_clock = now_us;
+	if (flood_clock >= now_us + 1000000)
+		return false;
+	flood_clock += 1000000 / conn_class->spec.flood;
+	return true;
+}
+
+long Client::flood_wait_ms(unsigned long now_us) const
+{
+	if (flood_clock < now_us + 1000000)
+		return 0;
+	return (flood_clock - now_us - 1000000) / 1000 + 1;
+}
+
+// ============================
+//         UUID
+// ============================
+
 std::string Client::pretty_uuid(void) const
 {
 	std::ostringstream oss;
@@ -87,6 +314,51 @@ std::string Client::pretty_uuid(void) const
 }
 
 
+// ============================
+//         Saved state
+// ============================
+
+/*
+Channel membership and invites are restored from the channel side.
+*/
+void Client::serialize(StateWriter &out) const
+{
+	out.put_u8(is_registered);
+	out.put_u8(has_valid_pwd);
+	out.put_u8(cap_negotiating);
+	out.put_u8(caps);
+	out.put_u8(closing);
+	out.put_string(quit_reason);
+	out.put_string(username);
+	out.put_string(realname);
+	out.put_string(nickname);
+	out.put_string(full_nickname);
+	out.put_string(msg_buff);
+	out.put_string(send_queue);
+	out.put_string(conn_class ? conn_class->spec.name : "default");
+}
+
+Client *Client::deserialize(App &app, int fd, StateReader &in)
+{
+	Client *client = new Client(app, fd);
+
+	client->is_registered = in.get_u8();
+	client->has_valid_pwd = in.get_u8();
+	client->cap_negotiating = in.get_u8();
+	client->caps = in.get_u8();
+	client->closing = in.get_u8();
+	client->quit_reason = in.get_string();
+	client->username = in.get_string();
+	client->realname = in.get_string();
+	client->nickname = in.get_string();
+	client->full_nickname = in.get_string();
+	client->msg_buff = in.get_string();
+	client->send_queue = in.get_string();
+	client->set_class(app.find_class(in.get_string()));
+	return client;
+}
+
+
 // ============================
 //         Registration
 // ============================
@@ -108,6 +380,9 @@ void Client::register_client(void)
 	send_numeric_reply(RPL_WELCOME, info);
 	send_numeric_reply(RPL_YOURHOST, info);
 	send_numeric_reply(RPL_CREATED, info);
+	info["tokens"] = app.get_isupport_tokens();
+	send_numeric_reply(RPL_ISUPPORT, info);
+	app.propagate(NULL, ServerLink::uid_line(app, *this));
 	// send_numeric_reply(user, RPL_MYINFO, info);
 	// send_numeric_reply(user, ERR_NOMOTD, info);
 }
@@ -122,6 +397,16 @@ bool Client::is_registered_client(void) const
 	return is_registered;
 }
 
+bool Client::is_server_link(void) const
+{
+	return link && link->linked;
+}
+
+bool Client::is_remote(void) const
+{
+	return remote;
+}
+
 /*
 Nickname has a maximum length of nine (9) characters.
 <nick>>: <letter> { <letter> | <number> | <special> }
@@ -134,7 +419,7 @@ bool Client::is_valid_nick(std::string const &nickname) const
 	size_t nick_len = nickname.length();
 	std::string special("-[]\\`^{}");
 
-	if (nick_len > app.nick_max_len)
+	if (static_cast<long>(nick_len) > app.config.nick_max_len)
 		return false;
 	if (!std::isalpha(nickname[0]))
 		return false;
@@ -151,13 +436,90 @@ bool Client::is_valid_nick(std::string const &nickname) const
 //  Sending messages & replies
 // ============================
 
+/*
+When nothing is waiting before it, a message is written straight from
+the caller's string and only what the socket does not take is queued;
+that goes out from the event loop once the socket is writable again.
+While draining, everything goes through the queue so that flush_output()
+sees it empty and ends the connection's output, and so does the handshake
+of a link that is still connecting. Users of peer servers have no
+connection: they are only reached through server commands on their uplink.
+*/
 void Client::send_message(std::string const &message) const
 {
-	std::string crlf_msg;
+	size_t const size = message.size() + 2;
+	bool const was_empty = send_queue.empty();
+	size_t sent = 0;
+
+	if (remote || evicted)
+		return ;
 
-	crlf_msg = message + CRLF;
 	std::cout << "SEND msg to uuid:" << pretty_uuid() << " ->" << message << "\n";
-	send(this->fd, crlf_msg.c_str(), crlf_msg.size(), 0);
+	app.stats.add_output(size);
+	if (was_empty && !app.draining && !connecting)
+	{
+		struct iovec iov[2];
+		ssize_t res;
+
+		iov[0].iov_base = const_cast<char *>(message.data());
+		iov[0].iov_len = message.size();
+		iov[1].iov_base = const_cast<char *>(CRLF);
+		iov[1].iov_len = 2;
+		res = app.transport->sendv(fd, iov, 2);
+		if (-1 == res && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			return ;
+		if (res > 0)
+			sent = res;
+		if (sent == size)
+			return ;
+	}
+	if (sent < message.size())
+		send_queue.append(message, sent, message.npos);
+	send_queue.append(CRLF + std::max(sent, message.size()) - message.size());
+	if (conn_class)
+		conn_class->sendq_bytes += size - sent;
+	if (was_empty)
+		flush_output();
+	if (conn_class && send_queue.size() > static_cast<unsigned long>(conn_class->spec.sendq) && !is_server_link())
+		evict("Max SendQ exceeded");
+}
+
+/*
+A failed write drops the queue: the connection is going away and the
+event loop will see the hangup. While the server drains, an emptied
+queue also ends the connection's output.
+*/
+void Client::flush_output(void) const
+{
+	ssize_t sent = 0;
+
+	if (!send_queue.empty() && !connecting)
+		sent = app.transport->send(this->fd, send_queue.data(), send_queue.size());
+	if (-1 == sent && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+		sent = send_queue.size();
+	if (sent > 0)
+	{
+		if (conn_class)
+			conn_class->sendq_bytes -= sent;
+		if (static_cast<size_t>(sent) == send_queue.size())
+			std::string().swap(send_queue);
+		else
+			send_queue.erase(0, sent);
+	}
+	if (write_wanted != !send_queue.empty())
+	{
+		write_wanted = !send_queue.empty();
+		app.transport->set_writable(fd, write_wanted);
+	}
+	if (send_queue.empty() && closing)
+		request_close();
+	else if (send_queue.empty() && app.draining && fd != -1)
+		app.transport->shutdown(fd, SHUT_WR);
+}
+
+bool Client::has_pending_output(void) const
+{
+	return !send_queue.empty();
 }
 
 void Client::fill_placeholders(std::string &str, std::map<std::string, std::string> const &info)
@@ -187,6 +549,8 @@ void Client::send_numeric_reply(IRCReplyCodeEnum code, std::map<std::string, std
 	std::string reply_text;
 	std::string msg;
 
+	if (link || uplink)
+		return ;
 	reply_text = IRCReply::get_reply_message(code);
 	fill_placeholders(reply_text, info);
 
@@ -194,15 +558,99 @@ void Client::send_numeric_reply(IRCReplyCodeEnum code, std::map<std::string, std
 	send_message(msg);
 }
 
-void Client::privmsg_client(std::string const &source, std::string const &msg) const
+/*
+Standard replies: FAIL <command> <code> [<context>] :<description>
+*/
+void Client::send_fail(std::string const &cmd, std::string const &code, std::string const &context, std::string const &desc) const
 {
-	std::string message;
-	
-	if (source == this->nickname)
-		return;
-	
-	message = app.create_message(source, "PRIVMSG", this->nickname + ' ' + msg);
-	this->send_message(message);
+	send_message(app.create_message(app.server_name, "FAIL", cmd + ' ' + code + (context.empty() ? "" : ' ' + context) + " :" + desc));
+}
+
+
+
+// ============================
+//            CAP
+// ============================
+
+static unsigned char cap_bit(std::string const &name)
+{
+	if (name == "server-time")
+		return Client::cap_server_time;
+	if (name == "batch")
+		return Client::cap_batch;
+	return 0;
+}
+
+/*
+IRCv3 capability negotiation for server-time and batch, which only
+CHATHISTORY uses. CAP LS or CAP REQ before registration holds it back
+until CAP END. A REQ naming an unknown capability is refused as a whole.
+*/
+void Client::cap(std::vector<std::string> const &params)
+{
+	std::map<std::string, std::string> info;
+	std::string nick = nickname.empty() ? "*" : nickname;
+	std::string subcmd;
+
+	info["client"] = nick;
+	info["command"] = "CAP";
+	if (is_server_link())
+		return ;
+	if (params.empty())
+		return send_numeric_reply(ERR_NEEDMOREPARAMS, info);
+	subcmd = params[0];
+	if (subcmd == "LS" || subcmd == "REQ")
+		cap_negotiating = cap_negotiating || !is_registered;
+	if (subcmd == "LS")
+		send_message(app.create_message(app.server_name, "CAP", nick + " LS :server-time batch"));
+	else if (subcmd == "LIST")
+	{
+		std::string names;
+
+		if (caps & cap_server_time)
+			names = "server-time";
+		if (caps & cap_batch)
+			names += names.empty() ? "batch" : " batch";
+		send_message(app.create_message(app.server_name, "CAP", nick + " LIST :" + names));
+	}
+	else if (subcmd == "REQ")
+	{
+		std::string requested = params.size() > 1 ? params[1] : "";
+		unsigned char enable = 0;
+		unsigned char disable = 0;
+		std::istringstream names;
+		std::string name;
+
+		if (!requested.empty() && requested[0] == ':')
+			requested.erase(0, 1);
+		names.str(requested);
+		while (names >> name)
+		{
+			unsigned char bit = cap_bit(name[0] == '-' ? name.substr(1) : name);
+
+			if (!bit)
+				return send_message(app.create_message(app.server_name, "CAP", nick + " NAK :" + requested));
+			if (name[0] == '-')
+				disable |= bit;
+			else
+				enable |= bit;
+		}
+		caps = (caps | enable) & ~disable;
+		send_message(app.create_message(app.server_name, "CAP", nick + " ACK :" + requested));
+	}
+	else if (subcmd == "END")
+	{
+		if (!cap_negotiating)
+			return ;
+		cap_negotiating = false;
+		if (!is_registered && !nickname.empty() && !username.empty())
+			register_client();
+	}
+	else
+	{
+		info["subcommand"] = subcmd;
+		send_numeric_reply(ERR_INVALIDCAPCMD, info);
+	}
 }
 
 
@@ -218,10 +666,15 @@ If the user sends an additional PASS command with incorrect password
 after already setting nickname or username, the server replies with ERR_PASSWDMISMATCH,
 and future attempts to complete the registration with NICK/USER commands lead
 to the same result until the correct password is set.
+
+The password of a connection class is accepted too, and moves the
+connection into that class. A server's PASS (followed by TS) is only
+kept, for SERVER to check against the link blocks.
 */
 void Client::pass(std::vector<std::string> const &params)
 {
 	std::map<std::string, std::string> info;
+	ConnClass *class_by_pwd;
 
 	info["client"] = full_nickname;
 	info["command"] = "PASS";
@@ -229,7 +682,17 @@ void Client::pass(std::vector<std::string> const &params)
 		return send_numeric_reply(ERR_ALREADYREGISTERED, info);
 	if (params.empty())
 		return send_numeric_reply(ERR_NEEDMOREPARAMS, info);
-	if (!app.is_correct_pwd(params[0]))
+	if (params.size() > 1 && params[1] == "TS")
+	{
+		if (!link)
+			link = new ServerLink(app, *this);
+		link->password = params[0];
+		return ;
+	}
+	class_by_pwd = app.find_class_by_password(params[0]);
+	if (class_by_pwd)
+		set_class(class_by_pwd);
+	else if (!app.is_correct_pwd(params[0]))
 	{
 		if (has_valid_pwd)
 			has_valid_pwd = false;
@@ -246,10 +709,12 @@ void Client::pass(std::vector<std::string> const &params)
 /*
 If the nickname is already used by other client,
 the server just sends back ERR_NICKNAMEINUSE reply.
+A client may change the case of its own nickname.
 */
 void Client::nick(std::vector<std::string> const &params)
 {
 	std::map<std::string, std::string> info;
+	Client *other;
 
 	info["client"] = this->nickname;
 	if (!this->has_valid_pwd)
@@ -259,10 +724,21 @@ void Client::nick(std::vector<std::string> const &params)
 	info["nick"] = params[0];
 	if (!this->is_valid_nick(info["nick"]))
 		return this->send_numeric_reply(ERR_ERRONEUSNICKNAME, info);
-	if (app.find_client_by_nick(info["nick"]))
+	other = app.find_client_by_nick(info["nick"]);
+	if (other && (other != this || info["nick"] == this->nickname))
 		return this->send_numeric_reply(ERR_NICKNAMEINUSE, info);
-	this->nickname = info["nick"];
-	if (!this->is_registered && !this->username.empty())
+	std::swap(this->nickname, info["nick"]);
+	app.index_nick(this, info["nick"]);
+	if (this->is_registered)
+	{
+		std::string message = app.create_message(full_nickname, "NICK", ':' + nickname);
+
+		this->full_nickname = nickname + '!' + username + '@' + app.server_name;
+		send_message(message);
+		send_to_peers(message);
+		app.propagate(NULL, ':' + uid + " NICK " + nickname + " 0");
+	}
+	else if (!this->username.empty() && !this->cap_negotiating)
 		this->register_client();
 }
 
@@ -299,7 +775,11 @@ void Client::user(std::vector<std::string> const &params)
 		this->username = username.substr(0, 12);
 	else
 		this->username = username;
-	if (!this->nickname.empty())
+	if (params.size() > 3)
+		this->realname = params[3][0] == ':' ? params[3].substr(1) : params[3];
+	else
+		this->realname = this->username;
+	if (!this->nickname.empty() && !this->cap_negotiating)
 		this->register_client();
 }
 
@@ -314,7 +794,9 @@ Parameters: <channel> [<key>]
 void Client::join(std::vector<std::string> const &params)
 {
 	std::map<std::string, std::string> info;
+	Membership *member;
 	Channel *channel;
+	ConnClass const *limits = conn_class ? conn_class : app.find_class("default");
 
 	if (!this->is_registered)
 		return ;
@@ -326,13 +808,15 @@ void Client::join(std::vector<std::string> const &params)
 		info["channel"] = params[0].substr(0, 200);
 	else
 		info["channel"] = params[0];
-	if (this->channels.size() == app.client_channel_limit)
+	if (static_cast<long>(this->channel_count) >= limits->spec.channels)
 		return send_numeric_reply(ERR_TOOMANYCHANNELS, info);
 	channel = app.find_channel_by_name(info["channel"]);
 	if (channel)
 	{
 		if (channel->is_on_channel(this))
 			return ;
+		if (channel->is_banned(this) && !channel->is_invited(this))
+			return send_numeric_reply(ERR_BANNEDFROMCHAN, info);
 		if (channel->is_in_mode(INVITE_ONLY) && !channel->is_invited(this))
 			return send_numeric_reply(ERR_INVITEONLYCHAN, info);
 		if (channel->is_full())
@@ -349,11 +833,13 @@ void Client::join(std::vector<std::string> const &params)
 	{
 		if (!Channel::is_valid_channel_name(info["channel"]))
 			return send_numeric_reply(ERR_BADCHANMASK, info);
-		channel = app.create_channel(this->nickname, info["channel"]);
+		channel = app.create_channel(info["channel"]);
 		app.add_channel(channel);
 	}
-	channel->add_client(this);
+	info["channel"] = channel->name;
+	member = channel->add_client(this, !channel->get_members());
 	channel->notify(this->full_nickname, info["command"], "");
+	app.propagate(NULL, ServerLink::sjoin_line(app, *channel, (member->op ? "@" : "") + uid));
 	info["topic"] = channel->get_topic();
 	info["nicks"] = channel->get_client_nicks_str();
 	if (info["topic"] != ":")
@@ -362,29 +848,35 @@ void Client::join(std::vector<std::string> const &params)
 	send_numeric_reply(RPL_NAMREPLY, info);
 }
 
-void Client::add_channel(Channel *channel)
+/*
+Memberships are created and freed by their channel, which links them
+here as well.
+*/
+void Client::link_membership(Membership *member)
 {
-	channels.push_back(channel);
+	member->client_prev = NULL;
+	member->client_next = memberships;
+	if (memberships)
+		memberships->client_prev = member;
+	memberships = member;
+	channel_count++;
 }
 
-void Client::remove_channel(Channel *channel)
+void Client::unlink_membership(Membership *member)
 {
-	std::vector<Channel *>::iterator it;
-
-	it = std::find(channels.begin(), channels.end(), channel);
-	if (it == channels.end())
-		return;
-
-	channels.erase(it);
+	if (member->client_prev)
+		member->client_prev->client_next = member->client_next;
+	else
+		memberships = member->client_next;
+	if (member->client_next)
+		member->client_next->client_prev = member->client_prev;
+	channel_count--;
 }
 
 void Client::remove_channels(void)
 {
-	for (std::vector<Channel *>::iterator i = channels.begin(); i < channels.end(); i++)
-	{
-		(*i)->remove_client(this);
-		this->remove_channel(*i);
-	}
+	while (memberships)
+		memberships->channel->remove_member(memberships);
 }
 
 
@@ -399,30 +891,49 @@ Message can be sent to the same client that sends it.
 */
 void Client::privmsg(std::vector<std::string> const &params)
 {
-	std::vector<std::string> targets;
+	send_text("PRIVMSG", params);
+}
+
+/*
+Same as PRIVMSG, but no reply is ever sent back to the sender.
+*/
+void Client::notice(std::vector<std::string> const &params)
+{
+	send_text("NOTICE", params);
+}
+
+void Client::send_text(std::string const &cmd, std::vector<std::string> const &params)
+{
+	std::vector<std::string> names;
+	std::vector<MessageTarget> targets;
 	std::map<std::string, std::string> info;
-	std::string target;
 
 	if (!this->is_registered)
 		return ;
-	info["client"] = this->full_nickname;
-	info["command"] = "PRIVMSG";
-	if (params.empty())
-		return send_numeric_reply(ERR_NORECIPIENT, info);
-	if (params.size() < 2)
-		return send_numeric_reply(ERR_NOTEXTTOSEND, info);
-	target = params[0];
-	info["target"] = target;
-	if (target.find(',') == target.npos)
-		targets.push_back(params[0]);
-	else if (split_targets(target, targets) == -1)
+	if (params.size() < 2 || split_targets(params[0], names) == -1)
+	{
+		if (cmd == "NOTICE")
+			return ;
+		info["client"] = this->full_nickname;
+		info["command"] = cmd;
+		if (params.empty())
+			return send_numeric_reply(ERR_NORECIPIENT, info);
+		if (params.size() < 2)
+			return send_numeric_reply(ERR_NOTEXTTOSEND, info);
+		info["target"] = params[0];
 		return send_numeric_reply(ERR_TOOMANYTARGETS, info);
-
-	privmsg_targets(params[1], targets);
+	}
+	resolve_targets(cmd, names, targets);
+	deliver_text(cmd, targets, params[1]);
 }
 
+/*
+Fails on a duplicate target or on more than App::max_targets of them
+(the TARGMAX advertised in RPL_ISUPPORT).
+*/
 int Client::split_targets(std::string const &target_str, std::vector<std::string> &targets)
 {
+	HashMap<std::string, char, StringHash> seen;
 	std::istringstream ss(target_str);
 	std::string target;
 
@@ -431,7 +942,7 @@ int Client::split_targets(std::string const &target_str, std::vector<std::string
 		std::getline(ss, target, ',');
 		if (!target.empty())
 		{
-			if (std::find(targets.begin(), targets.end(), target) != targets.end())
+			if (!seen.insert(target, 0) || targets.size() == static_cast<size_t>(App::max_targets))
 				return -1;
 			targets.push_back(target);
 		}
@@ -439,45 +950,146 @@ int Client::split_targets(std::string const &target_str, std::vector<std::string
 	return 0;
 }
 
-void Client::privmsg_targets(std::string const &msg, std::vector<std::string> const &targets) const
+/*
+Targets from a peer server name users by uid. Unknown targets, channels
+the sender is not on and channels it is banned from are reported
+(PRIVMSG only) and dropped. Operators speak through bans, and the peer
+server of a remote sender has already checked them.
+*/
+void Client::resolve_targets(std::string const &cmd, std::vector<std::string> const &names,
+	std::vector<MessageTarget> &targets) const
 {
 	std::map<std::string, std::string> info;
-	Client *client;
-	Channel *channel;
+	MessageTarget target;
 
-	for (std::vector<std::string>::const_iterator target = targets.begin(); target < targets.end(); target++)
+	info["client"] = this->full_nickname;
+	for (std::vector<std::string>::const_iterator name = names.begin(); name != names.end(); name++)
 	{
-		client = app.find_client_by_nick(*target);
-		if (client && client->is_registered)
-			client->privmsg_client(this->get_full_nickname(), msg);
+		target.client = uplink ? app.find_client_by_uid(*name) : app.find_client_by_nick(*name);
+		target.channel = NULL;
+		if (target.client && target.client->is_registered)
+		{
+			target.name = target.client->nickname;
+			target.wire_name = target.client->uid;
+			targets.push_back(target);
+			continue ;
+		}
+		target.client = NULL;
+		target.channel = app.find_channel_by_name(*name);
+		if (target.channel && target.channel->is_on_channel(this) && !uplink
+			&& target.channel->is_banned(this) && !target.channel->is_channel_operator(this))
+		{
+			if (cmd == "NOTICE")
+				continue ;
+			info["channel"] = target.channel->name;
+			send_numeric_reply(ERR_CANNOTSENDTOCHAN, info);
+		}
+		else if (target.channel && target.channel->is_on_channel(this))
+		{
+			target.name = target.channel->name;
+			target.wire_name = target.channel->name;
+			targets.push_back(target);
+		}
+		else if (cmd == "NOTICE")
+			continue ;
+		else if (target.channel)
+		{
+			info["channel"] = *name;
+			send_numeric_reply(ERR_NOTONCHANNEL, info);
+		}
 		else
 		{
-			channel = app.find_channel_by_name(*target);
-			if (channel && channel->is_on_channel(this))
-				channel->privmsg(this->full_nickname, msg);
-			else if (channel)
-			{
-				info["channel"] = *target;
-				send_numeric_reply(ERR_NOTONCHANNEL, info);
-			}
-			else
-			{
-				info["nick"] = *target;
-				send_numeric_reply(ERR_NOSUCHNICK, info);
-			}
+			info["nick"] = *name;
+			send_numeric_reply(ERR_NOSUCHNICK, info);
 		}
 	}
 }
 
+static void add_recipient(HashMap<Client *, uint32, PointerHash> &masks, std::vector<Client *> &recipients,
+	Client *member, Client const *sender_uplink, size_t target)
+{
+	Client *recipient = member->get_uplink() ? member->get_uplink() : member;
 
-// ============================
-//           KICK
-// ============================
+	if (recipient == sender_uplink)
+		return ;
+	if (masks.insert(recipient, 0))
+		recipients.push_back(recipient);
+	*masks.find(recipient) |= 1UL << target;
+}
 
 /*
-Parameters: <channel> <user> [<comment>]
+Every recipient gets the text once, however many of the targets it is
+reached through. A recipient is a local user or the link towards remote
+ones, and the set of targets it is reached through is a bitmask. A local
+user's line names one target, the first of its set in request order,
+since clients read the target as a single name. A link's line names the
+whole set by wire name, and the peer splits it again for its own users.
+Recipients sharing a line share its formatting. Channel targets are
+recorded in the channel history. Nothing goes back to the link the text
+came from.
 */
-void Client::kick(std::vector<std::string> const &params)
+void Client::deliver_text(std::string const &cmd, std::vector<MessageTarget> const &targets, std::string const &msg) const
+{
+	HashMap<Client *, uint32, PointerHash> masks;
+	HashMap<uint32, std::string, IntHash> lines[2];
+	std::vector<Client *> recipients;
+	std::string *line;
+	uint32 mask;
+
+	for (size_t t = 0; t < targets.size(); t++)
+	{
+		if (targets[t].client)
+		{
+			add_recipient(masks, recipients, targets[t].client, uplink, t);
+			continue ;
+		}
+		targets[t].channel->add_history(full_nickname, cmd, msg);
+		for (Membership const *member = targets[t].channel->get_members(); member; member = member->channel_next)
+		{
+			if (member->client != this)
+				add_recipient(masks, recipients, member->client, uplink, t);
+		}
+	}
+
+	for (std::vector<Client *>::const_iterator i = recipients.begin(); i != recipients.end(); i++)
+	{
+		bool to_link = (*i)->link != NULL;
+
+		mask = *masks.find(*i);
+		if (!to_link)
+			mask &= ~(mask - 1);
+		line = lines[to_link].find(mask);
+		if (!line)
+		{
+			std::string names;
+
+			for (size_t t = 0; t < targets.size(); t++)
+			{
+				if (!(mask & 1UL << t))
+					continue ;
+				if (!names.empty())
+					names += ',';
+				names += to_link ? targets[t].wire_name : targets[t].name;
+			}
+			line = &lines[to_link][mask];
+			if (to_link)
+				*line = ':' + uid + ' ' + cmd + ' ' + names + ' ' + msg;
+			else
+				*line = app.create_message(full_nickname, cmd, names + ' ' + msg);
+		}
+		(*i)->send_message(*line);
+	}
+}
+
+
+// ============================
+//           KICK
+// ============================
+
+/*
+Parameters: <channel> <user> [<comment>]
+*/
+void Client::kick(std::vector<std::string> const &params)
 {
 	std::map<std::string, std::string> info;
 	Channel *channel;
@@ -496,7 +1108,7 @@ void Client::kick(std::vector<std::string> const &params)
 		return send_numeric_reply(ERR_NOSUCHCHANNEL, info);
 	if (!channel->is_on_channel(this))
 		return send_numeric_reply(ERR_NOTONCHANNEL, info);
-	if (!channel->is_channel_operator(this->nickname))
+	if (!channel->is_channel_operator(this))
 		return send_numeric_reply(ERR_CHANOPRIVSNEEDED, info);
 	user = app.find_client_by_nick(info["user"]);
 	info["nick"] = info["user"];
@@ -505,8 +1117,118 @@ void Client::kick(std::vector<std::string> const &params)
 	if (!channel->is_on_channel(user))
 		return send_numeric_reply(ERR_USERNOTINCHANNEL, info);
 	channel->notify(this->full_nickname, info["command"], info["user"]);
+	app.propagate(NULL, ':' + uid + " KICK " + info["channel"] + ' ' + user->uid + ' '
+		+ (params.size() > 2 ? params[2] : ':' + user->nickname));
 	channel->remove_client(user);
-	user->remove_channel(channel);
+}
+
+
+// ============================
+//           PART
+// ============================
+
+/*
+Parameters: <channel>{,<channel>} [<reason>]
+Unlike message targets, the channel list has no length limit.
+*/
+void Client::part(std::vector<std::string> const &params)
+{
+	std::map<std::string, std::string> info;
+	std::istringstream names;
+	std::string name;
+	std::string reason;
+	Membership *member;
+	Channel *channel;
+
+	if (!is_registered)
+		return ;
+	info["client"] = this->full_nickname;
+	info["command"] = "PART";
+	if (params.empty())
+		return send_numeric_reply(ERR_NEEDMOREPARAMS, info);
+	if (params.size() > 1)
+		reason = params[1][0] == ':' ? params[1] : ':' + params[1];
+	names.str(params[0]);
+	while (std::getline(names, name, ','))
+	{
+		if (name.empty())
+			continue ;
+		info["channel"] = name;
+		channel = app.find_channel_by_name(name);
+		if (!channel)
+		{
+			send_numeric_reply(ERR_NOSUCHCHANNEL, info);
+			continue ;
+		}
+		member = channel->find_member(this);
+		if (!member)
+		{
+			send_numeric_reply(ERR_NOTONCHANNEL, info);
+			continue ;
+		}
+		channel->notify(this->full_nickname, info["command"], reason);
+		app.propagate(NULL, ':' + uid + " PART " + channel->name + (reason.empty() ? "" : ' ' + reason));
+		channel->remove_member(member);
+	}
+}
+
+
+// ============================
+//           QUIT
+// ============================
+
+/*
+Parameters: [<reason>]
+Lines after this one are not run, and later input is discarded. The
+connection closes once the ERROR is written; the channels hear about it
+when it is gone, see App::remove_client().
+*/
+void Client::quit(std::vector<std::string> const &params)
+{
+	std::string reason;
+
+	if (!params.empty())
+		reason = params[0][0] == ':' ? params[0].substr(1) : params[0];
+	quit_reason = reason.empty() ? "Client Quit" : "Quit: " + reason;
+	send_message("ERROR :Closing link (" + quit_reason + ")");
+	close_when_flushed();
+}
+
+/*
+Sends the message once to every local user sharing a channel with this
+client, however many channels they share. Each call takes a fresh App
+epoch and stamps the users it reaches with it, so a user met again in a
+later channel is skipped: the cost is one pass over the members of the
+client's channels, with no set to build.
+*/
+void Client::send_to_peers(std::string const &message) const
+{
+	unsigned int const epoch = app.next_fanout_epoch();
+
+	seen_epoch = epoch;
+	for (Membership const *own = memberships; own; own = own->client_next)
+	{
+		for (Membership const *member = own->channel->get_members(); member; member = member->channel_next)
+		{
+			Client const *peer = member->client;
+
+			if (peer->seen_epoch == epoch)
+				continue ;
+			peer->seen_epoch = epoch;
+			if (!peer->remote)
+				peer->send_message(message);
+		}
+	}
+}
+
+void Client::broadcast_quit(std::string const &reason) const
+{
+	send_to_peers(app.create_message(full_nickname, "QUIT", ':' + reason));
+}
+
+void Client::clear_fanout_mark(void) const
+{
+	seen_epoch = 0;
 }
 
 
@@ -541,39 +1263,22 @@ void Client::invite(std::vector<std::string> const &params)
 		return send_numeric_reply(ERR_NOSUCHCHANNEL, info);
 	if (!channel->is_on_channel(this))
 		return send_numeric_reply(ERR_NOTONCHANNEL, info);
-	if (channel->is_in_mode(INVITE_ONLY) && !channel->is_channel_operator(this->nickname))
+	if (channel->is_in_mode(INVITE_ONLY) && !channel->is_channel_operator(this))
 		return send_numeric_reply(ERR_CHANOPRIVSNEEDED, info);
 	if (channel->is_on_channel(recipient))
 		return send_numeric_reply(ERR_USERONCHANNEL, info);
 	channel->add_invite(recipient);
 	invite_msg = app.create_message(this->full_nickname, info["command"], info["nick"] + ' ' + info["channel"]);
-	recipient->send_message(invite_msg);
+	if (recipient->uplink)
+		recipient->uplink->send_message(':' + uid + " INVITE " + recipient->uid + ' ' + info["channel"]);
+	else
+		recipient->send_message(invite_msg);
 	send_numeric_reply(RPL_INVITING, info);
 }
 
-void Client::add_invite(Channel *channel)
-{
-	invites.push_back(channel);
-}
-
-void Client::remove_invite(Channel *channel)
-{
-	std::vector<Channel *>::iterator it;
-
-	it = std::find(invites.begin(), invites.end(), channel);
-	if (it == invites.end())
-		return ;
-		
-	invites.erase(it);
-}
-
 void Client::remove_invites(void)
 {
-	for (std::vector<Channel *>::iterator i = invites.begin(); i < invites.end(); i++)
-	{
-		(*i)->remove_invite(this);
-		this->remove_invite(*i);
-	}
+	app.invites.remove_client(this);
 }
 
 
@@ -609,11 +1314,12 @@ void Client::topic(std::vector<std::string> const &params)
 		else
 			return send_numeric_reply(RPL_TOPIC, info);
 	}
-	if (channel->is_in_mode(TOPIC_LOCK) && !channel->is_channel_operator(this->nickname))
+	if (channel->is_in_mode(TOPIC_LOCK) && !channel->is_channel_operator(this))
 		return send_numeric_reply(ERR_CHANOPRIVSNEEDED, info);
 	info["topic"] = params[1];
 		channel->set_topic(info["topic"]);
 	channel->notify(this->full_nickname, info["command"], info["topic"]);
+	app.propagate(NULL, ':' + uid + " TOPIC " + info["channel"] + ' ' + info["topic"]);
 }
 
 
@@ -624,8 +1330,8 @@ void Client::topic(std::vector<std::string> const &params)
 void Client::mode(std::vector<std::string> const &params)
 {
 	std::map<std::string, std::string> info;
-	Channel::chan_mode_set_t change_mode;
-	std::string change_mode_str;
+	Channel::chan_mode_delta_t delta;
+	std::vector<std::string> lines;
 	Channel *channel;
 	
 	if (!this->is_registered)
@@ -648,12 +1354,22 @@ void Client::mode(std::vector<std::string> const &params)
 	// inform about the current channel mode
 	if (params.size() < 2)
 	{
-		channel->get_mode_with_params(this->nickname, info);
+		channel->get_mode_with_params(this, info);
 		return send_numeric_reply(RPL_CHANNELMODEIS, info);
 	}
 	
+	// list the bans or exceptions
+	if (Channel::is_list_query(params))
+	{
+		chan_mode_enum list = Channel::mode_table[static_cast<unsigned char>(*params[1].rbegin())]->mode;
+
+		if (list == BAN_EXCEPT && !channel->is_channel_operator(this))
+			return send_numeric_reply(ERR_CHANOPRIVSNEEDED, info);
+		return channel->send_list(*this, list);
+	}
+
 	// change the channel mode
-	if (!channel->is_channel_operator(this->nickname))
+	if (!channel->is_channel_operator(this))
 		return send_numeric_reply(ERR_CHANOPRIVSNEEDED, info);
 	if (!channel->mode_str_has_enough_params(params[1], params.size() - 2))
 		return send_numeric_reply(ERR_NEEDMOREPARAMS, info);
@@ -662,10 +1378,16 @@ void Client::mode(std::vector<std::string> const &params)
 		info["char"] = params[1][0];
 		return send_numeric_reply(ERR_UNKNOWNMODE, info);
 	}
-	change_mode = channel->parse_mode(*this, params[1], params);
-	change_mode_str = channel->change_mode(change_mode);
-	if (!change_mode_str.empty())
-		channel->notify(this->full_nickname, info["command"], change_mode_str);
+	channel->parse_mode(*this, params[1], params, delta);
+	channel->change_mode(delta, lines);
+	if (lines.empty())
+		return ;
+	for (std::vector<std::string>::const_iterator i = lines.begin(); i != lines.end(); i++)
+		channel->notify(this->full_nickname, info["command"], *i);
+	std::string tmode = ':' + uid + " TMODE 0";
+	for (std::vector<std::string>::const_iterator i = params.begin(); i != params.end(); i++)
+		tmode += ' ' + *i;
+	app.propagate(NULL, tmode);
 }
 
 
@@ -681,3 +1403,522 @@ void Client::ping(std::vector<std::string> const &params)
 	send_message(msg);
 }
 
+
+
+
+// ============================
+//         CHATHISTORY
+// ============================
+
+/*
+Parameters: LATEST <target> <* | reference> <limit>
+            BEFORE <target> <reference> <limit>
+            AFTER <target> <reference> <limit>
+            BETWEEN <target> <reference> <reference> <limit>
+<reference> is timestamp=YYYY-MM-DDThh:mm:ss.sssZ or msgid=<id>.
+Only channels the client is on can be queried. Messages are sent in
+chronological order, inside a chathistory batch if the client enabled
+batch and tagged with time if it enabled server-time. A client that
+enabled either reads tags, so it also gets the msgid its references use;
+other clients get the plain lines.
+*/
+void Client::chathistory(std::vector<std::string> const &params)
+{
+	static uint32 batch_count = 0;
+	size_t before_end, after_begin, before_end2, after_begin2;
+	size_t first, last, limit;
+	std::ostringstream batch_id;
+	std::string subcmd;
+	Channel *channel;
+
+	if (!this->is_registered)
+		return ;
+	if (params.size() < 4 || (params[0] == "BETWEEN" && params.size() < 5))
+		return send_fail("CHATHISTORY", "NEED_MORE_PARAMS", "", "Missing parameters");
+	subcmd = params[0];
+	channel = app.find_channel_by_name(params[1]);
+	if (!channel || !channel->is_on_channel(this))
+		return send_fail("CHATHISTORY", "INVALID_TARGET", subcmd + ' ' + params[1], "Messages could not be retrieved");
+	ChannelHistory const &history = channel->get_history();
+	limit = std::min(static_cast<size_t>(std::atoi(params.back().c_str())), ChannelHistory::max_query_limit);
+	if (!history.ref_bounds(params[2], before_end, after_begin) || (subcmd != "LATEST" && params[2] == "*"))
+		return send_fail("CHATHISTORY", "INVALID_PARAMS", subcmd + ' ' + params[2], "Invalid message reference");
+
+	if (subcmd == "LATEST")
+	{
+		last = history.size();
+		first = std::max(after_begin, last - std::min(limit, last));
+	}
+	else if (subcmd == "BEFORE")
+	{
+		last = before_end;
+		first = last - std::min(limit, last);
+	}
+	else if (subcmd == "AFTER")
+	{
+		first = after_begin;
+		last = std::min(first + limit, history.size());
+	}
+	else if (subcmd == "BETWEEN")
+	{
+		if (!history.ref_bounds(params[3], before_end2, after_begin2) || params[3] == "*")
+			return send_fail("CHATHISTORY", "INVALID_PARAMS", subcmd + ' ' + params[3], "Invalid message reference");
+		first = std::min(after_begin, after_begin2);
+		last = std::max(before_end, before_end2);
+		last = std::min(std::max(first, last), first + limit);
+	}
+	else
+		return send_fail("CHATHISTORY", "INVALID_PARAMS", subcmd, "Unknown subcommand");
+
+	if (caps & cap_batch)
+	{
+		batch_id << "h" << ++batch_count;
+		send_message(app.create_message(app.server_name, "BATCH", '+' + batch_id.str() + " chathistory " + channel->name));
+	}
+	for (size_t i = first; i < last; i++)
+	{
+		ChannelHistory::Entry const &entry = history.at(i);
+		std::ostringstream tags;
+
+		if (caps & cap_batch)
+			tags << ";batch=" << batch_id.str();
+		if (caps & cap_server_time)
+			tags << ";time=" << ChannelHistory::format_time(entry);
+		if (caps)
+		{
+			tags << ";msgid=" << entry.msgid;
+			send_message('@' + tags.str().substr(1) + ' ' + history.text(entry));
+		}
+		else
+			send_message(history.text(entry));
+	}
+	if (caps & cap_batch)
+		send_message(app.create_message(app.server_name, "BATCH", '-' + batch_id.str()));
+}
+
+
+// ============================
+//            STATS
+// ============================
+
+static std::string format_us(unsigned long ns)
+{
+	std::ostringstream oss;
+
+	oss << std::fixed << std::setprecision(1) << ns / 1000.0 << "us";
+	return oss.str();
+}
+
+/*
+Parameters: <query>
+  m   latency of every command seen so far: run count, p50/p90/p99/max
+  s   the last slow commands, newest last
+Other queries only get the end of report.
+*/
+void Client::stats(std::vector<std::string> const &params)
+{
+	std::map<std::string, std::string> info;
+	std::string query;
+
+	info["client"] = get_full_nickname();
+	info["command"] = "STATS";
+	if (!this->is_registered)
+		return ;
+	if (params.empty())
+		return send_numeric_reply(ERR_NEEDMOREPARAMS, info);
+	query = params[0].substr(0, 1);
+	info["query"] = query;
+	if (query == "m")
+	{
+		std::vector<std::string> const &names = app.stats.get_names();
+
+		for (std::vector<std::string>::const_iterator i = names.begin(); i != names.end(); i++)
+		{
+			LatencyHistogram const *h = app.stats.find(*i);
+			std::ostringstream count;
+
+			if (!h->count())
+				continue ;
+			count << h->count();
+			info["command"] = *i;
+			info["count"] = count.str();
+			info["latency"] = "p50=" + format_us(h->percentile(0.5)) + " p90=" + format_us(h->percentile(0.9))
+				+ " p99=" + format_us(h->percentile(0.99)) + " max=" + format_us(h->max())
+				+ " mean=" + format_us(h->mean());
+			send_numeric_reply(RPL_STATSCOMMANDS, info);
+		}
+	}
+	else if (query == "s")
+	{
+		std::deque<CommandStats::SlowEntry> const &log = app.stats.get_slow_log();
+		std::time_t now = std::time(NULL);
+
+		for (std::deque<CommandStats::SlowEntry>::const_iterator i = log.begin(); i != log.end(); i++)
+		{
+			std::ostringstream text;
+
+			text << now - i->when << "s ago " << i->command << " from " << i->source;
+			if (!i->target.empty())
+				text << " to " << i->target;
+			if (i->channel_size >= 0)
+				text << " (" << i->channel_size << " members)";
+			text << " took " << format_us(i->ns) << ", " << i->bytes << " bytes out";
+			info["text"] = text.str();
+			send_numeric_reply(RPL_STATSDEBUG, info);
+		}
+	}
+	else if (query == "p")
+	{
+		Poller::Counters const &c = app.poller.get_counters();
+		std::ostringstream text;
+
+		text << c.waits << " waits, " << c.events << " events, " << c.requested << " write interest changes, "
+			<< c.submitted << " changes sent to the kernel, registrations included";
+		info["text"] = text.str();
+		send_numeric_reply(RPL_STATSDEBUG, info);
+	}
+	else if (query == "y")
+	{
+		std::vector<ConnClass *> const &classes = app.get_classes();
+
+		for (std::vector<ConnClass *>::const_iterator i = classes.begin(); i != classes.end(); i++)
+		{
+			std::ostringstream sendq, recvq, channels, flood, usage;
+
+			sendq << (*i)->spec.sendq;
+			recvq << (*i)->spec.recvq;
+			channels << (*i)->spec.channels;
+			flood << (*i)->spec.flood;
+			usage << (*i)->clients << " clients, " << (*i)->sendq_bytes << " bytes queued, "
+				<< (*i)->evictions << " evicted";
+			info["class"] = (*i)->spec.name;
+			info["sendq"] = sendq.str();
+			info["recvq"] = recvq.str();
+			info["channels"] = channels.str();
+			info["flood"] = flood.str();
+			info["usage"] = usage.str();
+			send_numeric_reply(RPL_STATSYLINE, info);
+		}
+	}
+	send_numeric_reply(RPL_ENDOFSTATS, info);
+}
+
+
+// ============================
+//        WHO & WHOIS
+// ============================
+
+/*
+Against the nick, the username, the host and the whole nick!user@host,
+so that both "bob*" and "*!*@127.*" work.
+*/
+bool Client::matches(Mask const &mask) const
+{
+	size_t at = full_nickname.find('@');
+
+	if (mask.matches_everything())
+		return true;
+	return mask.matches(nickname) || mask.matches(username) || mask.matches(full_nickname)
+		|| (at != full_nickname.npos && mask.matches(full_nickname.data() + at + 1, full_nickname.size() - at - 1));
+}
+
+/*
+RPL_WHOREPLY, written into line rather than through the reply table so
+that a long WHO reuses one buffer instead of allocating per user.
+*/
+void Client::send_who_reply(Client const &user, std::string const &channel, bool op, std::string &line) const
+{
+	size_t at = user.full_nickname.find('@');
+
+	line.assign(1, ':');
+	line.append(app.server_name).append(" 352 ").append(full_nickname).append(1, ' ').append(channel);
+	line.append(1, ' ').append(user.username).append(1, ' ');
+	if (at != user.full_nickname.npos)
+		line.append(user.full_nickname, at + 1, user.full_nickname.npos);
+	line.append(1, ' ').append(user.get_server_name()).append(1, ' ').append(user.nickname);
+	line.append(op ? " H@ :" : " H :").append(user.remote ? "1 " : "0 ").append(user.realname);
+	send_message(line);
+}
+
+/*
+Parameters: [<mask> [o]]
+A channel name lists its members, a nick without wildcards that user;
+no mask or "0" means "*".
+Any other mask is matched against every user; that scan is spread over
+loop turns by App::run_who_queries(), which sends RPL_ENDOFWHO. There
+are no server operators, so the o flag lists nobody.
+*/
+void Client::who(std::vector<std::string> const &params)
+{
+	std::map<std::string, std::string> info;
+	std::string line;
+	Channel *channel;
+	Client *user;
+
+	if (!this->is_registered)
+		return ;
+	info["client"] = full_nickname;
+	info["command"] = "WHO";
+	info["mask"] = params.empty() || params[0] == "0" ? "*" : params[0];
+	if (params.size() > 1 && params[1].find('o') != params[1].npos)
+		return send_numeric_reply(RPL_ENDOFWHO, info);
+	if (Channel::is_valid_channel_name(info["mask"]))
+	{
+		channel = app.find_channel_by_name(info["mask"]);
+		for (Membership const *member = channel ? channel->get_members() : NULL; member; member = member->channel_next)
+			send_who_reply(*member->client, channel->name, member->op, line);
+		return send_numeric_reply(RPL_ENDOFWHO, info);
+	}
+	if (!Mask::has_wildcards(info["mask"]))
+	{
+		user = app.find_client_by_nick(info["mask"]);
+		if (user)
+		{
+			send_who_reply(*user, "*", false, line);
+			return send_numeric_reply(RPL_ENDOFWHO, info);
+		}
+	}
+	app.start_who(*this, info["mask"]);
+}
+
+/*
+Parameters: [<server>] <nick>{,<nick>}
+A nick may be a mask, answered with at most whois_mask_matches users;
+see App::find_users_by_mask(). More than App::max_targets nicks, or the
+same one twice, is refused with ERR_TOOMANYTARGETS like PRIVMSG.
+Channels are listed with '@' for the ones the user is an operator of,
+split over several lines when they do not fit in one.
+*/
+void Client::whois(std::vector<std::string> const &params)
+{
+	static size_t const whois_mask_matches = 10;
+	static size_t const channels_line_max = 400;
+	std::map<std::string, std::string> info;
+	std::vector<std::string> targets;
+	std::vector<Client *> users;
+
+	if (!this->is_registered)
+		return ;
+	info["client"] = full_nickname;
+	info["command"] = "WHOIS";
+	if (params.empty())
+		return send_numeric_reply(ERR_NONICKNAMEGIVEN, info);
+	if (split_targets(params.size() > 1 ? params[1] : params[0], targets) == -1)
+	{
+		info["target"] = params.size() > 1 ? params[1] : params[0];
+		return send_numeric_reply(ERR_TOOMANYTARGETS, info);
+	}
+	for (std::vector<std::string>::const_iterator target = targets.begin(); target != targets.end(); target++)
+	{
+		users.clear();
+		if (Mask::has_wildcards(*target))
+			app.find_users_by_mask(Mask(*target), whois_mask_matches, users);
+		else if (app.find_client_by_nick(*target))
+			users.push_back(app.find_client_by_nick(*target));
+		info["nick"] = *target;
+		if (users.empty())
+			send_numeric_reply(ERR_NOSUCHNICK, info);
+		for (std::vector<Client *>::const_iterator i = users.begin(); i != users.end(); i++)
+		{
+			Client const *user = *i;
+			size_t at = user->full_nickname.find('@');
+			std::string channels;
+
+			info["nick"] = user->nickname;
+			info["username"] = user->username;
+			info["host"] = at == user->full_nickname.npos ? app.server_name : user->full_nickname.substr(at + 1);
+			info["realname"] = user->realname;
+			send_numeric_reply(RPL_WHOISUSER, info);
+			info["server"] = user->get_server_name();
+			info["serverinfo"] = user->remote ? "Linked server" : app.network_name;
+			send_numeric_reply(RPL_WHOISSERVER, info);
+			for (Membership const *member = user->memberships; member; member = member->client_next)
+			{
+				if (!channels.empty())
+					channels += ' ';
+				if (member->op)
+					channels += '@';
+				channels += member->channel->name;
+				if (channels.size() > channels_line_max || !member->client_next)
+				{
+					info["channels"] = channels;
+					send_numeric_reply(RPL_WHOISCHANNELS, info);
+					channels.clear();
+				}
+			}
+		}
+		info["nick"] = *target;
+		send_numeric_reply(RPL_ENDOFWHOIS, info);
+	}
+}
+
+
+// ============================
+//            LIST
+// ============================
+
+/*
+RPL_LIST, built in line like RPL_WHOREPLY. The stored topic keeps its
+leading ':'.
+*/
+void Client::send_list_reply(Channel const &channel, std::string &line) const
+{
+	char digits[24];
+	size_t size = 0;
+
+	for (unsigned long count = channel.get_client_count(); count || !size; count /= 10)
+		digits[sizeof(digits) - ++size] = '0' + count % 10;
+	line.assign(1, ':');
+	line.append(app.server_name).append(" 322 ").append(full_nickname).append(1, ' ').append(channel.name);
+	line.append(1, ' ').append(digits + sizeof(digits) - size, size).append(1, ' ').append(channel.get_topic());
+	send_message(line);
+}
+
+/*
+Parameters: [<channel>{,<channel>}] [<condition>{,<condition>}]
+Conditions are the ELIST ones, see ListFilter, and may come in either
+parameter. Named channels are answered at once; without names every
+channel is walked by App::run_list_queries(), which sends RPL_LISTEND.
+Empty channels kept only for their saved settings are not listed.
+*/
+void Client::list(std::vector<std::string> const &params)
+{
+	std::map<std::string, std::string> info;
+	std::vector<std::string> names;
+	std::time_t now = std::time(NULL);
+	ListFilter filter;
+	std::string item;
+	std::string line;
+	Channel *channel;
+
+	if (!this->is_registered)
+		return ;
+	for (size_t i = 0; i < params.size() && i < 2; i++)
+	{
+		std::istringstream items(params[i][0] == ':' ? params[i].substr(1) : params[i]);
+
+		while (std::getline(items, item, ','))
+		{
+			if (!item.empty() && !filter.add_condition(item, now))
+				names.push_back(item);
+		}
+	}
+	info["client"] = full_nickname;
+	send_numeric_reply(RPL_LISTSTART, info);
+	if (names.empty())
+		return app.start_list(*this, filter);
+	for (std::vector<std::string>::const_iterator name = names.begin(); name != names.end(); name++)
+	{
+		channel = app.find_channel_by_name(*name);
+		if (channel && filter.accepts(*channel))
+			send_list_reply(*channel, line);
+	}
+	send_numeric_reply(RPL_LISTEND, info);
+}
+
+
+// ============================
+//       SERVER & CONNECT
+// ============================
+
+/*
+Parameters: <servername> <hopcount> <sid> :<description>
+Turns an unregistered connection that sent the PASS of a link block into
+a link to a peer server. Answers with our own handshake unless we
+initiated the link, then bursts our users and channels. A link we
+initiated must answer with the password of the block we connected to.
+*/
+void Client::server(std::vector<std::string> const &params)
+{
+	std::map<std::string, std::string> info;
+	Config::LinkSpec const *spec;
+
+	info["client"] = full_nickname;
+	info["command"] = "SERVER";
+	if (is_registered || is_server_link() || !nickname.empty())
+		return send_numeric_reply(ERR_ALREADYREGISTERED, info);
+	if (!link)
+		return send_numeric_reply(ERR_PASSWDMISMATCH, info);
+	if (params.size() < 3)
+		return send_numeric_reply(ERR_NEEDMOREPARAMS, info);
+	spec = app.config.find_link_by_password(link->password);
+	if (!spec || (link->outgoing && spec->name != link->name))
+	{
+		std::cerr << "Link from server " << params[0] << " (" << params[2] << ") refused: bad password\n";
+		send_message("ERROR :Bad link password");
+		return request_close();
+	}
+	if (params[2] == app.server_id || app.find_link_by_sid(params[2]))
+	{
+		send_message("ERROR :Server " + params[2] + " already linked");
+		return request_close();
+	}
+	if (!link->outgoing)
+		link->send_handshake(spec->password);
+	link->name = params[0];
+	link->block = spec->name;
+	link->sid = params[2];
+	link->sids.insert(params[2]);
+	link->linked = true;
+	app.add_link(this);
+	std::cout << "Linked to server " << link->name << " (" << link->sid << ")\n";
+	link->send_burst();
+}
+
+/*
+Parameters: <link name>
+Links this server to the peer of a link block of the config; no other
+address can be connected to. Only a client in a class with a password may
+connect, and a peer already linked or connecting is refused. The connect
+does not block: the handshake waits in the queue until the socket is
+writable.
+*/
+void Client::connect(std::vector<std::string> const &params)
+{
+	std::map<std::string, std::string> info;
+	Config::LinkSpec const *spec;
+	Client *peer;
+	int sock_fd;
+
+	if (!is_registered)
+		return ;
+	info["client"] = full_nickname;
+	info["command"] = "CONNECT";
+	if (params.empty())
+		return send_numeric_reply(ERR_NEEDMOREPARAMS, info);
+	if (!conn_class || conn_class->spec.password.empty())
+		return send_numeric_reply(ERR_NOPRIVILEGES, info);
+	info["server name"] = params[0];
+	spec = app.config.find_link(params[0]);
+	if (!spec)
+		return send_numeric_reply(ERR_NOSUCHSERVER, info);
+	if (app.find_link_by_block(spec->name))
+		return send_fail("CONNECT", "ALREADY_LINKED", spec->name, "Server is already linked or connecting");
+	try
+	{
+		sock_fd = connect_sock_init(*spec);
+	}
+	catch (internal_error_code)
+	{
+		return send_numeric_reply(ERR_NOSUCHSERVER, info);
+	}
+	catch (scem_function)
+	{
+		return send_numeric_reply(ERR_NOSUCHSERVER, info);
+	}
+	peer = new Client(app, sock_fd);
+	if (!app.add_client(peer))
+	{
+		delete peer;
+		close(sock_fd);
+		return send_numeric_reply(ERR_NOSUCHSERVER, info);
+	}
+	peer->set_class(app.find_class("default"));
+	peer->set_connecting(true);
+	app.poller.add_connection(sock_fd, peer->get_uuid());
+	peer->link = new ServerLink(app, *peer);
+	peer->link->name = spec->name;
+	peer->link->block = spec->name;
+	peer->link->outgoing = true;
+	peer->link->send_handshake(spec->password);
+}
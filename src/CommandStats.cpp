@@ -0,0 +1,202 @@
+#include "CommandStats.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <time.h>
+
+double CycleClock::ns_per_tick = 1;
+
+
+// ============================
+//          CycleClock
+// ============================
+
+unsigned long CycleClock::monotonic_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+unsigned long CycleClock::now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return monotonic_ns();
+#endif
+}
+
+unsigned long CycleClock::to_ns(unsigned long ticks)
+{
+	return static_cast<unsigned long>(ticks * ns_per_tick);
+}
+
+/*
+Spins for about 5 ms and compares the ticks against the monotonic
+clock. Without a TSC both are the same clock and the ratio stays 1.
+*/
+void CycleClock::calibrate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned long start_ns = monotonic_ns();
+	unsigned long start_ticks = now();
+	unsigned long elapsed_ns;
+
+	do
+		elapsed_ns = monotonic_ns() - start_ns;
+	while (elapsed_ns < 5000000);
+	ns_per_tick = static_cast<double>(elapsed_ns) / (now() - start_ticks);
+#endif
+}
+
+
+// ============================
+//       LatencyHistogram
+// ============================
+
+LatencyHistogram::LatencyHistogram() : total(0), sum_ns(0), max_ns(0)
+{
+	for (int i = 0; i < bucket_count; i++)
+		counts[i] = 0;
+}
+
+int LatencyHistogram::bucket_of(unsigned long ns)
+{
+	int shift;
+
+	if (ns < static_cast<unsigned long>(sub_buckets))
+		return ns;
+	if (ns >> max_bits)
+		return bucket_count - 1;
+	shift = (sizeof(unsigned long) * 8 - 1 - __builtin_clzl(ns)) - sub_bucket_bits;
+	return (shift + 1) * sub_buckets + (ns >> shift) - sub_buckets;
+}
+
+unsigned long LatencyHistogram::bucket_high(int bucket)
+{
+	int shift;
+
+	if (bucket < sub_buckets)
+		return bucket;
+	shift = bucket / sub_buckets - 1;
+	return ((static_cast<unsigned long>(sub_buckets + bucket % sub_buckets) + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(unsigned long ns)
+{
+	counts[bucket_of(ns)]++;
+	total++;
+	sum_ns += ns;
+	if (ns > max_ns)
+		max_ns = ns;
+}
+
+unsigned long LatencyHistogram::count(void) const
+{
+	return total;
+}
+
+unsigned long LatencyHistogram::max(void) const
+{
+	return max_ns;
+}
+
+unsigned long LatencyHistogram::mean(void) const
+{
+	return total ? static_cast<unsigned long>(sum_ns / total) : 0;
+}
+
+/*
+Returns the upper bound of the bucket holding the p-th fraction of the
+samples (p between 0 and 1), never more than the largest sample.
+*/
+unsigned long LatencyHistogram::percentile(double p) const
+{
+	unsigned long rank = static_cast<unsigned long>(p * total + 0.5);
+	unsigned long seen = 0;
+
+	if (rank == 0)
+		rank = 1;
+	for (int i = 0; i < bucket_count; i++)
+	{
+		seen += counts[i];
+		if (seen >= rank)
+			return std::min(bucket_high(i), max_ns);
+	}
+	return max_ns;
+}
+
+
+// ============================
+//         CommandStats
+// ============================
+
+CommandStats::CommandStats() : bytes_out(0), slow_threshold_ns(0)
+{
+	CycleClock::calibrate();
+}
+
+CommandStats::~CommandStats()
+{
+	for (HashMap<std::string, LatencyHistogram *, StringHash>::iterator it = histograms.begin(); it != histograms.end(); it++)
+		delete it->second;
+}
+
+LatencyHistogram *CommandStats::histogram(std::string const &command)
+{
+	LatencyHistogram **found = histograms.find(command);
+	LatencyHistogram *res;
+
+	if (found)
+		return *found;
+	if (names.size() + 1 >= max_commands && command != "*")
+		return histogram("*");
+	res = new LatencyHistogram();
+	histograms.insert(command, res);
+	names.push_back(command);
+	return res;
+}
+
+/*
+Keeps the last slow_log_size entries and writes each one to the log.
+*/
+void CommandStats::add_slow(SlowEntry const &entry)
+{
+	std::cout << "Slow command: " << entry.command << " from " << entry.source
+		<< (entry.target.empty() ? "" : " to " + entry.target);
+	if (entry.channel_size >= 0)
+		std::cout << " (" << entry.channel_size << " members)";
+	std::cout << " took " << entry.ns / 1000 << " us, " << entry.bytes << " bytes out\n";
+	if (slow_log.size() == slow_log_size)
+		slow_log.pop_front();
+	slow_log.push_back(entry);
+}
+
+void CommandStats::add_output(size_t bytes)
+{
+	bytes_out += bytes;
+}
+
+unsigned long CommandStats::get_bytes_out(void) const
+{
+	return bytes_out;
+}
+
+std::vector<std::string> const &CommandStats::get_names(void) const
+{
+	return names;
+}
+
+LatencyHistogram const *CommandStats::find(std::string const &command) const
+{
+	LatencyHistogram * const *found = histograms.find(command);
+
+	return found ? *found : NULL;
+}
+
+std::deque<CommandStats::SlowEntry> const &CommandStats::get_slow_log(void) const
+{
+	return slow_log;
+}
@@ -0,0 +1,395 @@
+#include "Config.hpp"
+#include "InternalError.hpp"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+Config::Setting const Config::settings[] = {
+	{"listen_backlog",        &Config::listen_backlog,        1, 65535,       false},
+	{"max_events",            &Config::max_events,            1, 4096,        true},
+	{"poll_timeout_ms",       &Config::poll_timeout_ms,       -1, 3600000,    true},
+	{"max_msg_size",          &Config::max_msg_size,          512, 8191,      true},
+	{"recv_buffer_size",      &Config::recv_buffer_size,      512, 1 << 20,   true},
+	{"nick_max_len",          &Config::nick_max_len,          1, 30,          true},
+	{"history_channel_bytes", &Config::history_channel_bytes, 0, 1L << 30,    true},
+	{"history_total_bytes",   &Config::history_total_bytes,   0, 1L << 30,    true},
+	{"slow_command_us",       &Config::slow_command_us,       0, 60000000,    true},
+	{"invite_ttl_s",          &Config::invite_ttl_s,          0, 30 * 86400,  true},
+	{"invite_channel_limit",  &Config::invite_channel_limit,  1, 100000,      true},
+	{"ban_list_limit",        &Config::ban_list_limit,        1, 100000,      true},
+	{"shutdown_drain_ms",     &Config::shutdown_drain_ms,     0, 600000,      true}
+};
+
+Config::TextSetting const Config::text_settings[] = {
+	{"bind_address",  &Config::bind_address,  false},
+	{"snapshot_path", &Config::snapshot_path, false},
+	{"journal_path",  &Config::journal_path,  false},
+	{"record_path",   &Config::record_path,   true}
+};
+
+
+// ============================
+//         Constructor
+// ============================
+
+Config::Config() :
+	bind_address("127.0.0.1"),
+	snapshot_path("ircserv.snapshot"),
+	journal_path("ircserv.journal"),
+	listen_backlog(12),
+	max_events(12),
+	poll_timeout_ms(-1),
+	max_msg_size(512),
+	recv_buffer_size(512),
+	nick_max_len(9),
+	history_channel_bytes(64 * 1024),
+	history_total_bytes(16 * 1024 * 1024),
+	slow_command_us(10000),
+	invite_ttl_s(3600),
+	invite_channel_limit(100),
+	ban_list_limit(100),
+	shutdown_drain_ms(5000)
+{}
+
+
+Config::ClassSpec::ClassSpec() :
+	name("default"),
+	sendq(1 << 20),
+	recvq(8192),
+	channels(10),
+	flood(0)
+{}
+
+
+// ============================
+//           Loading
+// ============================
+
+static std::string trim(std::string const &s)
+{
+	size_t begin = s.find_first_not_of(" \t\r");
+	size_t end = s.find_last_not_of(" \t\r");
+
+	if (begin == s.npos)
+		return "";
+	return s.substr(begin, end - begin + 1);
+}
+
+static bool parse_number(std::string const &s, long min, long max, long &n)
+{
+	char *end;
+
+	errno = 0;
+	n = std::strtol(s.c_str(), &end, 10);
+	return !s.empty() && *end == '\0' && errno != ERANGE && n >= min && n <= max;
+}
+
+void Config::set(std::string const &key, std::string const &value, int line_nb)
+{
+	if (key == "listen")
+		return add_listener(value, line_nb);
+	if (key == "class")
+		return add_class(value, line_nb);
+	if (key == "link")
+		return add_link(value, line_nb);
+	for (size_t i = 0; i < sizeof(text_settings) / sizeof(TextSetting); i++)
+	{
+		if (key == text_settings[i].key)
+		{
+			this->*text_settings[i].field = value;
+			return ;
+		}
+	}
+	for (size_t i = 0; i < sizeof(settings) / sizeof(Setting); i++)
+	{
+		if (key == settings[i].key)
+		{
+			long n;
+
+			if (!parse_number(value, settings[i].min, settings[i].max, n))
+			{
+				std::cerr << path << ":" << line_nb << ": " << key << " must be a number between "
+					<< settings[i].min << " and " << settings[i].max << "\n";
+				throw (IEC_BADCONFIG);
+			}
+			this->*settings[i].field = n;
+			return ;
+		}
+	}
+	std::cerr << path << ":" << line_nb << ": unknown setting \"" << key << "\"\n";
+	throw (IEC_BADCONFIG);
+}
+
+/*
+listen = <address> <port> [backlog=N] [sndbuf=N] [rcvbuf=N] [accept_budget=N] [class=NAME]
+The address is numeric, IPv4 or IPv6 ("::" for every interface).
+The line can be repeated, one per extra listener.
+*/
+void Config::add_listener(std::string const &value, int line_nb)
+{
+	std::istringstream iss(value);
+	std::string word;
+	ListenSpec spec;
+	long n;
+
+	spec.backlog = listen_backlog;
+	spec.sndbuf = 0;
+	spec.rcvbuf = 0;
+	spec.accept_budget = default_accept_budget;
+	spec.class_name = "default";
+	if (!(iss >> spec.address >> word) || !parse_number(word, 1, 65535, n))
+	{
+		std::cerr << path << ":" << line_nb << ": expected \"listen = <address> <port> [option=value ...]\"\n";
+		throw (IEC_BADCONFIG);
+	}
+	spec.port = n;
+	while (iss >> word)
+	{
+		size_t eq = word.find('=');
+		std::string option = word.substr(0, eq);
+		bool ok = eq != word.npos;
+
+		if (ok && option == "backlog")
+			ok = parse_number(word.substr(eq + 1), 1, 65535, spec.backlog);
+		else if (ok && option == "sndbuf")
+			ok = parse_number(word.substr(eq + 1), 0, 1L << 26, spec.sndbuf);
+		else if (ok && option == "rcvbuf")
+			ok = parse_number(word.substr(eq + 1), 0, 1L << 26, spec.rcvbuf);
+		else if (ok && option == "accept_budget")
+			ok = parse_number(word.substr(eq + 1), 1, 4096, spec.accept_budget);
+		else if (ok && option == "class")
+		{
+			spec.class_name = word.substr(eq + 1);
+			ok = !spec.class_name.empty();
+		}
+		else
+			ok = false;
+		if (!ok)
+		{
+			std::cerr << path << ":" << line_nb << ": bad listen option \"" << word << "\"\n";
+			throw (IEC_BADCONFIG);
+		}
+	}
+	listeners.push_back(spec);
+}
+
+/*
+class = <name> [sendq=N] [recvq=N] [channels=N] [flood=N] [password=X]
+Options left out keep the defaults of ClassSpec. Naming the class
+"default" changes the class of connections nothing else picks.
+*/
+void Config::add_class(std::string const &value, int line_nb)
+{
+	std::istringstream iss(value);
+	std::string word;
+	ClassSpec spec;
+
+	if (!(iss >> spec.name))
+	{
+		std::cerr << path << ":" << line_nb << ": expected \"class = <name> [option=value ...]\"\n";
+		throw (IEC_BADCONFIG);
+	}
+	while (iss >> word)
+	{
+		size_t eq = word.find('=');
+		std::string option = word.substr(0, eq);
+		bool ok = eq != word.npos;
+
+		if (ok && option == "sendq")
+			ok = parse_number(word.substr(eq + 1), 512, 1L << 30, spec.sendq);
+		else if (ok && option == "recvq")
+			ok = parse_number(word.substr(eq + 1), 512, 1L << 24, spec.recvq);
+		else if (ok && option == "channels")
+			ok = parse_number(word.substr(eq + 1), 1, 1000, spec.channels);
+		else if (ok && option == "flood")
+			ok = parse_number(word.substr(eq + 1), 0, 100000, spec.flood);
+		else if (ok && option == "password")
+		{
+			spec.password = word.substr(eq + 1);
+			ok = spec.password.size() >= 4 && spec.password.size() <= 32;
+		}
+		else
+			ok = false;
+		if (!ok)
+		{
+			std::cerr << path << ":" << line_nb << ": bad class option \"" << word << "\"\n";
+			throw (IEC_BADCONFIG);
+		}
+	}
+	for (std::vector<ClassSpec>::iterator i = classes.begin(); i != classes.end(); i++)
+	{
+		if (i->name == spec.name)
+		{
+			*i = spec;
+			return ;
+		}
+	}
+	classes.push_back(spec);
+}
+
+/*
+link = <name> <address> <port> password=X
+CONNECT <name> links to the peer listening there. Incoming links are
+told apart by their password, so each link needs its own, distinct
+from the connection and class passwords.
+*/
+void Config::add_link(std::string const &value, int line_nb)
+{
+	std::istringstream iss(value);
+	std::string word;
+	LinkSpec spec;
+	long n;
+
+	if (!(iss >> spec.name >> spec.address >> word) || !parse_number(word, 1, 65535, n)
+		|| !(iss >> word) || word.compare(0, 9, "password=") || iss >> word)
+	{
+		std::cerr << path << ":" << line_nb << ": expected \"link = <name> <address> <port> password=X\"\n";
+		throw (IEC_BADCONFIG);
+	}
+	spec.port = n;
+	spec.password = word.substr(9);
+	if (spec.password.size() < 4 || spec.password.size() > 32 || spec.password.find(' ') != spec.password.npos)
+	{
+		std::cerr << path << ":" << line_nb << ": link password must be 4 to 32 characters\n";
+		throw (IEC_BADCONFIG);
+	}
+	for (std::vector<LinkSpec>::const_iterator i = links.begin(); i != links.end(); i++)
+	{
+		if (i->name == spec.name || i->password == spec.password)
+		{
+			std::cerr << path << ":" << line_nb << ": link name and password must be unique\n";
+			throw (IEC_BADCONFIG);
+		}
+	}
+	links.push_back(spec);
+}
+
+/*
+Settings missing from the file keep their current value. Any error is
+reported with its line number and leaves the object partly updated, so
+load into a scratch Config when the current one must survive a bad file.
+*/
+void Config::load(std::string const &path)
+{
+	std::ifstream file(path.c_str());
+	std::string line;
+	size_t eq;
+	int line_nb = 0;
+
+	this->path = path;
+	if (!file)
+	{
+		std::cerr << path << ": " << std::strerror(errno) << "\n";
+		throw (IEC_BADCONFIG);
+	}
+	while (std::getline(file, line))
+	{
+		line_nb++;
+		line = trim(line.substr(0, line.find('#')));
+		if (line.empty())
+			continue ;
+		eq = line.find('=');
+		if (eq == line.npos)
+		{
+			std::cerr << path << ":" << line_nb << ": expected \"key = value\"\n";
+			throw (IEC_BADCONFIG);
+		}
+		set(trim(line.substr(0, eq)), trim(line.substr(eq + 1)), line_nb);
+	}
+}
+
+/*
+Takes the reloadable settings from a freshly loaded config. Changes to
+startup-only settings are reported and left for the next start.
+*/
+void Config::reload(Config const &fresh)
+{
+	for (size_t i = 0; i < sizeof(settings) / sizeof(Setting); i++)
+	{
+		if (settings[i].reloadable)
+			this->*settings[i].field = fresh.*settings[i].field;
+		else if (this->*settings[i].field != fresh.*settings[i].field)
+			std::cerr << "Config: " << settings[i].key << " only changes on restart\n";
+	}
+	for (size_t i = 0; i < sizeof(text_settings) / sizeof(TextSetting); i++)
+	{
+		if (text_settings[i].reloadable)
+			this->*text_settings[i].field = fresh.*text_settings[i].field;
+		else if (this->*text_settings[i].field != fresh.*text_settings[i].field)
+			std::cerr << "Config: " << text_settings[i].key << " only changes on restart\n";
+	}
+	if (listeners != fresh.listeners)
+		std::cerr << "Config: listen only changes on restart\n";
+	classes = fresh.classes;
+	links = fresh.links;
+}
+
+/*
+The listener for the port given on the command line comes first, then
+the ones from listen lines.
+*/
+std::vector<Config::ListenSpec> Config::get_listeners(int port) const
+{
+	std::vector<ListenSpec> res;
+	ListenSpec main_spec;
+
+	main_spec.address = bind_address;
+	main_spec.port = port;
+	main_spec.backlog = listen_backlog;
+	main_spec.sndbuf = 0;
+	main_spec.rcvbuf = 0;
+	main_spec.accept_budget = default_accept_budget;
+	main_spec.class_name = "default";
+	res.push_back(main_spec);
+	res.insert(res.end(), listeners.begin(), listeners.end());
+	return res;
+}
+
+bool Config::ListenSpec::operator==(ListenSpec const &other) const
+{
+	return address == other.address && port == other.port && backlog == other.backlog
+		&& sndbuf == other.sndbuf && rcvbuf == other.rcvbuf && accept_budget == other.accept_budget
+		&& class_name == other.class_name;
+}
+
+/*
+The configured classes, with "default" first whether it was configured
+or not.
+*/
+std::vector<Config::ClassSpec> Config::get_classes(void) const
+{
+	std::vector<ClassSpec> res(1);
+
+	for (std::vector<ClassSpec>::const_iterator i = classes.begin(); i != classes.end(); i++)
+	{
+		if (i->name == res[0].name)
+			res[0] = *i;
+		else
+			res.push_back(*i);
+	}
+	return res;
+}
+
+Config::LinkSpec const *Config::find_link(std::string const &name) const
+{
+	for (std::vector<LinkSpec>::const_iterator i = links.begin(); i != links.end(); i++)
+	{
+		if (i->name == name)
+			return &*i;
+	}
+	return NULL;
+}
+
+Config::LinkSpec const *Config::find_link_by_password(std::string const &password) const
+{
+	for (std::vector<LinkSpec>::const_iterator i = links.begin(); i != links.end(); i++)
+	{
+		if (i->password == password)
+			return &*i;
+	}
+	return NULL;
+}
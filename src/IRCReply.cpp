@@ -15,6 +15,8 @@ std::pair<IRCReplyCodeEnum, std::string> reply_data[] = {
 	std::make_pair(ERR_CANNOTSENDTOCHAN,  "<client> <channel> :Cannot send to channel"),
 	std::make_pair(ERR_TOOMANYTARGETS,    "<client> <target> :Duplicate recipients. No message delivered"),
 	std::make_pair(ERR_NOSUCHNICK,        "<client> <nick> :No such nick/channel"),
+	std::make_pair(ERR_NOSUCHSERVER,      "<client> <server name> :No such server"),
+	std::make_pair(ERR_INVALIDCAPCMD,     "<client> <subcommand> :Invalid CAP command"),
 	std::make_pair(ERR_NOSUCHCHANNEL,     "<client> <channel> :No such channel"),
 	std::make_pair(ERR_TOOMANYCHANNELS,   "<client> <channel> :You have joined too many channels"),
 	std::make_pair(ERR_INVITEONLYCHAN,    "<client> <channel> :Cannot join channel (invite only)"),
@@ -22,21 +24,41 @@ std::pair<IRCReplyCodeEnum, std::string> reply_data[] = {
 	std::make_pair(ERR_CHANNELISFULL,     "<client> <channel> :Cannot join channel (channel is full)"),
 	std::make_pair(ERR_BADCHANNELKEY,     "<client> <channel> :Cannot join channel (incorrect channel key)"),
 	std::make_pair(ERR_BADCHANMASK,       "<channel> :Bad Channel Mask"),
+	std::make_pair(ERR_BANLISTFULL,       "<client> <channel> <char> :Channel list is full"),
 	std::make_pair(ERR_USERONCHANNEL,     "<client> <user> <channel> :is already on channel"),
 	std::make_pair(ERR_USERNOTINCHANNEL,  "<client> <user> <channel> :They are not on that channel"),
 	std::make_pair(ERR_NOTONCHANNEL,      "<client> <channel> :You're not on that channel"),
 	std::make_pair(ERR_CHANOPRIVSNEEDED,  "<client> <channel> :You're not channel operator"),
 	std::make_pair(ERR_KEYSET,            "<client> <channel> :Channel key already set"),
 	std::make_pair(ERR_UNKNOWNMODE,       "<client> <char> :is unknown mode char to me for <channel>"),
+	std::make_pair(ERR_NOPRIVILEGES,      "<client> :Permission Denied- You're not an IRC operator"),
 	std::make_pair(ERR_USERSDONTMATCH,    "<client> :Cannot change mode for other users"),
 	std::make_pair(RPL_TOPIC,             "<client> <channel> <topic>"),
 	std::make_pair(RPL_NAMREPLY,          "<client> <symbol> <channel> :<nicks>"),
 	std::make_pair(RPL_INVITING,          "<client> <nick> <channel>"),
 	std::make_pair(RPL_CHANNELMODEIS,     "<client> <channel> <mode> <mode params>"),
 	std::make_pair(RPL_NOTOPIC,           "<client> <channel> :No topic is set"),
+	std::make_pair(RPL_BANLIST,           "<client> <channel> <mask> <who> <set-ts>"),
+	std::make_pair(RPL_ENDOFBANLIST,      "<client> <channel> :End of channel ban list"),
+	std::make_pair(RPL_EXCEPTLIST,        "<client> <channel> <mask> <who> <set-ts>"),
+	std::make_pair(RPL_ENDOFEXCEPTLIST,   "<client> <channel> :End of channel exception list"),
 	std::make_pair(RPL_WELCOME,           "<nick> :*** Welcome to <network>, <nick>! ***"),
 	std::make_pair(RPL_YOURHOST,          "<client> :Your host is <servername>, running version <version>"),
-	std::make_pair(RPL_CREATED,           "<client> :This server was created <datetime>")
+	std::make_pair(RPL_CREATED,           "<client> :This server was created <datetime>"),
+	std::make_pair(RPL_ISUPPORT,          "<client> <tokens> :are supported by this server"),
+	std::make_pair(RPL_STATSCOMMANDS,     "<client> <command> <count> :<latency>"),
+	std::make_pair(RPL_STATSYLINE,        "<client> Y <class> <sendq> <recvq> <channels> <flood> :<usage>"),
+	std::make_pair(RPL_STATSDEBUG,        "<client> <query> :<text>"),
+	std::make_pair(RPL_ENDOFSTATS,        "<client> <query> :End of /STATS report"),
+	std::make_pair(RPL_WHOREPLY,          "<client> <channel> <username> <host> <server> <nick> <flags> :<hopcount> <realname>"),
+	std::make_pair(RPL_ENDOFWHO,          "<client> <mask> :End of WHO list"),
+	std::make_pair(RPL_WHOISUSER,         "<client> <nick> <username> <host> * :<realname>"),
+	std::make_pair(RPL_WHOISSERVER,       "<client> <nick> <server> :<serverinfo>"),
+	std::make_pair(RPL_WHOISCHANNELS,     "<client> <nick> :<channels>"),
+	std::make_pair(RPL_ENDOFWHOIS,        "<client> <nick> :End of /WHOIS list"),
+	std::make_pair(RPL_LISTSTART,         "<client> Channel :Users  Name"),
+	std::make_pair(RPL_LIST,              "<client> <channel> <client count> <topic>"),
+	std::make_pair(RPL_LISTEND,           "<client> :End of /LIST")
 };
 
 std::map<IRCReplyCodeEnum, std::string> IRCReply::reply_messages(reply_data, reply_data + sizeof reply_data / sizeof reply_data[0]);
@@ -3,7 +3,10 @@
 std::pair<internal_error_code, std::string> em_data[] = {
 	std::make_pair(IEC_BADPASS,    "Invalid password entered: Must be between 8 and 32 alphanumeric characters"),
 	std::make_pair(IEC_BADPORTNUM, "Invalid portnumber entered: Must be a number between 1024 and 65535"),
-	std::make_pair(IEC_BADARGC,    "Must have two arguments: listening port and server password")
+	std::make_pair(IEC_BADARGC,    "Must have two arguments: listening port and server password, optionally followed by a config file"),
+	std::make_pair(IEC_BADSTATE,   "Saved server state is truncated or corrupted"),
+	std::make_pair(IEC_BADCONFIG,  "Invalid config file"),
+	std::make_pair(IEC_BADADDR,    "Invalid listen address: Must be a numeric IPv4 or IPv6 address")
 };
 
 std::map<internal_error_code, std::string> InternalError::error_messages(em_data, em_data + sizeof em_data / sizeof em_data[0]);
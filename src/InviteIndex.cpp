@@ -0,0 +1,193 @@
+#include "InviteIndex.hpp"
+
+typedef InviteIndex::Invite *InviteIndex::Invite::*link_t;
+
+
+// ============================
+//        Intrusive lists
+// ============================
+
+InviteIndex::InviteList::InviteList() : head(NULL), tail(NULL), size(0)
+{}
+
+static void push_back(InviteIndex::InviteList &list, InviteIndex::Invite *invite, link_t prev, link_t next)
+{
+	invite->*prev = list.tail;
+	invite->*next = NULL;
+	if (list.tail)
+		list.tail->*next = invite;
+	else
+		list.head = invite;
+	list.tail = invite;
+	list.size++;
+}
+
+static void unlink(InviteIndex::InviteList &list, InviteIndex::Invite *invite, link_t prev, link_t next)
+{
+	if (invite->*prev)
+		invite->*prev->*next = invite->*next;
+	else
+		list.head = invite->*next;
+	if (invite->*next)
+		invite->*next->*prev = invite->*prev;
+	else
+		list.tail = invite->*prev;
+	list.size--;
+}
+
+
+// ============================
+//             Key
+// ============================
+
+bool InviteIndex::Key::operator==(Key const &other) const
+{
+	return channel == other.channel && client == other.client;
+}
+
+size_t InviteIndex::KeyHash::operator()(Key const &key) const
+{
+	PointerHash hash;
+
+	return hash(key.channel) * 31 ^ hash(key.client);
+}
+
+
+// ============================
+//   Constructor & Destructor
+// ============================
+
+InviteIndex::InviteIndex() : ttl(0), channel_limit(0)
+{}
+
+InviteIndex::~InviteIndex()
+{
+	Invite *next;
+
+	for (Invite *i = by_age.head; i; i = next)
+	{
+		next = i->age_next;
+		delete i;
+	}
+}
+
+
+// ============================
+//           Updates
+// ============================
+
+/*
+Inviting again restarts the TTL. When the channel is at channel_limit,
+its oldest invite is dropped first.
+*/
+void InviteIndex::add(Channel *channel, Client *client, std::time_t now)
+{
+	Key key = {channel, client};
+	InviteList *channel_list;
+	Invite *invite;
+
+	if (index.find(key))
+		remove(channel, client);
+	while (channel_limit && (channel_list = by_channel.find(channel)) && channel_list->size >= channel_limit)
+		remove(channel_list->head);
+	invite = new Invite();
+	invite->channel = channel;
+	invite->client = client;
+	invite->created = now;
+	index.insert(key, invite);
+	push_back(by_channel[channel], invite, &Invite::channel_prev, &Invite::channel_next);
+	push_back(by_client[client], invite, &Invite::client_prev, &Invite::client_next);
+	push_back(by_age, invite, &Invite::age_prev, &Invite::age_next);
+}
+
+void InviteIndex::remove(Invite *invite)
+{
+	Key key = {invite->channel, invite->client};
+	InviteList *list;
+
+	list = by_channel.find(invite->channel);
+	unlink(*list, invite, &Invite::channel_prev, &Invite::channel_next);
+	if (!list->size)
+		by_channel.erase(invite->channel);
+	list = by_client.find(invite->client);
+	unlink(*list, invite, &Invite::client_prev, &Invite::client_next);
+	if (!list->size)
+		by_client.erase(invite->client);
+	unlink(by_age, invite, &Invite::age_prev, &Invite::age_next);
+	index.erase(key);
+	delete invite;
+}
+
+void InviteIndex::remove(Channel const *channel, Client const *client)
+{
+	Key key = {channel, client};
+	Invite **invite = index.find(key);
+
+	if (invite)
+		remove(*invite);
+}
+
+void InviteIndex::remove_channel(Channel const *channel)
+{
+	InviteList *list;
+
+	while ((list = by_channel.find(channel)))
+		remove(list->head);
+}
+
+void InviteIndex::remove_client(Client const *client)
+{
+	InviteList *list;
+
+	while ((list = by_client.find(client)))
+		remove(list->head);
+}
+
+/*
+Drops every invite created at least ttl seconds before now.
+*/
+void InviteIndex::expire(std::time_t now)
+{
+	if (!ttl)
+		return ;
+	while (by_age.head && by_age.head->created + ttl <= now)
+		remove(by_age.head);
+}
+
+
+// ============================
+//           Queries
+// ============================
+
+bool InviteIndex::contains(Channel const *channel, Client const *client) const
+{
+	Key key = {channel, client};
+
+	return index.find(key) != NULL;
+}
+
+void InviteIndex::get_clients(Channel const *channel, std::vector<Client *> &clients) const
+{
+	InviteList const *list = by_channel.find(channel);
+
+	for (Invite const *i = list ? list->head : NULL; i; i = i->channel_next)
+		clients.push_back(i->client);
+}
+
+size_t InviteIndex::size(void) const
+{
+	return by_age.size;
+}
+
+/*
+Milliseconds until the oldest invite expires, -1 when none will.
+*/
+long InviteIndex::next_expiry_ms(std::time_t now) const
+{
+	std::time_t expiry;
+
+	if (!ttl || !by_age.head)
+		return -1;
+	expiry = by_age.head->created + ttl;
+	return expiry > now ? (expiry - now) * 1000L : 0;
+}
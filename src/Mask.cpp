@@ -0,0 +1,122 @@
+#include "Mask.hpp"
+
+
+// ============================
+//         Compilation
+// ============================
+
+Mask::Mask() : has_star(true), leading_star(true), trailing_star(true)
+{}
+
+/*
+Runs of stars collapse into one; what lies between two stars is a piece.
+*/
+Mask::Mask(std::string const &pattern) : has_star(false), leading_star(false), trailing_star(false)
+{
+	Piece piece;
+
+	folded.reserve(pattern.size());
+	piece.start = 0;
+	piece.size = 0;
+	for (std::string::const_iterator c = pattern.begin(); c != pattern.end(); c++)
+	{
+		if (*c != '*')
+		{
+			folded += fold(*c);
+			piece.size++;
+			continue ;
+		}
+		if (c == pattern.begin())
+			leading_star = true;
+		has_star = true;
+		if (piece.size)
+			pieces.push_back(piece);
+		piece.start = folded.size();
+		piece.size = 0;
+	}
+	if (piece.size || !has_star)
+		pieces.push_back(piece);
+	trailing_star = !pattern.empty() && pattern[pattern.size() - 1] == '*';
+}
+
+
+// ============================
+//          Matching
+// ============================
+
+char Mask::fold(char c)
+{
+	if (c >= 'A' && c <= '^')
+		return c + ('a' - 'A');
+	return c;
+}
+
+bool Mask::has_wildcards(std::string const &pattern)
+{
+	return pattern.find_first_of("*?") != pattern.npos;
+}
+
+bool Mask::matches_everything(void) const
+{
+	return has_star && pieces.empty();
+}
+
+bool Mask::piece_at(Piece const &piece, char const *subject) const
+{
+	for (size_t i = 0; i < piece.size; i++)
+	{
+		char p = folded[piece.start + i];
+
+		if (p != '?' && p != fold(subject[i]))
+			return false;
+	}
+	return true;
+}
+
+bool Mask::matches(std::string const &subject) const
+{
+	return matches(subject.data(), subject.size());
+}
+
+/*
+Without stars the one piece has to cover the whole subject. Otherwise
+the first piece is pinned to the start unless the pattern starts with a
+star, the last one to the end unless it ends with one, and every other
+piece is taken at its leftmost place after the previous one, which is
+never worse than any later place.
+*/
+bool Mask::matches(char const *subject, size_t size) const
+{
+	size_t first = 0;
+	size_t last = pieces.size();
+	size_t pos = 0;
+	size_t end = size;
+
+	if (!has_star)
+		return pieces[0].size == size && piece_at(pieces[0], subject);
+	if (first < last && !leading_star)
+	{
+		if (pieces[first].size > size || !piece_at(pieces[first], subject))
+			return false;
+		pos = pieces[first++].size;
+	}
+	if (first < last && !trailing_star)
+	{
+		Piece const &tail = pieces[--last];
+
+		if (tail.size > end - pos)
+			return false;
+		end -= tail.size;
+		if (!piece_at(tail, subject + end))
+			return false;
+	}
+	for (; first < last; first++)
+	{
+		while (pos + pieces[first].size <= end && !piece_at(pieces[first], subject + pos))
+			pos++;
+		if (pos + pieces[first].size > end)
+			return false;
+		pos += pieces[first].size;
+	}
+	return true;
+}
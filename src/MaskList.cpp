@@ -0,0 +1,199 @@
+#include "MaskList.hpp"
+
+#include <algorithm>
+
+
+// ============================
+//         Constructor
+// ============================
+
+MaskList::MaskList() {}
+
+MaskList::~MaskList()
+{
+	clear();
+}
+
+
+// ============================
+//           Helpers
+// ============================
+
+std::string MaskList::fold(std::string const &text)
+{
+	std::string folded(text);
+
+	for (std::string::iterator c = folded.begin(); c != folded.end(); c++)
+		*c = Mask::fold(*c);
+	return folded;
+}
+
+/*
+The bucket map a folded mask with wildcards is filed in, and its key
+there; NULL when neither end has key_size literal characters.
+*/
+MaskList::Buckets *MaskList::index_of(std::string const &folded, std::string &key)
+{
+	size_t first = folded.find_first_of("*?");
+	size_t last = folded.find_last_of("*?");
+
+	if (first >= key_size)
+	{
+		key = folded.substr(0, key_size);
+		return &by_prefix;
+	}
+	if (folded.size() - last - 1 >= key_size)
+	{
+		key = folded.substr(folded.size() - key_size);
+		return &by_suffix;
+	}
+	return NULL;
+}
+
+bool MaskList::any_matches(std::vector<Entry *> const *bucket, std::string const &subject)
+{
+	if (!bucket)
+		return false;
+	for (std::vector<Entry *>::const_iterator i = bucket->begin(); i != bucket->end(); i++)
+	{
+		if ((*i)->compiled.matches(subject))
+			return true;
+	}
+	return false;
+}
+
+/*
+Fills in the parts a short mask leaves out: "bob" is "bob!*@*" and
+"*@host" is "*!*@host".
+*/
+std::string MaskList::normalize(std::string const &mask)
+{
+	size_t bang = mask.find('!');
+	size_t at = mask.find('@', bang == mask.npos ? 0 : bang);
+	std::string nick;
+	std::string user;
+	std::string host;
+
+	if (bang == mask.npos && at == mask.npos)
+		nick = mask;
+	else if (bang == mask.npos)
+	{
+		user = mask.substr(0, at);
+		host = mask.substr(at + 1);
+	}
+	else
+	{
+		nick = mask.substr(0, bang);
+		user = mask.substr(bang + 1, at == mask.npos ? mask.npos : at - bang - 1);
+		if (at != mask.npos)
+			host = mask.substr(at + 1);
+	}
+	return (nick.empty() ? "*" : nick) + '!' + (user.empty() ? "*" : user) + '@' + (host.empty() ? "*" : host);
+}
+
+
+// ============================
+//           Changes
+// ============================
+
+/*
+False when the list already holds the mask, compared case-insensitively.
+*/
+bool MaskList::add(std::string const &mask, std::string const &setter, std::time_t set_at)
+{
+	std::string folded = fold(mask);
+	std::string key;
+	Buckets *buckets;
+	Entry *entry;
+
+	if (by_mask.find(folded))
+		return false;
+	entry = new Entry();
+	entry->mask = mask;
+	entry->setter = setter;
+	entry->set_at = set_at;
+	entry->compiled = Mask(mask);
+	by_mask.insert(folded, entry);
+	entries.push_back(entry);
+	if (!Mask::has_wildcards(mask))
+		return true;
+	buckets = index_of(folded, key);
+	if (!buckets)
+		unindexed.push_back(entry);
+	else
+	{
+		buckets->insert(key, std::vector<Entry *>());
+		buckets->find(key)->push_back(entry);
+	}
+	return true;
+}
+
+bool MaskList::remove(std::string const &mask)
+{
+	std::string folded = fold(mask);
+	std::vector<Entry *> *bucket;
+	Entry *const *found = by_mask.find(folded);
+	std::string key;
+	Buckets *buckets;
+	Entry *entry;
+
+	if (!found)
+		return false;
+	entry = *found;
+	by_mask.erase(folded);
+	entries.erase(std::find(entries.begin(), entries.end(), entry));
+	if (Mask::has_wildcards(entry->mask))
+	{
+		buckets = index_of(folded, key);
+		bucket = buckets ? buckets->find(key) : &unindexed;
+		bucket->erase(std::find(bucket->begin(), bucket->end(), entry));
+		if (buckets && bucket->empty())
+			buckets->erase(key);
+	}
+	delete entry;
+	return true;
+}
+
+void MaskList::clear(void)
+{
+	for (std::vector<Entry *>::const_iterator i = entries.begin(); i != entries.end(); i++)
+		delete *i;
+	entries.clear();
+	by_mask.clear();
+	by_prefix.clear();
+	by_suffix.clear();
+	unindexed.clear();
+}
+
+
+// ============================
+//           Lookup
+// ============================
+
+bool MaskList::matches(std::string const &subject) const
+{
+	std::string folded;
+
+	if (entries.empty())
+		return false;
+	folded = fold(subject);
+	if (by_mask.find(folded))
+		return true;
+	if (folded.size() >= key_size)
+	{
+		if (any_matches(by_prefix.find(folded.substr(0, key_size)), subject)
+			|| any_matches(by_suffix.find(folded.substr(folded.size() - key_size)), subject))
+			return true;
+	}
+	return any_matches(&unindexed, subject);
+}
+
+size_t MaskList::size(void) const
+{
+	return entries.size();
+}
+
+std::vector<MaskList::Entry *> const &MaskList::get_entries(void) const
+{
+	return entries;
+}
@@ -0,0 +1,289 @@
+#include "Poller.hpp"
+#include "SystemCallErrorMessage.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+
+// ============================
+//   Constructor & Destructor
+// ============================
+
+Poller::Poller() : poll_fd(-1)
+{
+	std::memset(&counters, 0, sizeof(counters));
+}
+
+Poller::~Poller()
+{
+	close();
+}
+
+
+// ============================
+//           Setup
+// ============================
+
+void Poller::open(void)
+{
+	close();
+	#ifdef __APPLE__
+	poll_fd = kqueue();
+	if (-1 == poll_fd)
+		throw (SCEM_KQUEUE);
+	(void) fcntl(poll_fd, F_SETFD, FD_CLOEXEC);
+	#else
+	poll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (-1 == poll_fd)
+		throw (SCEM_EPOLL_CREATE);
+	#endif
+}
+
+void Poller::close(void)
+{
+	if (poll_fd != -1)
+		::close(poll_fd);
+	poll_fd = -1;
+	interests.clear();
+	dirty.clear();
+	ready.clear();
+	#ifdef __APPLE__
+	changes.clear();
+	#endif
+}
+
+int Poller::get_fd(void) const
+{
+	return poll_fd;
+}
+
+Poller::Counters const &Poller::get_counters(void) const
+{
+	return counters;
+}
+
+
+// ============================
+//          Interest
+// ============================
+
+Poller::Interest &Poller::interest_of(int fd)
+{
+	Interest none = {false, false, false, false, 0};
+
+	if (static_cast<size_t>(fd) >= interests.size())
+		interests.resize(fd + 1, none);
+	return interests[fd];
+}
+
+void Poller::register_fd(int fd, bool connection)
+{
+	#ifdef __APPLE__
+	struct kevent ev;
+
+	(void) connection;
+	EV_SET(&ev, fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, NULL);
+	changes.push_back(ev);
+	#else
+	epoll_event ev;
+	(void) std::memset(&ev, 0, sizeof(ev));
+
+	ev.events = connection ? EPOLLIN | EPOLLRDHUP | EPOLLHUP : EPOLLIN;
+	ev.data.fd = fd;
+	if (-1 == epoll_ctl(poll_fd, EPOLL_CTL_ADD, fd, &ev))
+		throw (SCEM_EPOLL_CTL);
+	#endif
+	counters.submitted++;
+}
+
+unsigned long Poller::owner_of(int fd) const
+{
+	if (fd < 0 || static_cast<size_t>(fd) >= interests.size() || !interests[fd].watched)
+		return 0;
+	return interests[fd].owner;
+}
+
+void Poller::add(int fd)
+{
+	Interest &interest = interest_of(fd);
+
+	interest.watched = true;
+	interest.registered_out = false;
+	interest.wanted_out = false;
+	interest.owner = 0;
+	register_fd(fd, false);
+}
+
+void Poller::add_connection(int fd, unsigned long owner)
+{
+	Interest &interest = interest_of(fd);
+
+	interest.watched = true;
+	interest.registered_out = false;
+	interest.wanted_out = false;
+	interest.owner = owner;
+	register_fd(fd, true);
+}
+
+#ifdef __APPLE__
+void Poller::add_signal(int sig)
+{
+	struct kevent ev;
+
+	EV_SET(&ev, sig, EVFILT_SIGNAL, EV_ADD | EV_ENABLE, 0, 0, NULL);
+	changes.push_back(ev);
+	counters.submitted++;
+}
+#endif
+
+/*
+Only noted here; see submit().
+*/
+void Poller::set_writable(int fd, bool writable)
+{
+	if (-1 == poll_fd || fd < 0 || static_cast<size_t>(fd) >= interests.size() || !interests[fd].watched)
+		return ;
+	counters.requested++;
+	interests[fd].wanted_out = writable;
+	if (!interests[fd].queued)
+	{
+		interests[fd].queued = true;
+		dirty.push_back(fd);
+	}
+}
+
+/*
+Closing the fd takes it out of the kernel's set; this forgets it here
+and drops changes for it that were not sent yet.
+*/
+void Poller::remove(int fd)
+{
+	if (fd < 0 || static_cast<size_t>(fd) >= interests.size())
+		return ;
+	interests[fd].watched = false;
+	interests[fd].registered_out = false;
+	interests[fd].wanted_out = false;
+	interests[fd].owner = 0;
+	#ifdef __APPLE__
+	for (size_t i = 0; i < changes.size(); )
+	{
+		if (static_cast<int>(changes[i].ident) == fd && changes[i].filter != EVFILT_SIGNAL)
+			changes.erase(changes.begin() + i);
+		else
+			i++;
+	}
+	#endif
+}
+
+/*
+Sends the write interest changes noted since the last wait, skipping
+those that ended where they started. A change the kernel refuses is
+logged and dropped; the fd keeps the interest it had, and the other
+changes still go through.
+*/
+void Poller::submit(void)
+{
+	for (std::vector<int>::const_iterator i = dirty.begin(); i != dirty.end(); i++)
+	{
+		Interest &interest = interests[*i];
+
+		interest.queued = false;
+		if (!interest.watched || interest.wanted_out == interest.registered_out)
+			continue ;
+		#ifdef __APPLE__
+		struct kevent ev;
+
+		EV_SET(&ev, *i, EVFILT_WRITE, interest.wanted_out ? EV_ADD | EV_ENABLE : EV_DELETE, 0, 0, NULL);
+		changes.push_back(ev);
+		#else
+		epoll_event ev;
+		(void) std::memset(&ev, 0, sizeof(ev));
+
+		ev.events = EPOLLIN | EPOLLRDHUP | EPOLLHUP;
+		if (interest.wanted_out)
+			ev.events |= EPOLLOUT;
+		ev.data.fd = *i;
+		if (-1 == epoll_ctl(poll_fd, EPOLL_CTL_MOD, *i, &ev))
+		{
+			std::cerr << "Poller: " << SystemCallErrorMessage::get_func_name(SCEM_EPOLL_CTL) << " on fd "
+				<< *i << ": " << std::strerror(errno) << ", change dropped\n";
+			interest.wanted_out = interest.registered_out;
+			continue ;
+		}
+		#endif
+		interest.registered_out = interest.wanted_out;
+		counters.submitted++;
+	}
+	dirty.clear();
+}
+
+
+// ============================
+//          Waiting
+// ============================
+
+/*
+A negative timeout waits for ever. An interrupted wait returns no events.
+*/
+int Poller::wait(int timeout_ms, size_t max_events)
+{
+	Event event;
+	int nfds;
+
+	submit();
+	events.resize(std::max(max_events, static_cast<size_t>(1)));
+	ready.clear();
+	#ifdef __APPLE__
+	struct timespec timeout;
+
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_nsec = timeout_ms % 1000 * 1000000;
+	nfds = kevent(poll_fd, changes.empty() ? NULL : &changes[0], changes.size(), &events[0], events.size(),
+		timeout_ms < 0 ? NULL : &timeout);
+	changes.clear();
+	if (-1 == nfds && errno != EINTR)
+		throw (SCEM_KEVENT);
+	for (int i = 0; i < nfds; i++)
+	{
+		if (events[i].flags & EV_ERROR)
+		{
+			std::cerr << "Poller: " << SystemCallErrorMessage::get_func_name(SCEM_KEVENT) << " on fd "
+				<< events[i].ident << ": " << std::strerror(static_cast<int>(events[i].data)) << ", change dropped\n";
+			continue ;
+		}
+		event.fd = events[i].ident;
+		event.owner = events[i].filter == EVFILT_SIGNAL ? 0 : owner_of(event.fd);
+		event.readable = events[i].filter == EVFILT_READ;
+		event.writable = events[i].filter == EVFILT_WRITE;
+		event.hangup = events[i].flags & EV_EOF;
+		event.signal = events[i].filter == EVFILT_SIGNAL;
+		ready.push_back(event);
+	}
+	#else
+	nfds = epoll_wait(poll_fd, &events[0], events.size(), timeout_ms);
+	if (-1 == nfds && errno != EINTR)
+		throw (SCEM_EPOLL_WAIT);
+	for (int i = 0; i < nfds; i++)
+	{
+		event.fd = events[i].data.fd;
+		event.owner = owner_of(event.fd);
+		event.readable = events[i].events & EPOLLIN;
+		event.writable = events[i].events & EPOLLOUT;
+		event.hangup = events[i].events & (EPOLLHUP | EPOLLRDHUP);
+		event.signal = false;
+		ready.push_back(event);
+	}
+	#endif
+	counters.waits++;
+	counters.events += ready.size();
+	return ready.size();
+}
+
+Poller::Event const &Poller::get_event(int i) const
+{
+	return ready[i];
+}
@@ -0,0 +1,148 @@
+#include "Recorder.hpp"
+#include "CommandStats.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+// ============================
+//         Constructor
+// ============================
+
+Recorder::Recorder() : fd(-1), last_ns(0), flushed_ns(0) {}
+
+Recorder::~Recorder()
+{
+	close();
+}
+
+
+// ============================
+//          The file
+// ============================
+
+bool Recorder::is_open(void) const
+{
+	return fd != -1;
+}
+
+std::string const &Recorder::get_path(void) const
+{
+	return path;
+}
+
+/*
+A recording that cannot be opened or written is reported and dropped;
+it never stops the server.
+*/
+void Recorder::open(std::string const &path)
+{
+	struct stat st;
+
+	close();
+	this->path = path;
+	fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if (fd == -1 || fstat(fd, &st) == -1)
+	{
+		std::cerr << "Recorder: cannot open " << path << ": " << std::strerror(errno) << "\n";
+		return close();
+	}
+	last_ns = CycleClock::monotonic_ns();
+	flushed_ns = last_ns;
+	if (st.st_size != 0)
+		return ;
+	buffer.put_u32(magic);
+	buffer.put_u32(version);
+	buffer.put_u32(std::time(NULL));
+	flush();
+}
+
+void Recorder::close(void)
+{
+	flush();
+	if (fd != -1)
+		::close(fd);
+	fd = -1;
+	path.clear();
+	buffer.clear();
+}
+
+void Recorder::flush(void)
+{
+	std::string const &data = buffer.data();
+	size_t done = 0;
+	ssize_t written;
+
+	while (fd != -1 && done < data.size())
+	{
+		written = write(fd, data.data() + done, data.size() - done);
+		if (written == -1 && errno == EINTR)
+			continue ;
+		if (written == -1)
+		{
+			std::cerr << "Recorder: cannot write " << path << ": " << std::strerror(errno) << ", recording stopped\n";
+			::close(fd);
+			fd = -1;
+			break ;
+		}
+		done += written;
+	}
+	buffer.clear();
+	flushed_ns = CycleClock::monotonic_ns();
+}
+
+
+// ============================
+//           Records
+// ============================
+
+/*
+Gaps longer than a u32 of microseconds (about 71 minutes) are cut short.
+*/
+void Recorder::put_record(record_type type, uint32 conn)
+{
+	unsigned long now = CycleClock::monotonic_ns();
+	unsigned long gap_us = (now - last_ns) / 1000;
+
+	last_ns = now;
+	buffer.put_u8(type);
+	buffer.put_u32(gap_us > 0xffffffffUL ? 0xffffffffUL : gap_us);
+	buffer.put_u32(conn);
+}
+
+void Recorder::wrote_record(void)
+{
+	if (buffer.data().size() >= flush_bytes || last_ns - flushed_ns >= flush_interval_ns)
+		flush();
+}
+
+void Recorder::record_open(uint32 conn, int port)
+{
+	if (fd == -1)
+		return ;
+	put_record(REC_OPEN, conn);
+	buffer.put_u32(port);
+	wrote_record();
+}
+
+void Recorder::record_data(uint32 conn, char const *data, size_t size)
+{
+	if (fd == -1)
+		return ;
+	put_record(REC_DATA, conn);
+	buffer.put_string(data, size);
+	wrote_record();
+}
+
+void Recorder::record_close(uint32 conn)
+{
+	if (fd == -1)
+		return ;
+	put_record(REC_CLOSE, conn);
+	wrote_record();
+}
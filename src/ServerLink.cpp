@@ -0,0 +1,522 @@
+#include "ServerLink.hpp"
+#include "Channel.hpp"
+#include "Client.hpp"
+
+#include <ctime>
+#include <iostream>
+#include <sstream>
+
+ServerLink::Command ServerLink::commands[] = {
+	{"UID",     &ServerLink::uid},
+	{"SJOIN",   &ServerLink::sjoin},
+	{"TB",      &ServerLink::tb},
+	{"BMASK",   &ServerLink::bmask},
+	{"NICK",    &ServerLink::nick},
+	{"QUIT",    &ServerLink::quit},
+	{"PRIVMSG", &ServerLink::privmsg},
+	{"NOTICE",  &ServerLink::privmsg},
+	{"KICK",    &ServerLink::kick},
+	{"PART",    &ServerLink::part},
+	{"TOPIC",   &ServerLink::topic},
+	{"TMODE",   &ServerLink::tmode},
+	{"INVITE",  &ServerLink::invite},
+	{"PING",    &ServerLink::ping},
+	{"ERROR",   &ServerLink::error}
+};
+
+
+// ============================
+//         Constructor
+// ============================
+
+ServerLink::ServerLink(App &app, Client &conn) : app(app), conn(conn), outgoing(false), linked(false) {}
+
+
+// ============================
+//       Helper functions
+// ============================
+
+/*
+Server ids are three base 36 digits derived from the listening port,
+so instances sharing a host get distinct ids.
+*/
+std::string ServerLink::make_server_id(int port)
+{
+	static char const digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+	std::string sid(3, '0');
+
+	port %= 36 * 36 * 36;
+	for (int i = 2; i >= 0; i--)
+	{
+		sid[i] = digits[port % 36];
+		port /= 36;
+	}
+	return sid;
+}
+
+std::string ServerLink::join_params(std::vector<std::string> const &params, size_t from)
+{
+	std::string res;
+
+	for (size_t i = from; i < params.size(); i++)
+	{
+		if (i > from)
+			res += ' ';
+		res += params[i];
+	}
+	return res;
+}
+
+std::string ServerLink::uid_line(App const &app, Client const &user)
+{
+	std::ostringstream oss;
+
+	oss << ':' << user.get_uid().substr(0, 3) << " UID " << user.get_nickname() << " 1 " << std::time(NULL)
+		<< " +i " << user.get_username() << ' ' << app.server_name << " 0 " << user.get_uid()
+		<< " :" << user.get_realname();
+	return oss.str();
+}
+
+/*
+members is a space separated list of uids, each prefixed with '@' for channel operators.
+*/
+std::string ServerLink::sjoin_line(App const &app, Channel const &channel, std::string const &members)
+{
+	return ':' + app.server_id + " SJOIN 0 " + channel.name + ' ' + channel.get_burst_modes() + " :" + members;
+}
+
+/*
+A server id is taken from this link unless it is ours or was first
+seen on another link.
+*/
+bool ServerLink::is_behind(std::string const &server_id) const
+{
+	Client *owner;
+
+	if (server_id == app.server_id)
+		return false;
+	owner = app.find_link_by_sid(server_id);
+	return !owner || owner == &conn;
+}
+
+/*
+Passes a command on to every other link, unchanged.
+*/
+void ServerLink::relay(Message const &msg) const
+{
+	std::string line;
+
+	if (!msg.prefix.empty())
+		line = ':' + msg.prefix + ' ';
+	line += msg.command + ' ' + join_params(msg.params, 0);
+	app.propagate(&conn, line);
+}
+
+
+// ============================
+//       Link setup
+// ============================
+
+void ServerLink::send_handshake(std::string const &password) const
+{
+	conn.send_message("PASS " + password + " TS 6 :" + app.server_id);
+	conn.send_message("SERVER " + app.server_name + " 1 " + app.server_id + " :" + app.network_name);
+}
+
+/*
+A channel's ban or exception list, as many masks per line as fit in
+max_sjoin_len.
+*/
+void ServerLink::add_bmask_lines(Channel const &channel, chan_mode_enum mode, std::string &burst) const
+{
+	std::vector<MaskList::Entry *> const &entries = channel.get_list(mode).get_entries();
+	std::string prefix = ':' + app.server_id + " BMASK 0 " + channel.name + (mode == BAN ? " b :" : " e :");
+	std::string masks;
+
+	for (std::vector<MaskList::Entry *>::const_iterator i = entries.begin(); i != entries.end(); i++)
+	{
+		if (!masks.empty() && masks.size() + (*i)->mask.size() + 1 > max_sjoin_len)
+		{
+			burst += prefix + masks + CRLF;
+			masks.clear();
+		}
+		masks += (masks.empty() ? "" : " ") + (*i)->mask;
+	}
+	if (!masks.empty())
+		burst += prefix + masks + CRLF;
+}
+
+/*
+Introduces every known user and channel membership to the new peer.
+SJOIN lines carry as many members as fit in max_sjoin_len, and the
+whole burst leaves in a single send.
+*/
+void ServerLink::send_burst(void) const
+{
+	std::vector<Client *> clients = app.get_clients();
+	std::vector<Channel *> channels = app.get_channels();
+	std::string burst;
+	std::string members;
+
+	for (std::vector<Client *>::const_iterator i = clients.begin(); i != clients.end(); i++)
+	{
+		if ((*i)->is_registered_client() && (*i)->get_uplink() != &conn)
+			burst += uid_line(app, **i) + CRLF;
+	}
+	for (std::vector<Channel *>::const_iterator ch = channels.begin(); ch != channels.end(); ch++)
+	{
+		members.clear();
+		for (Membership const *i = (*ch)->get_members(); i; i = i->channel_next)
+		{
+			if (i->client->get_uplink() == &conn)
+				continue ;
+			std::string member = (i->op ? "@" : "") + i->client->get_uid();
+			if (!members.empty() && members.size() + member.size() + 1 > max_sjoin_len)
+			{
+				burst += sjoin_line(app, **ch, members) + CRLF;
+				members.clear();
+			}
+			members += (members.empty() ? "" : " ") + member;
+		}
+		if (!members.empty())
+			burst += sjoin_line(app, **ch, members) + CRLF;
+		if (!members.empty() && (*ch)->get_topic() != ":")
+			burst += ':' + app.server_id + " TB " + (*ch)->name + " 0 " + (*ch)->get_topic() + CRLF;
+		if (!members.empty())
+		{
+			add_bmask_lines(**ch, BAN, burst);
+			add_bmask_lines(**ch, BAN_EXCEPT, burst);
+		}
+	}
+	if (burst.empty())
+		return ;
+	burst.erase(burst.size() - 2);
+	conn.send_message(burst);
+}
+
+
+// ============================
+//         Execution
+// ============================
+
+/*
+The prefix names the user (uid) or the server (sid) the command comes from.
+Commands from a source that is not behind this link are dropped.
+Unknown commands, numerics included, are ignored. Returns whether the
+command reached its handler.
+*/
+bool ServerLink::execute(Message const &msg)
+{
+	Client *source = NULL;
+	size_t commands_size = sizeof(commands) / sizeof(Command);
+
+	if (msg.prefix.size() > 3)
+	{
+		source = app.find_client_by_uid(msg.prefix);
+		if (!source || source->get_uplink() != &conn)
+			return false;
+	}
+	else if (!msg.prefix.empty() && !is_behind(msg.prefix))
+		return false;
+	for (size_t i = 0; i < commands_size; i++)
+	{
+		if (commands[i].name == msg.command)
+		{
+			(this->*(commands[i].cmd_func))(source, msg);
+			return true;
+		}
+	}
+	return false;
+}
+
+
+// ============================
+//       Users
+// ============================
+
+/*
+Two users with the same nick cannot be merged: the link is dropped.
+The uid must start with the id of the server introducing it.
+*/
+void ServerLink::uid(Client *source, Message const &msg)
+{
+	Client *user;
+
+	(void) source;
+	if (msg.params.size() < 9 || msg.prefix.size() != 3 || msg.params[7].size() <= 3
+		|| msg.params[7].compare(0, 3, msg.prefix))
+		return ;
+	if (app.find_client_by_uid(msg.params[7]) || app.find_client_by_nick(msg.params[0]))
+	{
+		conn.send_message("ERROR :Nick collision on " + msg.params[0]);
+		return conn.request_close();
+	}
+	user = new Client(app, -1);
+	if (!app.add_client(user))
+	{
+		delete user;
+		conn.send_message("ERROR :Too many clients");
+		return conn.request_close();
+	}
+	sids.insert(msg.prefix);
+	user->set_remote(&conn, msg.params[7], msg.params[0], msg.params[4], msg.params[5],
+		msg.params[8][0] == ':' ? msg.params[8].substr(1) : msg.params[8]);
+	app.add_remote_client(user);
+	relay(msg);
+}
+
+void ServerLink::nick(Client *source, Message const &msg)
+{
+	Client *other;
+
+	if (!source || !source->is_remote() || msg.params.empty())
+		return ;
+	other = app.find_client_by_nick(msg.params[0]);
+	if (other && other != source)
+	{
+		conn.send_message("ERROR :Nick collision on " + msg.params[0]);
+		return conn.request_close();
+	}
+	source->set_remote_nick(msg.params[0]);
+	relay(msg);
+}
+
+/*
+App::remove_client() tells the local channel members and the other links.
+*/
+void ServerLink::quit(Client *source, Message const &msg)
+{
+	if (!source || !source->is_remote())
+		return ;
+	if (!msg.params.empty())
+		source->set_quit_reason(msg.params[0][0] == ':' ? msg.params[0].substr(1) : msg.params[0]);
+	app.remove_client(source->get_uuid());
+}
+
+
+// ============================
+//       Channels
+// ============================
+
+/*
+Channel modes are only taken over when the channel did not exist here;
+there is no timestamp based conflict resolution in this subset.
+*/
+void ServerLink::sjoin(Client *source, Message const &msg)
+{
+	std::vector<std::string> mode_params;
+	Channel::chan_mode_delta_t delta;
+	std::vector<std::string> lines;
+	std::istringstream members;
+	std::string member;
+	Channel *channel;
+	Client *user;
+	bool is_op;
+
+	(void) source;
+	if (msg.params.size() < 4)
+		return ;
+	channel = app.find_channel_by_name(msg.params[1]);
+	if (!channel)
+	{
+		if (!Channel::is_valid_channel_name(msg.params[1]))
+			return ;
+		channel = app.create_channel(msg.params[1]);
+		app.add_channel(channel);
+		mode_params.push_back(msg.params[1]);
+		mode_params.insert(mode_params.end(), msg.params.begin() + 2, msg.params.end() - 1);
+		if (msg.params[2] != "+" && Channel::mode_str_has_enough_params(msg.params[2], mode_params.size() - 2))
+		{
+			channel->parse_mode(conn, msg.params[2], mode_params, delta);
+			channel->change_mode(delta, lines);
+		}
+	}
+
+	members.str(msg.params.back()[0] == ':' ? msg.params.back().substr(1) : msg.params.back());
+	while (members >> member)
+	{
+		is_op = member[0] == '@';
+		user = app.find_client_by_uid(is_op ? member.substr(1) : member);
+		if (!user || user->get_uplink() != &conn || channel->is_on_channel(user))
+			continue ;
+		channel->add_client(user, is_op);
+		channel->notify(user->get_full_nickname(), "JOIN", "");
+	}
+	relay(msg);
+}
+
+/*
+Ban list burst: the masks are added to the list the channel has, and
+local members see them set by the peer server.
+*/
+void ServerLink::bmask(Client *source, Message const &msg)
+{
+	std::vector<std::string> mode_params;
+	Channel::chan_mode_map_t const *map;
+	Channel::chan_mode_delta_t delta;
+	std::vector<std::string> lines;
+	std::istringstream masks;
+	std::string mask;
+	Channel *channel;
+
+	(void) source;
+	if (msg.params.size() < 4 || msg.params[2].size() != 1)
+		return ;
+	channel = app.find_channel_by_name(msg.params[1]);
+	map = Channel::mode_table[static_cast<unsigned char>(msg.params[2][0])];
+	if (!channel || !map || map->mode_type != 'a')
+		return ;
+	mode_params.push_back(channel->name);
+	mode_params.push_back("+");
+	masks.str(msg.params[3][0] == ':' ? msg.params[3].substr(1) : msg.params[3]);
+	while (masks >> mask)
+	{
+		mode_params[1] += map->mode_char;
+		mode_params.push_back(mask);
+	}
+	channel->parse_mode(conn, mode_params[1], mode_params, delta);
+	channel->change_mode(delta, lines);
+	for (std::vector<std::string>::const_iterator i = lines.begin(); i != lines.end(); i++)
+		channel->notify(name, "MODE", *i);
+	relay(msg);
+}
+
+/*
+Topic burst: only fills in a topic the channel does not have yet.
+*/
+void ServerLink::tb(Client *source, Message const &msg)
+{
+	Channel *channel;
+
+	(void) source;
+	if (msg.params.size() < 3)
+		return ;
+	channel = app.find_channel_by_name(msg.params[0]);
+	if (!channel || channel->get_topic() != ":")
+		return ;
+	channel->set_topic(msg.params[2]);
+	relay(msg);
+}
+
+/*
+Also handles NOTICE. Targets are channels and uids, possibly several
+of them. Client::deliver_text() splits them again: each local user gets
+a line with one target, and the other links get the list.
+*/
+void ServerLink::privmsg(Client *source, Message const &msg)
+{
+	if (!source || !source->is_remote())
+		return ;
+	source->send_text(msg.command, msg.params);
+}
+
+void ServerLink::kick(Client *source, Message const &msg)
+{
+	Channel *channel;
+	Client *target;
+
+	if (!source || msg.params.size() < 2)
+		return ;
+	channel = app.find_channel_by_name(msg.params[0]);
+	target = app.find_client_by_uid(msg.params[1]);
+	if (!channel || !target || !channel->is_on_channel(target) || !channel->is_channel_operator(source))
+		return ;
+	channel->notify(source->get_full_nickname(), "KICK", target->get_nickname());
+	channel->remove_client(target);
+	relay(msg);
+}
+
+void ServerLink::part(Client *source, Message const &msg)
+{
+	Membership *member;
+	Channel *channel;
+
+	if (!source || !source->is_remote() || msg.params.empty())
+		return ;
+	channel = app.find_channel_by_name(msg.params[0]);
+	member = channel ? channel->find_member(source) : NULL;
+	if (!member)
+		return ;
+	channel->notify(source->get_full_nickname(), "PART", msg.params.size() > 1 ? msg.params[1] : "");
+	channel->remove_member(member);
+	relay(msg);
+}
+
+void ServerLink::topic(Client *source, Message const &msg)
+{
+	Channel *channel;
+
+	if (!source || msg.params.size() < 2)
+		return ;
+	channel = app.find_channel_by_name(msg.params[0]);
+	if (!channel)
+		return ;
+	channel->set_topic(msg.params[1]);
+	channel->notify(source->get_full_nickname(), "TOPIC", msg.params[1]);
+	relay(msg);
+}
+
+/*
+Params: <ts> <channel> <modes> [<mode params>], the mode string as the
+user typed it. The origin server checked it, but it only applies here
+if the source is an operator of the channel on this side too.
+*/
+void ServerLink::tmode(Client *source, Message const &msg)
+{
+	std::vector<std::string> mode_params;
+	Channel::chan_mode_delta_t delta;
+	std::vector<std::string> lines;
+	Channel *channel;
+
+	if (!source || msg.params.size() < 3)
+		return ;
+	channel = app.find_channel_by_name(msg.params[1]);
+	if (!channel || (msg.params[2][0] != '+' && msg.params[2][0] != '-') || !channel->is_channel_operator(source))
+		return ;
+	mode_params.assign(msg.params.begin() + 1, msg.params.end());
+	if (!Channel::mode_str_has_enough_params(msg.params[2], mode_params.size() - 2))
+		return ;
+	channel->parse_mode(*source, msg.params[2], mode_params, delta);
+	channel->change_mode(delta, lines);
+	for (std::vector<std::string>::const_iterator i = lines.begin(); i != lines.end(); i++)
+		channel->notify(source->get_full_nickname(), "MODE", *i);
+	relay(msg);
+}
+
+/*
+Only the server of the invited user records the invite, others pass it along.
+*/
+void ServerLink::invite(Client *source, Message const &msg)
+{
+	Channel *channel;
+	Client *target;
+
+	if (!source || msg.params.size() < 2)
+		return ;
+	target = app.find_client_by_uid(msg.params[0]);
+	channel = app.find_channel_by_name(msg.params[1]);
+	if (!target || !channel)
+		return ;
+	if (target->is_remote())
+		return target->get_uplink()->send_message(':' + msg.prefix + " INVITE " + msg.params[0] + ' ' + msg.params[1]);
+	channel->add_invite(target);
+	target->send_message(app.create_message(source->get_full_nickname(), "INVITE", target->get_nickname() + ' ' + channel->name));
+}
+
+
+// ============================
+//       Link maintenance
+// ============================
+
+void ServerLink::ping(Client *source, Message const &msg)
+{
+	(void) source;
+	conn.send_message(':' + app.server_id + " PONG " + app.server_name + ' ' + (msg.params.empty() ? "" : msg.params[0]));
+}
+
+void ServerLink::error(Client *source, Message const &msg)
+{
+	(void) source;
+	std::cerr << "Link to " << name << " closed by peer: " << join_params(msg.params, 0) << "\n";
+	conn.request_close();
+}
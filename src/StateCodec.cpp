@@ -0,0 +1,90 @@
+#include "StateCodec.hpp"
+#include "InternalError.hpp"
+
+// ============================
+//          Writer
+// ============================
+
+void StateWriter::put_u8(unsigned char value)
+{
+	buff += static_cast<char>(value);
+}
+
+void StateWriter::put_u32(uint32 value)
+{
+	for (int i = 0; i < 4; i++)
+		buff += static_cast<char>((value >> (8 * i)) & 0xff);
+}
+
+void StateWriter::put_string(std::string const &value)
+{
+	put_string(value.data(), value.size());
+}
+
+void StateWriter::put_string(char const *value, size_t size)
+{
+	put_u32(size);
+	buff.append(value, size);
+}
+
+std::string const &StateWriter::data(void) const
+{
+	return buff;
+}
+
+void StateWriter::clear(void)
+{
+	buff.clear();
+}
+
+
+// ============================
+//          Reader
+// ============================
+
+StateReader::StateReader(char const *data, size_t size) : data(data), size(size), pos(0) {}
+
+unsigned char StateReader::get_u8(void)
+{
+	if (pos + 1 > size)
+		throw (IEC_BADSTATE);
+	return static_cast<unsigned char>(data[pos++]);
+}
+
+uint32 StateReader::get_u32(void)
+{
+	uint32 value = 0;
+
+	if (pos + 4 > size)
+		throw (IEC_BADSTATE);
+	for (int i = 0; i < 4; i++)
+		value |= static_cast<uint32>(static_cast<unsigned char>(data[pos++])) << (8 * i);
+	return value;
+}
+
+std::string StateReader::get_string(void)
+{
+	uint32 len = get_u32();
+
+	if (len > size - pos)
+		throw (IEC_BADSTATE);
+	pos += len;
+	return std::string(data + pos - len, len);
+}
+
+void StateReader::skip(size_t len)
+{
+	if (len > size - pos)
+		throw (IEC_BADSTATE);
+	pos += len;
+}
+
+size_t StateReader::get_pos(void) const
+{
+	return pos;
+}
+
+bool StateReader::at_end(void) const
+{
+	return pos == size;
+}
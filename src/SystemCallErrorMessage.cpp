@@ -13,7 +13,18 @@ std::pair<scem_function, std::string> sf_data[] = {
 	std::make_pair(SCEM_LISTEN,       "listen()"),
 	std::make_pair(SCEM_RECV,         "recv()"),
 	std::make_pair(SCEM_SOCKET,       "socket()"),
-	std::make_pair(SCEM_SIGACT,       "sigaction()")
+	std::make_pair(SCEM_SIGACT,       "sigaction()"),
+	std::make_pair(SCEM_SOCKETPAIR,   "socketpair()"),
+	std::make_pair(SCEM_FORK,         "fork()"),
+	std::make_pair(SCEM_SENDMSG,      "sendmsg()"),
+	std::make_pair(SCEM_RECVMSG,      "recvmsg()"),
+	std::make_pair(SCEM_OPEN,         "open()"),
+	std::make_pair(SCEM_MMAP,         "mmap()"),
+	std::make_pair(SCEM_WRITE,        "write()"),
+	std::make_pair(SCEM_RENAME,       "rename()"),
+	std::make_pair(SCEM_CONNECT,      "connect()"),
+	std::make_pair(SCEM_SIGPROCMASK,  "sigprocmask()"),
+	std::make_pair(SCEM_SIGNALFD,     "signalfd()")
 };
 
 std::map<scem_function, std::string> SystemCallErrorMessage::error_function(sf_data, sf_data + sizeof sf_data / sizeof sf_data[0]);
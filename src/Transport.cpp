@@ -0,0 +1,310 @@
+#include "Transport.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <sys/socket.h>
+
+
+// ============================
+//          Transport
+// ============================
+
+Transport::~Transport() {}
+
+
+// ============================
+//       SocketTransport
+// ============================
+
+SocketTransport::SocketTransport(Poller *poller) : poller(poller) {}
+
+ssize_t SocketTransport::recv(int fd, char *buff, size_t size)
+{
+	return ::recv(fd, buff, size, 0);
+}
+
+ssize_t SocketTransport::send(int fd, char const *data, size_t size)
+{
+	return ::send(fd, data, size, 0);
+}
+
+ssize_t SocketTransport::sendv(int fd, struct iovec const *iov, int count)
+{
+	return ::writev(fd, iov, count);
+}
+
+void SocketTransport::shutdown(int fd, int how)
+{
+	::shutdown(fd, how);
+}
+
+void SocketTransport::set_writable(int fd, bool writable)
+{
+	poller->set_writable(fd, writable);
+}
+
+
+// ============================
+//  MemoryTransport: connections
+// ============================
+
+MemoryTransport::MemoryTransport() : calls(0) {}
+
+MemoryTransport::Connection *MemoryTransport::find(int fd)
+{
+	size_t index = static_cast<size_t>(fd - first_fd);
+
+	if (fd < first_fd || index >= conns.size() || !conns[index].open)
+	{
+		errno = EBADF;
+		return NULL;
+	}
+	return &conns[index];
+}
+
+MemoryTransport::Connection const *MemoryTransport::find(int fd) const
+{
+	return const_cast<MemoryTransport *>(this)->find(fd);
+}
+
+int MemoryTransport::open(bool keep_output)
+{
+	Connection conn;
+	int fd;
+
+	conn.open = true;
+	conn.keep_output = keep_output;
+	conn.peer_closed = false;
+	conn.shut = false;
+	conn.writable = false;
+	conn.capacity = unlimited;
+	conn.max_write = unlimited;
+	conn.failing_writes = 0;
+	conn.bytes_sent = 0;
+	if (free_fds.empty())
+	{
+		conns.push_back(conn);
+		return first_fd + conns.size() - 1;
+	}
+	fd = free_fds.back();
+	free_fds.pop_back();
+	conns[fd - first_fd] = conn;
+	return fd;
+}
+
+void MemoryTransport::close(int fd)
+{
+	Connection *conn = find(fd);
+
+	if (!conn)
+		return ;
+	conn->open = false;
+	std::string().swap(conn->input);
+	std::string().swap(conn->output);
+	free_fds.push_back(fd);
+}
+
+
+// ============================
+//   MemoryTransport: the peer
+// ============================
+
+void MemoryTransport::feed(int fd, std::string const &data)
+{
+	Connection *conn = find(fd);
+
+	if (conn)
+		conn->input += data;
+}
+
+/*
+What is left to read still comes first, then recv() returns 0.
+*/
+void MemoryTransport::close_peer(int fd)
+{
+	Connection *conn = find(fd);
+
+	if (conn)
+		conn->peer_closed = true;
+}
+
+/*
+Taking the output frees its room in the capacity.
+*/
+std::string MemoryTransport::take_output(int fd)
+{
+	Connection *conn = find(fd);
+	std::string res;
+
+	if (conn)
+		res.swap(conn->output);
+	return res;
+}
+
+void MemoryTransport::set_capacity(int fd, size_t capacity)
+{
+	Connection *conn = find(fd);
+
+	if (conn)
+		conn->capacity = capacity;
+}
+
+void MemoryTransport::set_max_write(int fd, size_t max_write)
+{
+	Connection *conn = find(fd);
+
+	if (conn)
+		conn->max_write = max_write;
+}
+
+void MemoryTransport::fail_writes(int fd, unsigned long count)
+{
+	Connection *conn = find(fd);
+
+	if (conn)
+		conn->failing_writes = count;
+}
+
+bool MemoryTransport::is_shut(int fd) const
+{
+	Connection const *conn = find(fd);
+
+	return conn && conn->shut;
+}
+
+bool MemoryTransport::wants_writable(int fd) const
+{
+	Connection const *conn = find(fd);
+
+	return conn && conn->writable;
+}
+
+unsigned long MemoryTransport::get_bytes_sent(int fd) const
+{
+	Connection const *conn = find(fd);
+
+	return conn ? conn->bytes_sent : 0;
+}
+
+/*
+Every call the server made, the number of system calls sockets would
+have cost.
+*/
+unsigned long MemoryTransport::get_calls(void) const
+{
+	return calls;
+}
+
+
+// ============================
+//   MemoryTransport: server
+// ============================
+
+/*
+How much of a write of size bytes goes through, or -1 with errno set.
+*/
+ssize_t MemoryTransport::room_for(Connection &conn, size_t size)
+{
+	size_t room = size;
+
+	if (conn.peer_closed || conn.shut)
+	{
+		errno = EPIPE;
+		return -1;
+	}
+	if (conn.failing_writes)
+	{
+		conn.failing_writes--;
+		errno = EAGAIN;
+		return -1;
+	}
+	if (conn.capacity != unlimited)
+	{
+		size_t used = conn.keep_output ? conn.output.size() : 0;
+
+		room = conn.capacity > used ? conn.capacity - used : 0;
+	}
+	room = std::min(std::min(room, size), conn.max_write);
+	if (room == 0 && size)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	conn.bytes_sent += room;
+	return room;
+}
+
+ssize_t MemoryTransport::recv(int fd, char *buff, size_t size)
+{
+	Connection *conn = find(fd);
+
+	calls++;
+	if (!conn)
+		return -1;
+	if (conn->input.empty() && !conn->peer_closed)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	size = std::min(size, conn->input.size());
+	conn->input.copy(buff, size);
+	conn->input.erase(0, size);
+	return size;
+}
+
+ssize_t MemoryTransport::send(int fd, char const *data, size_t size)
+{
+	Connection *conn = find(fd);
+	ssize_t res;
+
+	calls++;
+	if (!conn)
+		return -1;
+	res = room_for(*conn, size);
+	if (res > 0 && conn->keep_output)
+		conn->output.append(data, res);
+	return res;
+}
+
+ssize_t MemoryTransport::sendv(int fd, struct iovec const *iov, int count)
+{
+	Connection *conn = find(fd);
+	size_t size = 0;
+	size_t left;
+	ssize_t res;
+
+	calls++;
+	if (!conn)
+		return -1;
+	for (int i = 0; i < count; i++)
+		size += iov[i].iov_len;
+	res = room_for(*conn, size);
+	left = res > 0 ? res : 0;
+	for (int i = 0; i < count && left && conn->keep_output; i++)
+	{
+		size_t part = std::min(left, iov[i].iov_len);
+
+		conn->output.append(static_cast<char const *>(iov[i].iov_base), part);
+		left -= part;
+	}
+	return res;
+}
+
+void MemoryTransport::shutdown(int fd, int how)
+{
+	Connection *conn = find(fd);
+
+	(void) how;
+	calls++;
+	if (conn)
+		conn->shut = true;
+}
+
+void MemoryTransport::set_writable(int fd, bool writable)
+{
+	Connection *conn = find(fd);
+
+	calls++;
+	if (conn)
+		conn->writable = writable;
+}
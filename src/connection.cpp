@@ -4,22 +4,23 @@
 #include <cstring>
 #include <iostream>
 #include <limits>
+#include <netdb.h>
 #include <netinet/in.h>
 #include <sstream>
-#ifdef __APPLE__
-#include <sys/event.h>
 #include <fcntl.h>
-#else
-#include <sys/epoll.h>
+#ifndef __APPLE__
+#include <sys/signalfd.h>
 #endif
 #include <unistd.h>
+#include <vector>
 #include "App.hpp"
 #include "Client.hpp"
 #include "InternalError.hpp"
+#include "Recorder.hpp"
 #include "SystemCallErrorMessage.hpp"
 #include "connection.hpp"
 
-int parse_port(char *s)
+int parse_port(char const *s)
 {
 	int port = 0;
 
@@ -33,212 +34,390 @@ int parse_port(char *s)
 	return (port);
 }
 
-int listen_sock_init(int port)
+/*
+Opens one listener. The address is numeric, IPv4 or IPv6; an IPv6
+socket only takes IPv6 so that "::" and "0.0.0.0" can share a port.
+Buffer sizes are set before listen() so accepted sockets inherit them.
+*/
+int listen_sock_init(Config::ListenSpec const &spec)
 {
 	int sock_fd = -1;
-	struct sockaddr_in sai;
-	(void) std::memset(&sai, 0, sizeof(sai));
-
-	sai.sin_family = AF_INET;
-	sai.sin_port = htons(port);
-	sai.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	struct addrinfo hints;
+	struct addrinfo *ai = NULL;
+	std::ostringstream port;
+	(void) std::memset(&hints, 0, sizeof(hints));
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV | AI_PASSIVE;
+	port << spec.port;
+	if (getaddrinfo(spec.address.c_str(), port.str().c_str(), &hints, &ai) != 0)
+		throw (IEC_BADADDR);
 
 	#ifdef __APPLE__
-	sock_fd = socket(sai.sin_family, SOCK_STREAM, 0);
+	sock_fd = socket(ai->ai_family, SOCK_STREAM, 0);
 	if (-1 == sock_fd)
+	{
+		freeaddrinfo(ai);
 		throw (SCEM_SOCKET);
+	}
 
 	if (fcntl(sock_fd, F_SETFL, O_NONBLOCK) == -1)
+	{
+		freeaddrinfo(ai);
+		close(sock_fd);
 		throw (SCEM_FCNTL);
+	}
 	#else
-	sock_fd = socket(sai.sin_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	sock_fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
 	if (-1 == sock_fd)
+	{
+		freeaddrinfo(ai);
 		throw (SCEM_SOCKET);
+	}
 	#endif
 
 	int set = 1;
 	setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &set, sizeof(set));
-
-	if (-1 == bind(sock_fd, (struct sockaddr *) &sai, sizeof(sai)))
+	if (ai->ai_family == AF_INET6)
+		setsockopt(sock_fd, IPPROTO_IPV6, IPV6_V6ONLY, &set, sizeof(set));
+	int size = spec.sndbuf;
+	if (size > 0)
+		setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	size = spec.rcvbuf;
+	if (size > 0)
+		setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	if (-1 == bind(sock_fd, ai->ai_addr, ai->ai_addrlen))
+	{
+		freeaddrinfo(ai);
+		close(sock_fd);
 		throw (SCEM_BIND);
+	}
+	freeaddrinfo(ai);
 
-	if (-1 == listen(sock_fd, ConnConst::max_conns))
+	if (-1 == listen(sock_fd, spec.backlog))
+	{
+		close(sock_fd);
 		throw (SCEM_LISTEN);
+	}
 
 	return (sock_fd);
 }
 
-int epoll_init(int listen_sock_fd)
+/*
+Opens every listener in specs that is not open yet.
+*/
+void open_listeners(std::vector<Config::ListenSpec> const &specs, std::vector<Listener> &listeners)
 {
+	Listener listener;
 
-	#ifdef __APPLE__
-	int kq_fd = -1;
-	struct kevent ev;
-	(void) std::memset(&ev, 0, sizeof(ev));
-
-	kq_fd = kqueue();
-	if (kq_fd == -1)
-		throw (SCEM_KQUEUE);
-	
-	EV_SET(&ev, listen_sock_fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, NULL);
-	if (kevent(kq_fd, &ev, 1, NULL, 0, NULL) == -1)
-		throw (SCEM_KEVENT);
-
-	return (kq_fd);
-	#else
-	int ep_fd = -1;
-	epoll_event ev;
-	(void) std::memset(&ev, 0, sizeof(ev));
-
-	ep_fd = epoll_create1(0);
-	if (-1 == ep_fd)
-		throw (SCEM_EPOLL_CREATE);
-
-	ev.events = EPOLLIN;
-	ev.data.fd = listen_sock_fd;
-	if (-1 == epoll_ctl(ep_fd, EPOLL_CTL_ADD, listen_sock_fd, &ev))
-		throw (SCEM_EPOLL_CTL);
+	for (std::vector<Config::ListenSpec>::const_iterator spec = specs.begin(); spec != specs.end(); spec++)
+	{
+		std::vector<Listener>::const_iterator i = listeners.begin();
 
-	return (ep_fd);
-	#endif
+		while (i != listeners.end() && (i->spec.address != spec->address || i->spec.port != spec->port))
+			i++;
+		if (i != listeners.end())
+			continue ;
+		listener.fd = listen_sock_init(*spec);
+		listener.spec = *spec;
+		listeners.push_back(listener);
+		std::cout << "Listening on " << spec->address << " port " << spec->port << "\n";
+	}
 }
 
-void accept_in_conns(App &app, int epoll_fd, int listen_sock_fd)
+Listener const *find_listener(std::vector<Listener> const &listeners, int fd)
 {
-	#ifdef __APPLE__
-	struct kevent ev;
-	(void) std::memset(&ev, 0, sizeof(ev));
+	for (std::vector<Listener>::const_iterator i = listeners.begin(); i != listeners.end(); i++)
+	{
+		if (i->fd == fd)
+			return &*i;
+	}
+	return NULL;
+}
 
-	int conn_sock_fd = accept(listen_sock_fd, NULL, NULL);
-	if (-1 == conn_sock_fd)
-		throw (SCEM_ACCEPT);
+/*
+Starts connecting to the peer of a link block. The socket is non-blocking
+from the start, so the connect is usually still in progress on return;
+flush_conn() sees it complete.
+*/
+int connect_sock_init(Config::LinkSpec const &spec)
+{
+	int sock_fd = -1;
+	struct addrinfo hints;
+	struct addrinfo *ai = NULL;
+	std::ostringstream port;
+	(void) std::memset(&hints, 0, sizeof(hints));
+
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+	port << spec.port;
+	if (getaddrinfo(spec.address.c_str(), port.str().c_str(), &hints, &ai) != 0)
+		throw (IEC_BADADDR);
+
+	sock_fd = socket(ai->ai_family, SOCK_STREAM, 0);
+	if (-1 == sock_fd)
+	{
+		freeaddrinfo(ai);
+		throw (SCEM_SOCKET);
+	}
 
-	if (fcntl(conn_sock_fd, F_SETFL, O_NONBLOCK) == -1)
+	if (fcntl(sock_fd, F_SETFL, O_NONBLOCK) == -1)
+	{
+		freeaddrinfo(ai);
+		close(sock_fd);
 		throw (SCEM_FCNTL);
+	}
 
-	EV_SET(&ev, conn_sock_fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, NULL);
-	if (kevent(epoll_fd, &ev, 1, NULL, 0, NULL) == -1)
-		throw (SCEM_KEVENT);
-	#else
-	epoll_event ev;
-	(void) std::memset(&ev, 0, sizeof(ev));
-
-	int conn_sock_fd = accept4(listen_sock_fd, NULL, NULL, SOCK_NONBLOCK);	
-	if (-1 == conn_sock_fd)
-		throw (SCEM_ACCEPT4);
-
-	ev.events = EPOLLIN | EPOLLRDHUP | EPOLLHUP;
-	ev.data.fd = conn_sock_fd;
-	if (-1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn_sock_fd, &ev))
-		throw (SCEM_EPOLL_CTL);
-	#endif
+	if (-1 == connect(sock_fd, ai->ai_addr, ai->ai_addrlen) && errno != EINPROGRESS)
+	{
+		freeaddrinfo(ai);
+		close(sock_fd);
+		throw (SCEM_CONNECT);
+	}
+	freeaddrinfo(ai);
 
-	Client *client = new Client(app, conn_sock_fd);
-	app.add_client(client);
+	return (sock_fd);
+}
 
-	std::cout << "ACCEPT'ed new connection and created new client with uuid:" << client->pretty_uuid() << " and fd:"
-		<< client->get_fd() << "\n";
+void poller_init(Poller &poller, std::vector<Listener> const &listeners)
+{
+	poller.open();
+	for (std::vector<Listener>::const_iterator i = listeners.begin(); i != listeners.end(); i++)
+		poller.add(i->fd);
 }
 
-void handle_msg(App &app, Client *client)
+/*
+Accepts up to the listener's accept budget, so that a flood on one
+listener cannot starve the others or the established connections.
+*/
+void accept_in_conns(App &app, Listener const &listener)
 {
-	char buff[MAX_MSG_SIZE];
-	std::string msg = client->get_msg_buff();
-	ssize_t bytes_read;
-	size_t crlf_indx;
-	Message message;
-
-	do
-	{
-		std::memset(buff, 0, sizeof buff);
-		bytes_read = recv(client->get_fd(), buff, sizeof buff, 0);
-		std::cout << "RECV chars from uuid:" << client->pretty_uuid() << " ->" << buff
-			<< (std::strchr(buff, '\n') ? "" : "\n") ;
-		if (-1 ==  bytes_read)
-			throw (SCEM_RECV);
-		if (0 == bytes_read)
+	for (long n = 0; n < listener.spec.accept_budget; n++)
+	{
+		#ifdef __APPLE__
+		int conn_sock_fd = accept(listener.fd, NULL, NULL);
+		if (-1 == conn_sock_fd && (errno == EAGAIN || errno == EWOULDBLOCK))
 			return ;
-		msg.append(buff);
-		crlf_indx = msg.find(CRLF);
+		if (-1 == conn_sock_fd)
+			throw (SCEM_ACCEPT);
+
+		if (fcntl(conn_sock_fd, F_SETFL, O_NONBLOCK) == -1)
+			throw (SCEM_FCNTL);
+		#else
+		int conn_sock_fd = accept4(listener.fd, NULL, NULL, SOCK_NONBLOCK);
+		if (-1 == conn_sock_fd && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return ;
+		if (-1 == conn_sock_fd)
+			throw (SCEM_ACCEPT4);
+		#endif
 
-		if ((crlf_indx == msg.npos && msg.size() >= MAX_MSG_SIZE)
-				|| (crlf_indx != msg.npos && crlf_indx > MAX_MSG_SIZE - 2))
+		Client *client = new Client(app, conn_sock_fd);
+		if (!app.add_client(client))
 		{
-			msg.erase(MAX_MSG_SIZE);
-			std::cout << "Completed msg from uuid:" << client->pretty_uuid() << " ->" << msg << "\n";
-			if (-1 == app.parse_message(*client, msg, message))
-				std::cerr << "Cannot parse message from uuid:" << client->pretty_uuid() << " ->" << msg << "\n";
-			else
-			{
-				std::cout << "EXEC msg from uuid:" << client->pretty_uuid() << " ->" << msg << "\n";
-				app.execute_message(*client, message);
-			}
-			msg.clear();
+			std::cerr << "Refused connection on fd " << conn_sock_fd << ": too many clients\n";
+			delete client;
+			close(conn_sock_fd);
 			continue ;
 		}
+		client->set_class(app.find_class(listener.spec.class_name));
+		app.poller.add_connection(conn_sock_fd, client->get_uuid());
+		app.recorder->record_open(client->get_uuid(), listener.spec.port);
 
-		while (not msg.empty() && crlf_indx != msg.npos)
-		{
-			std::string msg_substr = msg.substr(0, crlf_indx);
-			std::cout << "Completed msg from uuid:" << client->pretty_uuid() << " ->" << msg_substr << "\n";
-
-			if (-1 == app.parse_message(*client, msg_substr, message))
-				std::cerr << "Cannot parse message from uuid:" << client->pretty_uuid() << " ->" << msg_substr << "\n";
-			else
-			{
-				std::cout << "EXEC msg from uuid:" << client->pretty_uuid() << " ->" << msg_substr << "\n";
-				app.execute_message(*client, message);
-			}
-			msg.erase(0, crlf_indx + 2);
-			crlf_indx = msg.find(CRLF);
-		}
+		std::cout << "ACCEPT'ed new connection and created new client with uuid:" << client->pretty_uuid() << " and fd:"
+			<< client->get_fd() << "\n";
 	}
-	while (crlf_indx != msg.npos);
-	client->set_msg_buff(msg);
 }
 
-void close_conn_by_fd(App &app, int fd)
+/*
+The receive buffer is owned by the App and shared by all clients. The
+client's leftover partial line goes first, recv appends up to
+recv_buffer_size bytes after it, and the lines are run in place; one
+extra byte keeps the new data NUL-terminated for logging.
+*/
+void handle_msg(App &app, Client *client)
 {
-	Client *client = app.find_client_by_fd(fd);
-	handle_msg(app, client);
-	close(fd);
-	std::cout << "Peer with uuid:" << client->pretty_uuid() << " closed the connection.\n";
-	app.remove_client(client->get_uuid());
+	std::vector<char> &buff = app.input_buffer;
+	std::string const &leftover = client->get_msg_buff();
+	size_t const kept = leftover.size();
+	ssize_t bytes_read;
+
+	if (app.draining || client->is_closing())
+		return discard_input(app, client);
+	if (buff.size() < kept + app.config.recv_buffer_size + 1)
+		buff.resize(kept + app.config.recv_buffer_size + 1);
+	std::copy(leftover.begin(), leftover.end(), buff.begin());
+	bytes_read = app.transport->recv(client->get_fd(), &buff[kept], app.config.recv_buffer_size);
+	if (-1 == bytes_read && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return ;
+	if (-1 ==  bytes_read)
+		throw (SCEM_RECV);
+	buff[kept + bytes_read] = '\0';
+	std::cout << "RECV chars from uuid:" << client->pretty_uuid() << " ->" << &buff[kept]
+		<< (std::strchr(&buff[kept], '\n') ? "" : "\n") ;
+	if (0 == bytes_read)
+		return ;
+	app.recorder->record_data(client->get_uuid(), &buff[kept], bytes_read);
+	app.run_input(*client, &buff[0], kept + bytes_read);
 }
 
-void close_conn_by_uuid(App &app, uint32 uuid)
+/*
+While draining, or once a client quit, input is read only so that
+closing the socket later does not reset the connection over unread data.
+*/
+void discard_input(App &app, Client *client)
 {
-	Client *client = app.get_client(uuid);
-	handle_msg(app, client);
-	close(client->get_fd());
-	std::cout << "Closed connection to peer with uuid:" << client->pretty_uuid() << ".\n";
-	app.remove_client(client->get_uuid());
+	std::vector<char> &buff = app.input_buffer;
+
+	if (buff.size() < static_cast<size_t>(app.config.recv_buffer_size))
+		buff.resize(app.config.recv_buffer_size);
+	while (app.transport->recv(client->get_fd(), &buff[0], buff.size()) > 0)
+		;
 }
 
-static void signal_handler(int sig)
+/*
+A link still connecting learns here whether the connect succeeded.
+*/
+void flush_conn(Client &client)
 {
-	if (sig == SIGQUIT || sig == SIGINT)
+	socklen_t len = sizeof(int);
+	int error = 0;
+
+	if (client.is_connecting())
 	{
-		extern int g_listen_sock_fd;
-		extern App *g_app;
-		if (g_app)
-			g_app->~App();
-		if (g_listen_sock_fd > 0)
-			close(g_listen_sock_fd);
-		std::cout << "Server has exited.\n";
-		std::exit(0);
+		if (-1 == getsockopt(client.get_fd(), SOL_SOCKET, SO_ERROR, &error, &len))
+			error = errno;
+		if (error)
+		{
+			std::cerr << "Link to uuid:" << client.pretty_uuid() << " failed: " << std::strerror(error) << "\n";
+			return client.request_close();
+		}
+		client.set_connecting(false);
 	}
+	client.flush_output();
+}
+
+void close_conn(App &app, Client &client)
+{
+	handle_msg(app, &client);
+	app.poller.remove(client.get_fd());
+	close(client.get_fd());
+	std::cout << "Peer with uuid:" << client.pretty_uuid() << " closed the connection.\n";
+	app.remove_client(client.get_uuid());
 }
 
+// ============================
+//           Signals
+// ============================
+
+static int const loop_signals[] = {SIGINT, SIGQUIT, SIGTERM, SIGHUP, SIGUSR2};
+static size_t const loop_signal_count = sizeof(loop_signals) / sizeof(loop_signals[0]);
+
+/*
+No handler runs in signal context: the signals conn_loop cares about are
+blocked (ignored with kqueue, which still reports them) and come in as
+events instead, see signal_fd_init().
+*/
 void setup_signal_handlers(void)
 {
 	struct sigaction sa;
 	std::memset(&sa, 0, sizeof(sa));
 
-	sa.sa_handler = &signal_handler;
-
-	if (-1 == sigaction(SIGINT, &sa, NULL))
-		throw(SCEM_SIGACT);
-	if (-1 == sigaction(SIGQUIT, &sa, NULL))
+	sa.sa_handler = SIG_IGN;
+	if (-1 == sigaction(SIGPIPE, &sa, NULL))
 		throw(SCEM_SIGACT);
+
+	#ifdef __APPLE__
+	for (size_t i = 0; i < loop_signal_count; i++)
+	{
+		if (-1 == sigaction(loop_signals[i], &sa, NULL))
+			throw(SCEM_SIGACT);
+	}
+	#else
+	sigset_t mask;
+
+	sigemptyset(&mask);
+	for (size_t i = 0; i < loop_signal_count; i++)
+		sigaddset(&mask, loop_signals[i]);
+	if (-1 == sigprocmask(SIG_BLOCK, &mask, NULL))
+		throw(SCEM_SIGPROCMASK);
+	#endif
+}
+
+/*
+Registers the blocked signals with the poller. Returns the signalfd,
+or -1 with kqueue, where the events carry the signal number themselves.
+*/
+int signal_fd_init(Poller &poller)
+{
+	#ifdef __APPLE__
+	for (size_t i = 0; i < loop_signal_count; i++)
+		poller.add_signal(loop_signals[i]);
+	return (-1);
+	#else
+	sigset_t mask;
+	int sig_fd;
+
+	sigemptyset(&mask);
+	for (size_t i = 0; i < loop_signal_count; i++)
+		sigaddset(&mask, loop_signals[i]);
+	sig_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (-1 == sig_fd)
+		throw (SCEM_SIGNALFD);
+	try
+	{
+		poller.add(sig_fd);
+	}
+	catch (scem_function)
+	{
+		close(sig_fd);
+		throw ;
+	}
+	return (sig_fd);
+	#endif
+}
+
+void note_signal(int sig, SignalRequests &requests)
+{
+	if (sig == SIGHUP)
+		requests.reload = true;
+	else if (sig == SIGUSR2)
+		requests.upgrade = true;
+	else
+		requests.shutdown = true;
+}
+
+#ifndef __APPLE__
+void read_signals(int sig_fd, SignalRequests &requests)
+{
+	struct signalfd_siginfo info;
+
+	while (read(sig_fd, &info, sizeof(info)) == static_cast<ssize_t>(sizeof(info)))
+		note_signal(info.ssi_signo, requests);
+}
+#endif
+
+/*
+Stops accepting and queues a closing notice for every connection. From
+here on conn_loop only drains the output queues.
+*/
+void begin_shutdown(App &app, std::vector<Listener> &listeners)
+{
+	std::vector<Client *> clients = app.get_clients();
+
+	for (std::vector<Listener>::const_iterator i = listeners.begin(); i != listeners.end(); i++)
+	{
+		app.poller.remove(i->fd);
+		close(i->fd);
+	}
+	listeners.clear();
+	app.draining = true;
+	for (std::vector<Client *>::const_iterator i = clients.begin(); i != clients.end(); i++)
+	{
+		if ((*i)->get_fd() != -1 && !(*i)->is_remote())
+			(*i)->send_message("ERROR :Closing link (Server shutting down)");
+	}
+	std::cout << "Shutting down, draining output of " << clients.size() << " connections.\n";
 }
@@ -1,69 +1,96 @@
+#include <algorithm>
 #include <cerrno>
 #include <cstring>
 #include <iostream>
-#ifdef __APPLE__
-#include <sys/event.h>
-#else
-#include <sys/epoll.h>
-#endif
+#include <ctime>
 #include <unistd.h>
+#include <vector>
 #include "App.hpp"
 #include "InternalError.hpp"
 #include "SystemCallErrorMessage.hpp"
+#include "ServerLink.hpp"
 #include "connection.hpp"
+#include "upgrade.hpp"
 
-int g_listen_sock_fd = -1;
-App *g_app = NULL;
+static long monotonic_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
 
-void conn_loop(App &app, int listen_sock_fd)
+/*
+Signals come in as poll events and are acted on after each turn: a
+reload, an upgrade, or a shutdown that drains the output queues until
+they are empty or shutdown_drain_ms has passed. A second shutdown
+signal skips the drain.
+*/
+void conn_loop(App &app, std::vector<Listener> &listeners, char **argv)
 {
-	g_app = &app;
+	SignalRequests requests = {false, false, false};
+	long drain_deadline = 0;
+	int timeout_ms;
 	int nfds = 0;
-	#ifdef __APPLE__
-	struct kevent events[ConnConst::max_events];
-	#else
-	struct epoll_event events[ConnConst::max_events];
-	#endif
-	(void) std::memset(events, 0, sizeof(events));
 
-	int epoll_fd = epoll_init(listen_sock_fd);
+	poller_init(app.poller, listeners);
+	int signal_fd = signal_fd_init(app.poller);
+
+	std::vector<Client *> restored = app.get_clients();
+	for (std::vector<Client *>::const_iterator i = restored.begin(); i != restored.end(); i++)
+	{
+		app.poller.add_connection((*i)->get_fd(), (*i)->get_uuid());
+		(*i)->flush_output();
+	}
 
 	for (;;)
 	{
-		#ifdef __APPLE__
-		nfds = kevent(epoll_fd, NULL, 0, events, ConnConst::max_events, NULL);
-		if (-1 == nfds)
-			throw (SCEM_KEVENT);
-		#else
-		nfds = epoll_wait(epoll_fd, events, ConnConst::max_events, ConnConst::time_out_ms);
-		if (-1 == nfds)
-			throw (SCEM_EPOLL_WAIT);
-		#endif
+		timeout_ms = app.get_poll_timeout();
+		if (app.draining)
+		{
+			long left = std::max(0L, drain_deadline - monotonic_ms());
+
+			if (timeout_ms < 0 || left < timeout_ms)
+				timeout_ms = left;
+		}
+		nfds = app.poller.wait(timeout_ms, app.config.max_events);
+
+		app.run_timers();
 
 		for (int i = 0; i < nfds; ++i)
 		{
-			#ifdef __APPLE__
-			int fd = events[i].ident;
-			int filter = events[i].filter;
-			bool is_hup = events[i].flags & EV_EOF;
-			#else
-			int fd = events[i].data.fd;
-			bool is_hup = events[i].events & (EPOLLHUP | EPOLLRDHUP);
+			Poller::Event const &event = app.poller.get_event(i);
+			int fd = event.fd;
+
+			if (event.signal)
+			{
+				note_signal(fd, requests);
+				continue ;
+			}
+			#ifndef __APPLE__
+			if (fd == signal_fd)
+			{
+				read_signals(signal_fd, requests);
+				continue ;
+			}
 			#endif
 
+			/* the client of a connection closed earlier in this batch is gone: its uuid is stale */
+			Listener const *listener = event.owner ? NULL : find_listener(listeners, fd);
+			Client *client = event.owner ? app.get_client(event.owner) : NULL;
+
 			try
 			{
-				if (fd == listen_sock_fd)
-					accept_in_conns(app, epoll_fd, listen_sock_fd);
-				else if (is_hup)
-					close_conn_by_fd(app, fd);
-				#ifdef __APPLE__
-				else if (filter == EVFILT_READ)
-					handle_msg(app, app.find_client_by_fd(fd));
-				#else
-				else if (events[i].events & EPOLLIN)
-					handle_msg(app, app.find_client_by_fd(fd));
-				#endif
+				if (listener)
+					accept_in_conns(app, *listener);
+				if (!client)
+					continue ;
+				if (event.writable)
+					flush_conn(*client);
+				if (event.hangup)
+					close_conn(app, *client);
+				else if (event.readable)
+					handle_msg(app, client);
 			}
 			catch (scem_function sf)
 			{
@@ -75,9 +102,42 @@ void conn_loop(App &app, int listen_sock_fd)
 				std::cerr << "Error while manupulating strings" << e.what() << "\n";
 			}
 		}
+		app.sync_channel_store();
+
+		if (requests.reload)
+		{
+			requests.reload = false;
+			app.reload_config();
+		}
+
+		if (requests.upgrade && !app.draining)
+		{
+			requests.upgrade = false;
+			if (upgrade_server(app, listeners, argv))
+				break ;
+		}
+
+		if (requests.shutdown)
+		{
+			requests.shutdown = false;
+			if (app.draining)
+				break ;
+			begin_shutdown(app, listeners);
+			drain_deadline = monotonic_ms() + app.config.shutdown_drain_ms;
+		}
+
+		if (app.draining && (!app.has_pending_output() || monotonic_ms() >= drain_deadline))
+		{
+			std::cout << "Server has exited.\n";
+			break ;
+		}
 	}
 
-	close(listen_sock_fd);
+	if (signal_fd != -1)
+		close(signal_fd);
+	app.poller.close();
+	for (std::vector<Listener>::const_iterator i = listeners.begin(); i != listeners.end(); i++)
+		close(i->fd);
 }
 
 int main(int argc, char **argv)
@@ -85,19 +145,33 @@ int main(int argc, char **argv)
 	try
 	{
 		setup_signal_handlers();
-		if (argc != 3)
+		if (argc != 3 && argc != 4)
 			throw (IEC_BADARGC);
 
 		std::string password(argv[2]);
 		if (password.size() < 4 || password.size() > 32)
 			throw (IEC_BADPASS);
 
-		int listen_sock_fd = listen_sock_init(parse_port(argv[1]));
-		g_listen_sock_fd = listen_sock_fd;
+		int port = parse_port(argv[1]);
+		Config config;
+		if (argc == 4)
+			config.load(argv[3]);
+		std::vector<Config::ListenSpec> specs = config.get_listeners(port);
+		std::vector<Listener> listeners;
+		int upgrade_fd = get_upgrade_fd();
+		if (upgrade_fd == -1)
+			open_listeners(specs, listeners);
+
+		App app("127.0.0.1", password, config);
+		app.server_id = ServerLink::make_server_id(port);
 
-		App app("127.0.0.1", password);
+		if (upgrade_fd != -1)
+			listeners = resume_from_upgrade(app, upgrade_fd, specs);
+		else
+			app.load_saved_channels();
+		app.start_channel_journal();
 
-		conn_loop(app, listen_sock_fd);
+		conn_loop(app, listeners, argv);
 
 	}
 	catch (internal_error_code iec)
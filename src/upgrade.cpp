@@ -0,0 +1,330 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "App.hpp"
+#include "InternalError.hpp"
+#include "Recorder.hpp"
+#include "StateCodec.hpp"
+#include "SystemCallErrorMessage.hpp"
+#include "connection.hpp"
+#include "upgrade.hpp"
+
+/*
+Handoff protocol over a socketpair shared with the exec'd binary:
+	header   magic, version, payload size, fd count (u32 each)
+	payload  listener count, address and port of each listener,
+	         then App::serialize_state()
+	fds      listen sockets followed by client sockets, sent in batches
+	         of UpgradeConst::fds_per_msg, each batch carried by one byte
+	ack      one 'R' byte written back once the new process owns the state
+*/
+
+// ============================
+//       Socket helpers
+// ============================
+
+static void write_all(int fd, char const *data, size_t size)
+{
+	ssize_t written;
+
+	while (size > 0)
+	{
+		written = write(fd, data, size);
+		if (written == -1 && errno == EINTR)
+			continue ;
+		if (written == -1)
+			throw (SCEM_SENDMSG);
+		data += written;
+		size -= written;
+	}
+}
+
+static void read_all(int fd, char *data, size_t size)
+{
+	ssize_t bytes_read;
+
+	while (size > 0)
+	{
+		bytes_read = read(fd, data, size);
+		if (bytes_read == -1 && errno == EINTR)
+			continue ;
+		if (bytes_read == -1)
+			throw (SCEM_RECVMSG);
+		if (bytes_read == 0)
+			throw (IEC_BADSTATE);
+		data += bytes_read;
+		size -= bytes_read;
+	}
+}
+
+static void send_fds(int sock_fd, std::vector<int> const &fds)
+{
+	char byte = 'F';
+	size_t sent = 0;
+
+	while (sent < fds.size())
+	{
+		size_t batch = std::min(fds.size() - sent, static_cast<size_t>(UpgradeConst::fds_per_msg));
+		std::vector<char> control(CMSG_SPACE(batch * sizeof(int)), 0);
+		struct iovec iov;
+		struct msghdr msg;
+		struct cmsghdr *cmsg;
+
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		std::memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = &control[0];
+		msg.msg_controllen = control.size();
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(batch * sizeof(int));
+		std::memcpy(CMSG_DATA(cmsg), &fds[sent], batch * sizeof(int));
+
+		if (-1 == sendmsg(sock_fd, &msg, 0))
+		{
+			if (errno == EINTR)
+				continue ;
+			throw (SCEM_SENDMSG);
+		}
+		sent += batch;
+	}
+}
+
+static void recv_fds(int sock_fd, size_t count, std::vector<int> &fds)
+{
+	char byte;
+
+	while (fds.size() < count)
+	{
+		size_t batch = std::min(count - fds.size(), static_cast<size_t>(UpgradeConst::fds_per_msg));
+		std::vector<char> control(CMSG_SPACE(batch * sizeof(int)), 0);
+		struct iovec iov;
+		struct msghdr msg;
+		struct cmsghdr *cmsg;
+		ssize_t bytes_read;
+
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		std::memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = &control[0];
+		msg.msg_controllen = control.size();
+
+		bytes_read = recvmsg(sock_fd, &msg, 0);
+		if (bytes_read == -1 && errno == EINTR)
+			continue ;
+		if (bytes_read == -1)
+			throw (SCEM_RECVMSG);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		if (bytes_read == 0 || (msg.msg_flags & MSG_CTRUNC) || !cmsg
+				|| cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+				|| cmsg->cmsg_len != CMSG_LEN(batch * sizeof(int)))
+			throw (IEC_BADSTATE);
+		size_t first = fds.size();
+		fds.resize(first + batch);
+		std::memcpy(&fds[first], CMSG_DATA(cmsg), batch * sizeof(int));
+	}
+}
+
+static void put_header(StateWriter &out, uint32 payload_size, uint32 fd_count)
+{
+	out.put_u32(UpgradeConst::magic);
+	out.put_u32(UpgradeConst::version);
+	out.put_u32(payload_size);
+	out.put_u32(fd_count);
+}
+
+
+// ============================
+//        Old process
+// ============================
+
+/*
+Runs in the forked child: drops every inherited socket so that only the
+fds passed with SCM_RIGHTS survive in the new binary, then re-execs it.
+*/
+static void exec_new_binary(int handoff_fd, int poll_fd, std::vector<int> const &fds, char **argv)
+{
+	std::ostringstream oss;
+
+	for (std::vector<int>::const_iterator i = fds.begin(); i != fds.end(); i++)
+		close(*i);
+	close(poll_fd);
+	oss << handoff_fd;
+	setenv(UPGRADE_FD_ENV, oss.str().c_str(), 1);
+	execv(argv[0], argv);
+	std::cerr << "Upgrade: cannot exec " << argv[0] << ": " << std::strerror(errno) << "\n";
+	_exit(127);
+}
+
+/*
+Hands the listen sockets and every connection over to a freshly exec'd
+copy of the binary. Returns true once the new process has acknowledged
+the state; the caller must then stop serving without touching the sockets.
+On any failure the connections are still ours and serving goes on.
+*/
+bool upgrade_server(App &app, std::vector<Listener> const &listeners, char **argv)
+{
+	StateWriter header;
+	StateWriter payload;
+	std::vector<int> fds;
+	int sv[2];
+	pid_t pid;
+	char ack = 0;
+
+	if (app.has_links())
+	{
+		std::cerr << "Upgrade aborted: server links cannot be handed over, unlink the peer servers first\n";
+		return false;
+	}
+	std::cout << "Upgrade requested, handing connections over to " << argv[0] << "\n";
+	payload.put_u32(listeners.size());
+	for (std::vector<Listener>::const_iterator i = listeners.begin(); i != listeners.end(); i++)
+	{
+		payload.put_string(i->spec.address);
+		payload.put_u32(i->spec.port);
+		fds.push_back(i->fd);
+	}
+	app.end_pending_queries();
+	app.serialize_state(payload, fds);
+	app.recorder->flush();
+	app.sync_channel_store();
+	put_header(header, payload.data().size(), fds.size());
+
+	if (-1 == socketpair(AF_UNIX, SOCK_STREAM, 0, sv))
+	{
+		std::cerr << "Upgrade aborted: " << SystemCallErrorMessage::get_func_name(SCEM_SOCKETPAIR) << "\n";
+		return false;
+	}
+	pid = fork();
+	if (pid == -1)
+	{
+		std::cerr << "Upgrade aborted: " << SystemCallErrorMessage::get_func_name(SCEM_FORK) << "\n";
+		close(sv[0]);
+		close(sv[1]);
+		return false;
+	}
+	if (pid == 0)
+	{
+		close(sv[0]);
+		exec_new_binary(sv[1], app.poller.get_fd(), fds, argv);
+	}
+	close(sv[1]);
+
+	try
+	{
+		write_all(sv[0], header.data().data(), header.data().size());
+		write_all(sv[0], payload.data().data(), payload.data().size());
+		send_fds(sv[0], fds);
+		read_all(sv[0], &ack, 1);
+	}
+	catch (scem_function sf)
+	{
+		std::cerr << "Upgrade aborted: " << SystemCallErrorMessage::get_func_name(sf) << "\n";
+	}
+	catch (internal_error_code)
+	{
+		std::cerr << "Upgrade aborted: new process exited before taking over\n";
+	}
+	close(sv[0]);
+
+	if (ack != 'R')
+	{
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return false;
+	}
+	std::cout << "Upgrade complete, " << fds.size() - listeners.size() << " connections handed over to pid " << pid << "\n";
+	return true;
+}
+
+
+// ============================
+//        New process
+// ============================
+
+int get_upgrade_fd(void)
+{
+	char const *value = std::getenv(UPGRADE_FD_ENV);
+	int fd;
+
+	if (!value)
+		return -1;
+	fd = std::atoi(value);
+	unsetenv(UPGRADE_FD_ENV);
+	return fd > 2 ? fd : -1;
+}
+
+/*
+Rebuilds the App from the parent's state and returns the inherited
+listeners that are still configured, with their new settings (socket
+options stay as the old process set them), along with the new ones.
+Listeners dropped from the config are closed. The new listeners are
+opened before the parent is told to go: if one cannot be opened, this
+process fails and the parent keeps serving.
+*/
+std::vector<Listener> resume_from_upgrade(App &app, int upgrade_fd, std::vector<Config::ListenSpec> const &specs)
+{
+	char header_buff[16];
+	std::vector<char> payload;
+	std::vector<int> fds;
+	std::vector<Listener> listeners;
+	Listener listener;
+	uint32 payload_size;
+	uint32 fd_count;
+	uint32 listener_count;
+
+	read_all(upgrade_fd, header_buff, sizeof(header_buff));
+	StateReader header(header_buff, sizeof(header_buff));
+	if (header.get_u32() != UpgradeConst::magic || header.get_u32() != UpgradeConst::version)
+		throw (IEC_BADSTATE);
+	payload_size = header.get_u32();
+	fd_count = header.get_u32();
+
+	payload.resize(payload_size + 1);
+	read_all(upgrade_fd, &payload[0], payload_size);
+	recv_fds(upgrade_fd, fd_count, fds);
+
+	StateReader reader(&payload[0], payload_size);
+	listener_count = reader.get_u32();
+	if (listener_count > fd_count)
+		throw (IEC_BADSTATE);
+	for (uint32 i = 0; i < listener_count; i++)
+	{
+		std::string address = reader.get_string();
+		int port = reader.get_u32();
+		std::vector<Config::ListenSpec>::const_iterator spec = specs.begin();
+
+		while (spec != specs.end() && (spec->address != address || spec->port != port))
+			spec++;
+		if (spec == specs.end())
+		{
+			std::cout << "Closing listener " << address << " port " << port << ", no longer configured\n";
+			close(fds[i]);
+			continue ;
+		}
+		listener.fd = fds[i];
+		listener.spec = *spec;
+		listeners.push_back(listener);
+	}
+	app.restore_state(reader, std::vector<int>(fds.begin() + listener_count, fds.end()));
+	if (!reader.at_end())
+		throw (IEC_BADSTATE);
+	open_listeners(specs, listeners);
+
+	write_all(upgrade_fd, "R", 1);
+	close(upgrade_fd);
+	std::cout << "Resumed " << fd_count - listener_count << " connections from the previous process\n";
+	return listeners;
+}